@@ -0,0 +1,747 @@
+// Microbenchmarks for chunky internals. Where an implementation has
+// been replaced, the previous implementation is reproduced here for
+// comparison.
+//
+// Usage: benchmark [name...]
+// With no arguments all benchmarks are run.
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <sstream>
+#include <map>
+#include <thread>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/format.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include "chunky.hpp"
+
+using namespace chunky;
+
+// Request heads captured from common clients.
+static const std::vector<std::string> requestHeads = {
+   // Chrome page load.
+   "GET /dashboard/index.html?tab=overview&range=24h HTTP/1.1\r\n"
+   "Host: controlpanel.local:8800\r\n"
+   "Connection: keep-alive\r\n"
+   "Cache-Control: max-age=0\r\n"
+   "Upgrade-Insecure-Requests: 1\r\n"
+   "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_11_1) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/46.0.2490.86 Safari/537.36\r\n"
+   "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+   "Accept-Encoding: gzip, deflate, sdch\r\n"
+   "Accept-Language: en-US,en;q=0.8\r\n"
+   "Cookie: session=4f6e2c1a9b8d7e3f; theme=dark; _ga=GA1.2.1234567890.1447000000\r\n"
+   "\r\n",
+
+   // Firefox XHR.
+   "GET /api/status.json HTTP/1.1\r\n"
+   "Host: controlpanel.local:8800\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:42.0) Gecko/20100101 Firefox/42.0\r\n"
+   "Accept: application/json, text/javascript, */*; q=0.01\r\n"
+   "Accept-Language: en-US,en;q=0.5\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "X-Requested-With: XMLHttpRequest\r\n"
+   "Referer: http://controlpanel.local:8800/dashboard/index.html\r\n"
+   "Connection: keep-alive\r\n"
+   "\r\n",
+
+   // Form POST.
+   "POST /settings HTTP/1.1\r\n"
+   "Host: controlpanel.local:8800\r\n"
+   "Content-Type: application/x-www-form-urlencoded\r\n"
+   "Content-Length: 42\r\n"
+   "Origin: http://controlpanel.local:8800\r\n"
+   "Referer: http://controlpanel.local:8800/settings\r\n"
+   "\r\n",
+
+   // curl.
+   "GET /metrics HTTP/1.1\r\n"
+   "Host: localhost:8800\r\n"
+   "User-Agent: curl/7.43.0\r\n"
+   "Accept: */*\r\n"
+   "\r\n"
+};
+
+template<typename F>
+static void run(const std::string& name, size_t nIterations, F f) {
+   const auto t0 = std::chrono::steady_clock::now();
+   for (size_t i = 0; i < nIterations; ++i)
+      f();
+   const auto t1 = std::chrono::steady_clock::now();
+
+   const double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+   std::cout << boost::format("%-40s %10.1f ns/op\n") % name % (ns / nIterations);
+}
+
+// Request head processing as implemented with std::regex before
+// RequestParser.
+namespace regex_head {
+   struct CaselessCompare {
+      bool operator()(const std::string& a,const std::string& b) const {
+         return boost::ilexicographical_compare(a,b);
+      }
+   };
+   typedef std::map<std::string, std::string, CaselessCompare> Headers;
+
+   struct Request {
+      std::string method;
+      std::string resource;
+      std::string version;
+      std::string path;
+      std::string fragment;
+      Headers headers;
+   };
+
+   static std::string get_line(const std::string& head, size_t& position) {
+      const auto end = head.find("\r\n", position);
+      std::string s(head, position, end - position);
+      position = end + 2;
+      return s;
+   }
+
+   static bool parse(const std::string& head, Request& request) {
+      size_t position = 0;
+      std::smatch requestMatch;
+      static const std::regex requestRegex("([-!#$%^&*+._'`|~0-9A-Za-z]+) (\\S+) (HTTP/\\d\\.\\d)");
+      const std::string line = get_line(head, position);
+      if (!std::regex_match(line, requestMatch, requestRegex))
+         return false;
+
+      request.method   = requestMatch[1];
+      request.resource = requestMatch[2];
+      request.version  = requestMatch[3];
+      if (request.version != "HTTP/1.1")
+         return false;
+
+      std::smatch resourceMatch;
+      static const std::regex resourceRegex("(/[^?#]*)(?:\\?([^#]*))?(?:#(.*))?");
+      if (std::regex_match(request.resource, resourceMatch, resourceRegex)) {
+         request.path = resourceMatch[1];
+         request.fragment = resourceMatch[3];
+      }
+
+      for (auto s = get_line(head, position); !s.empty(); s = get_line(head, position)) {
+         const auto colon = s.find_first_of(':');
+         if (colon == std::string::npos)
+            return false;
+
+         std::string key = s.substr(0, colon);
+         std::string value = s.substr(colon + 1);
+         boost::algorithm::trim_left(value);
+
+         const auto i = request.headers.find(key);
+         if (i != request.headers.end()) {
+            i->second += ", ";
+            i->second += value;
+         }
+         else
+            request.headers.insert({{std::move(key), std::move(value)}});
+      }
+      return true;
+   }
+}
+
+static void request_head() {
+   const size_t nIterations = 200000;
+
+   run("request head: regex", nIterations, []() {
+         for (const auto& head : requestHeads) {
+            regex_head::Request request;
+            if (!regex_head::parse(head, request))
+               throw std::runtime_error("regex parse failed");
+         }
+      });
+
+   detail::RequestParser parser;
+   run("request head: RequestParser", nIterations, [&]() {
+         for (const auto& head : requestHeads) {
+            parser.reset();
+            if (parser.parse(head.data(), head.size()) != detail::RequestParser::complete)
+               throw std::runtime_error("parse failed");
+         }
+      });
+
+   // Include building the same strings and header map as the regex
+   // implementation.
+   run("request head: RequestParser + std::map", nIterations, [&]() {
+         for (const auto& head : requestHeads) {
+            parser.reset();
+            if (parser.parse(head.data(), head.size()) != detail::RequestParser::complete)
+               throw std::runtime_error("parse failed");
+
+            regex_head::Request request;
+            request.method.assign(head, parser.method().offset, parser.method().size);
+            request.resource.assign(head, parser.resource().offset, parser.resource().size);
+            request.version.assign(head, parser.version().offset, parser.version().size);
+            for (const auto& field : parser.fields()) {
+               request.headers.insert({{
+                     head.substr(field.name.offset, field.name.size),
+                     head.substr(field.value.offset, field.value.size) }});
+            }
+         }
+      });
+
+   // Include building the request as HTTPTransaction does.
+   run("request head: RequestParser + HeaderMap", nIterations, [&]() {
+         for (const auto& head : requestHeads) {
+            parser.reset();
+            if (parser.parse(head.data(), head.size()) != detail::RequestParser::complete)
+               throw std::runtime_error("parse failed");
+
+            std::string method, resource, version;
+            method.assign(head, parser.method().offset, parser.method().size);
+            resource.assign(head, parser.resource().offset, parser.resource().size);
+            version.assign(head, parser.version().offset, parser.version().size);
+
+            detail::Arena arena;
+            HTTP::RequestHeaders headers;
+            detail::add_fields(headers, arena, head.data(), parser);
+         }
+      });
+
+   // Deliver each head in 16 byte reads to exercise resumption.
+   run("request head: RequestParser (16B reads)", nIterations, [&]() {
+         for (const auto& head : requestHeads) {
+            parser.reset();
+            for (size_t n = 16; parser.parse(head.data(), std::min(n, head.size())) != detail::RequestParser::complete; n += 16) {
+               if (n >= head.size())
+                  throw std::runtime_error("parse failed");
+            }
+         }
+      });
+}
+
+static void scan_delimiters() {
+   const size_t nIterations = 200000;
+
+   std::string heads;
+   for (const auto& head : requestHeads)
+      heads += head;
+   heads.resize(heads.size() + detail::ScanBlockSize - heads.size() % detail::ScanBlockSize);
+
+   std::vector<std::pair<std::string, detail::ScanDelimitersFunc> > scans = {
+      { "scan delimiters: scalar", &detail::scan_delimiters_scalar }
+   };
+#ifdef CHUNKY_X86_SIMD
+   scans.push_back({ "scan delimiters: sse2", &detail::scan_delimiters_sse2 });
+   if (__builtin_cpu_supports("avx2"))
+      scans.push_back({ "scan delimiters: avx2", &detail::scan_delimiters_avx2 });
+#endif
+
+   uint64_t sum = 0;
+   for (const auto& scan : scans) {
+      run(scan.first, nIterations, [&]() {
+            for (size_t i = 0; i < heads.size(); i += detail::ScanBlockSize) {
+               uint64_t lf, colon;
+               scan.second(heads.data() + i, lf, colon);
+               sum += lf ^ colon;
+            }
+         });
+   }
+   if (!sum)
+      throw std::runtime_error("no delimiters found");
+}
+
+static void date() {
+   const size_t nIterations = 1000000;
+
+   // As prepare_write_prefix() formatted Date before DateCache.
+   run("date: gmtime + strftime", nIterations, []() {
+         std::time_t t;
+         std::time(&t);
+         std::tm tm = *std::gmtime(&t);
+         char s[30];
+         auto n = strftime(s, sizeof(s), "%a, %d %b %Y %T GMT", &tm);
+         if (n != detail::DateCache::Size)
+            throw std::runtime_error("strftime failed");
+      });
+
+   char s[detail::DateCache::Size];
+   run("date: DateCache", nIterations, [&]() {
+         detail::DateCache::instance().read(s);
+      });
+
+   // Keep a refresher registered so that reads do not check the
+   // clock, as when a server is running.
+   detail::DateCache::instance().add_refresher();
+   run("date: DateCache (server refreshing)", nIterations, [&]() {
+         detail::DateCache::instance().read(s);
+      });
+   detail::DateCache::instance().remove_refresher();
+}
+
+// Response head serialization as implemented with std::ostringstream
+// before the write buffer.
+namespace ostream_head {
+   static void write_status(std::ostream& os, unsigned int status) {
+      static std::map<unsigned int, std::string> reasons = {
+         { 200, "OK" },
+         { 404, "Not Found" }
+      };
+
+      auto reason = reasons.find(status);
+      os << boost::format("HTTP/1.1 %d %s%s")
+         % status
+         % (reason != reasons.end() ? reason->second : std::string())
+         % "\r\n";
+   }
+
+   static void write_headers(std::ostream& os, const HTTP::Headers& headers) {
+      for (const auto& value : headers) {
+         os << boost::format("%s: %s%s")
+            % value.first
+            % value.second
+            % "\r\n";
+      }
+      os << "\r\n";
+   }
+}
+
+static void response_head() {
+   const size_t nIterations = 1000000;
+
+   // A small response as a handler typically produces.
+   HTTP::Headers headers;
+   headers["Content-Type"] = "text/html";
+   headers["Transfer-Encoding"] = "chunked";
+   char date[detail::DateCache::Size];
+   detail::DateCache::instance().read(date);
+   const std::string body = "<title>OK</title><h1>OK</h1>";
+
+   run("response head: ostringstream", nIterations, [&]() {
+         std::ostringstream os;
+         ostream_head::write_status(os, 200);
+         os << "Date: ";
+         os.write(date, sizeof(date));
+         os << "\r\n";
+         ostream_head::write_headers(os, headers);
+         os << boost::format("%x%s") % body.size() % "\r\n";
+         auto prefix = std::make_shared<std::string>(os.str());
+
+         std::ostringstream suffixStream;
+         suffixStream << "\r\n";
+         auto suffix = std::make_shared<std::string>(suffixStream.str());
+         if (prefix->empty() || suffix->empty())
+            throw std::runtime_error("empty head");
+      });
+
+   std::vector<char> buffer;
+   run("response head: write buffer", nIterations, [&]() {
+         buffer.clear();
+         detail::append_status_line(buffer, 200);
+         detail::append(buffer, "Date: ");
+         detail::append(buffer, date, sizeof(date));
+         detail::append(buffer, "\r\n");
+         detail::append_fields(buffer, headers);
+         detail::append_hex(buffer, body.size());
+         detail::append(buffer, "\r\n");
+         detail::append(buffer, "\r\n");
+         if (buffer.empty())
+            throw std::runtime_error("empty head");
+      });
+}
+
+// Keep-alive request throughput with the server's io_service run on
+// 1..N threads, invoking handlers on the server strand (the default)
+// or on each connection's strand. Each client is a thread issuing
+// requests on one connection.
+static void server_threads() {
+   using boost::asio::ip::tcp;
+   const unsigned nCores = std::max(1u, std::thread::hardware_concurrency());
+   const std::string request("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+   for (int concurrent = 0; concurrent < 2; ++concurrent) {
+      for (unsigned nThreads = 1; nThreads <= nCores; nThreads *= 2) {
+         boost::asio::io_service io;
+         auto server = SimpleHTTPServer::create(io);
+         server->set_concurrent_dispatch(concurrent != 0);
+         server->set_handler("", [](const std::shared_ptr<HTTP>& http) {
+               // Stand-in for application work.
+               uint64_t x = 88172645463325252ull;
+               for (int i = 0; i < 20000; ++i) {
+                  x ^= x << 13;
+                  x ^= x >> 7;
+                  x ^= x << 17;
+               }
+
+               const std::string body(1, static_cast<char>('0' + (x & 1)));
+               http->response_status() = 200;
+               http->response_headers()["Content-Length"] = "1";
+               boost::asio::write(*http, boost::asio::buffer(body));
+               http->finish();
+            });
+         const auto port = server->listen(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+         std::vector<std::thread> threads;
+         for (unsigned i = 0; i < nThreads; ++i)
+            threads.emplace_back([&]() { io.run(); });
+
+         std::atomic<bool> stop(false);
+         std::atomic<size_t> nRequests(0);
+         std::vector<std::thread> clients;
+         for (unsigned i = 0; i < 2 * nThreads; ++i) {
+            clients.emplace_back([&]() {
+                  boost::asio::io_service clientIO;
+                  tcp::socket socket(clientIO);
+                  socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+                  boost::asio::streambuf response;
+                  while (!stop) {
+                     boost::asio::write(socket, boost::asio::buffer(request));
+                     response.consume(boost::asio::read_until(socket, response, "\r\n\r\n"));
+                     if (response.size() == 0)
+                        boost::asio::read(socket, response, boost::asio::transfer_at_least(1));
+                     response.consume(1);
+                     ++nRequests;
+                  }
+               });
+         }
+
+         const auto t0 = std::chrono::steady_clock::now();
+         std::this_thread::sleep_for(std::chrono::seconds(1));
+         stop = true;
+         for (auto& client : clients)
+            client.join();
+         const auto t1 = std::chrono::steady_clock::now();
+
+         server->destroy();
+         io.stop();
+         for (auto& thread : threads)
+            thread.join();
+
+         const double seconds = std::chrono::duration<double>(t1 - t0).count();
+         std::cout << boost::format("%-40s %10.0f req/s\n")
+            % (boost::format("%s dispatch, %d threads")
+               % (concurrent ? "connection" : "server")
+               % nThreads).str()
+            % (nRequests / seconds);
+      }
+   }
+}
+
+// Route matching with 1024 routes. Before Router, handlers were
+// found by exact std::map lookup, and parameterized routes were
+// matched by regexes scanned in order in the default handler.
+static void routing() {
+   const size_t nResources = 256;
+   std::vector<std::string> patterns;
+   for (size_t i = 0; i < nResources; ++i) {
+      const std::string resource = (boost::format("/api/r%d") % i).str();
+      patterns.push_back(resource);
+      patterns.push_back(resource + "/:id");
+      patterns.push_back(resource + "/:id/items/:item");
+      patterns.push_back((boost::format("/static/s%d/*file") % i).str());
+   }
+
+   const std::vector<std::string> paths = {
+      "/api/r200",
+      "/api/r200/12345",
+      "/api/r200/12345/items/67",
+      "/static/s200/css/site.css"
+   };
+
+   std::map<std::string, int> map;
+   for (size_t i = 0; i < patterns.size(); ++i)
+      map[patterns[i]] = i + 1;
+   run("routing: std::map exact (static only)", 1000000, [&]() {
+         if (map.find(paths[0]) == map.end())
+            throw std::runtime_error("no route");
+      });
+
+   std::vector<std::pair<std::regex, int> > regexes;
+   for (size_t i = 0; i < patterns.size(); ++i) {
+      const std::string expression = std::regex_replace(
+         std::regex_replace(patterns[i], std::regex(":[^/]+"), "([^/]+)"),
+         std::regex("\\*.*"), "(.*)");
+      regexes.emplace_back(std::regex(expression), i + 1);
+   }
+   size_t n = 0;
+   run("routing: std::regex scan", 1000, [&]() {
+         const auto& path = paths[n++ % paths.size()];
+         std::smatch match;
+         auto i = std::find_if(
+            regexes.begin(), regexes.end(),
+            [&](const std::pair<std::regex, int>& regex) {
+               return std::regex_match(path, match, regex.first);
+            });
+         if (i == regexes.end())
+            throw std::runtime_error("no route");
+      });
+
+   detail::Router<int> router;
+   for (size_t i = 0; i < patterns.size(); ++i)
+      router.insert(patterns[i], i + 1);
+   detail::PathParameters parameters;
+   run("routing: Router", 1000000, [&]() {
+         parameters.resize(0);
+         if (!router.find(paths[n++ % paths.size()], parameters))
+            throw std::runtime_error("no route");
+      });
+}
+
+// File responses of 1 MB to 1 GB over loopback, sent by reading into
+// a buffer and writing it through the transaction (as before
+// send_file()) and with send_file().
+static void send_file() {
+   using boost::asio::ip::tcp;
+   const size_t maxSize = size_t(1) << 30;
+
+   // A sparse file, so reads come from the page cache.
+   char path[] = "/tmp/chunky_benchmarkXXXXXX";
+   const int fd = mkstemp(path);
+   if (fd < 0 || ftruncate(fd, maxSize) != 0)
+      throw std::runtime_error("cannot create file");
+   unlink(path);
+
+   boost::asio::io_service io;
+   auto server = SimpleHTTPServer::create(io);
+   server->set_handler("", [=](const std::shared_ptr<HTTP>& http) {
+         const size_t size = std::stoul(http->request_path().substr(1));
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(size);
+         if (http->request_query().count("buffered")) {
+            std::vector<char> buffer(65536);
+            for (size_t offset = 0; offset < size; offset += buffer.size()) {
+               const size_t n = std::min(buffer.size(), size - offset);
+               if (pread(fd, buffer.data(), n, offset) != static_cast<ssize_t>(n))
+                  throw std::runtime_error("read failed");
+               boost::asio::write(*http, boost::asio::buffer(buffer.data(), n));
+            }
+         }
+         else
+            http->send_file(fd, 0, size);
+         http->finish();
+      });
+   const auto port = server->listen(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+   std::thread thread([&]() { io.run(); });
+
+   std::vector<char> buffer(1 << 20);
+   for (size_t size = size_t(1) << 20; size <= maxSize; size <<= 2) {
+      for (const std::string mode : { "buffered", "send_file" }) {
+         const std::string request = (boost::format("GET /%d%s HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                                      % size
+                                      % (mode == "buffered" ? "?buffered" : "")).str();
+         const size_t nRequests = std::max<size_t>(4, maxSize / size);
+
+         boost::asio::io_service clientIO;
+         tcp::socket socket(clientIO);
+         socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+         boost::asio::streambuf response;
+         const auto t0 = std::chrono::steady_clock::now();
+         for (size_t i = 0; i < nRequests; ++i) {
+            boost::asio::write(socket, boost::asio::buffer(request));
+            response.consume(boost::asio::read_until(socket, response, "\r\n\r\n"));
+            size_t remaining = size - response.size();
+            response.consume(response.size());
+            while (remaining)
+               remaining -= socket.read_some(boost::asio::buffer(buffer.data(), std::min(remaining, buffer.size())));
+         }
+         const auto t1 = std::chrono::steady_clock::now();
+
+         const double seconds = std::chrono::duration<double>(t1 - t0).count();
+         std::cout << boost::format("%-40s %10.0f MB/s\n")
+            % (boost::format("send_file: %s, %d MB") % mode % (size >> 20)).str()
+            % (nRequests * size / seconds / (1 << 20));
+      }
+   }
+
+   server->destroy();
+   io.stop();
+   thread.join();
+   close(fd);
+}
+
+// Content-Length parsing as implemented with Boost.Iostreams before
+// detail::parse_decimal().
+static void content_length() {
+   const boost::string_ref value("1048576");
+   volatile size_t sink;
+   run("content_length: iostreams", 1000000, [&]() {
+         boost::iostreams::filtering_istream is(
+            boost::make_iterator_range(value.begin(), value.end()));
+         size_t n;
+         is >> n;
+         sink = n;
+      });
+   run("content_length: parse_decimal", 10000000, [&]() {
+         uint64_t n;
+         detail::parse_decimal(value, n);
+         sink = n;
+      });
+   (void)sink;
+}
+
+// Query string decoding as implemented with std::regex before
+// detail::percent_decode().
+namespace regex_query {
+   static std::string decode(std::string::const_iterator bgn, std::string::const_iterator end) {
+      std::string result;
+      auto i = bgn;
+      std::smatch escapeMatch;
+      static const std::regex escapeRegex("^([^+%]*)(?:\\+|(?:%([0-9A-Fa-f]{2})))");
+      while (i != end) {
+         if (std::regex_search(i, end, escapeMatch, escapeRegex)) {
+            result += escapeMatch[1].str();
+            if (escapeMatch[2].matched)
+               result += static_cast<char>(std::stoi(escapeMatch[2].str(), 0, 16));
+            else
+               result += ' ';
+            i = escapeMatch[0].second;
+         }
+         else {
+            result += std::string(i, end);
+            i = end;
+         }
+      }
+      return result;
+   }
+
+   static HTTP::Query parse_query(const std::string& s) {
+      HTTP::Query query;
+      auto i = s.begin();
+      std::smatch paramMatch;
+      static const std::regex paramRegex("^([^=&]+)(=)?([^&]*)&?");
+      while (std::regex_search(i, s.end(), paramMatch, paramRegex)) {
+         if (paramMatch[2].matched) {
+            std::string key = decode(paramMatch[1].first, paramMatch[1].second);
+            std::string value = decode(paramMatch[3].first, paramMatch[3].second);
+            query[key] = value;
+         }
+         i = paramMatch[0].second;
+      }
+      return query;
+   }
+}
+
+static void query() {
+   // A long query string of mostly unescaped values, as from a large
+   // form submission or tracking link.
+   std::string s;
+   for (int i = 0; i < 64; ++i) {
+      if (i)
+         s += '&';
+      s += boost::str(boost::format("field_%d=") % i);
+      if (i % 8 == 0)
+         s += "caf%C3%A9+au+lait%21";
+      else
+         s += std::string(32, 'a' + i % 26);
+   }
+
+   if (regex_query::parse_query(s) != HTTP::parse_query(s))
+      throw std::runtime_error("query mismatch");
+
+   size_t sum = 0;
+   run("query: regex", 2000, [&]() {
+         sum += regex_query::parse_query(s).size();
+      });
+   run("query: parse_query", 100000, [&]() {
+         sum += HTTP::parse_query(s).size();
+      });
+   run("query: parse_query views", 100000, [&]() {
+         HTTP::parse_query(s, [&](boost::string_ref key, boost::string_ref value) {
+               sum += key.size() + value.size();
+            });
+      });
+
+   // Decoding a long value with no escapes is bounded by the scan.
+   const std::string value(4096, 'x');
+   std::vector<std::pair<std::string, detail::FindEscapeFunc> > finds = {
+      { "query: find_escape scalar (4KB)", &detail::find_escape_scalar }
+   };
+#ifdef CHUNKY_X86_SIMD
+   finds.push_back({ "query: find_escape sse2 (4KB)", &detail::find_escape_sse2 });
+   if (__builtin_cpu_supports("avx2"))
+      finds.push_back({ "query: find_escape avx2 (4KB)", &detail::find_escape_avx2 });
+#endif
+   for (const auto& find : finds) {
+      run(find.first, 100000, [&]() {
+            sum += find.second(value.data(), value.data() + value.size()) - value.data();
+         });
+   }
+   run("query: decode (4KB)", 100000, [&]() {
+         sum += HTTP::decode(value).size();
+      });
+
+   if (!sum)
+      throw std::runtime_error("nothing parsed");
+}
+
+// Throughput of chunked request bodies read through
+// HTTPTransaction::read_some(), by chunk size.
+static void chunked_upload() {
+   using boost::asio::ip::tcp;
+   const size_t bodySize = 16 << 20;
+
+   boost::asio::io_service io;
+   auto server = SimpleHTTPServer::create(io);
+   server->set_handler("", [](const std::shared_ptr<HTTP>& http) {
+         std::vector<char> buffer(65536);
+         boost::system::error_code error;
+         size_t nBytes = 0;
+         while (!error)
+            nBytes += http->read_some(boost::asio::buffer(buffer), error);
+
+         const std::string body = std::to_string(nBytes);
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(body.size());
+         boost::asio::write(*http, boost::asio::buffer(body));
+         http->finish();
+      });
+   const auto port = server->listen(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+   std::thread thread([&]() { io.run(); });
+
+   for (size_t chunkSize : { 16, 256, 4096, 65536 }) {
+      std::ostringstream os;
+      os << "POST / HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n";
+      const std::string data(chunkSize, 'x');
+      for (size_t i = 0; i < bodySize; i += chunkSize)
+         os << std::hex << chunkSize << "\r\n" << data << "\r\n";
+      os << "0\r\n\r\n";
+      const std::string request = os.str();
+
+      boost::asio::io_service clientIO;
+      tcp::socket socket(clientIO);
+      socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+      boost::asio::streambuf response;
+      const size_t nRequests = 4;
+      const auto t0 = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < nRequests; ++i) {
+         boost::asio::write(socket, boost::asio::buffer(request));
+         boost::asio::read_until(socket, response, "\r\n\r\n");
+         response.consume(response.size());
+      }
+      const auto t1 = std::chrono::steady_clock::now();
+
+      const double seconds = std::chrono::duration<double>(t1 - t0).count();
+      std::cout << boost::format("%-40s %10.0f MB/s\n")
+         % (boost::format("chunked_upload: %d byte chunks") % chunkSize).str()
+         % (nRequests * bodySize / seconds / (1 << 20));
+   }
+
+   server->destroy();
+   io.stop();
+   thread.join();
+}
+
+int main(int argc, char* argv[]) {
+   const std::vector<std::pair<std::string, void(*)()> > benchmarks = {
+      { "request_head", &request_head },
+      { "scan_delimiters", &scan_delimiters },
+      { "date", &date },
+      { "response_head", &response_head },
+      { "server_threads", &server_threads },
+      { "routing", &routing },
+      { "send_file", &send_file },
+      { "content_length", &content_length },
+      { "query", &query },
+      { "chunked_upload", &chunked_upload }
+   };
+
+   for (const auto& benchmark : benchmarks) {
+      if (argc == 1 ||
+          std::find(argv + 1, argv + argc, benchmark.first) != argv + argc)
+         benchmark.second();
+   }
+
+   return 0;
+}
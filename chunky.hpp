@@ -17,37 +17,59 @@ limitations under the License.
 #define CHUNKY_HPP
 
 #include <algorithm>
-#include <deque>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <limits>
 #include <list>
+#include <map>
 #include <memory>
-#include <regex>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
-#include <boost/algorithm/string/predicate.hpp>
-#include <boost/algorithm/string/trim.hpp>
 #include <boost/asio.hpp>
 #include <boost/format.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
 #include <boost/utility.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CHUNKY_X86_SIMD
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
 
 namespace chunky {
-   namespace detail {
-      struct CaselessCompare {
-         bool operator()(const std::string& a,const std::string& b) const {
-            return boost::ilexicographical_compare(a,b);
-         }
-      };
-   }
-   
    enum errors {
       invalid_request_line = 1,
       invalid_request_header,
       unsupported_http_version,
       invalid_content_length,
       invalid_chunk_length,
-      invalid_chunk_delimiter
+      invalid_chunk_delimiter,
+      invalid_content_encoding,
+      request_body_too_large
    };
    
    inline boost::system::error_code make_error_code(errors e) {
@@ -72,6 +94,10 @@ namespace chunky {
                return "Invalid chunk length";
             case invalid_chunk_delimiter:
                return "Invalid chunk delimiter";
+            case invalid_content_encoding:
+               return "Invalid Content-Encoding";
+            case request_body_too_large:
+               return "Request body too large";
             default:
                return "chunky error";
             }
@@ -83,285 +109,3389 @@ namespace chunky {
          static_cast<int>(e), category);
    }
 
-   // This is a wrapper for a boost::asio stream class (e.g.
-   // boost::asio::ip::tcp::socket). It provides three features:
-   //
-   // 1. Asynchronous operations are thread-safe via a strand.
-   // 2. A put back buffer is available for overread data.
-   // 3. Stream lifetime is ensured (via shared_ptr) for asynchronous
-   //    operations.
-   template<typename T>
-   class Stream : public std::enable_shared_from_this<Stream<T> >
-                , boost::noncopyable {
-   public:
-      typedef T stream_t;
-      
-      virtual ~Stream() {}
+   namespace detail {
+      // A byte range in a buffer. Offsets are used instead of
+      // pointers so that a range remains valid if the buffer is
+      // reallocated.
+      struct Span {
+         size_t offset;
+         size_t size;
+      };
 
-      stream_t& stream() {
-         return stream_;
+      enum methods {
+         other_method,
+         get_method,
+         head_method,
+         post_method,
+         put_method,
+         delete_method,
+         options_method,
+         trace_method,
+         connect_method,
+         patch_method
+      };
+
+      // Identify common request methods without allocating.
+      inline methods method_type(const char* s, size_t n) {
+         switch (n) {
+         case 3:
+            if (!std::memcmp(s, "GET", 3)) return get_method;
+            if (!std::memcmp(s, "PUT", 3)) return put_method;
+            break;
+         case 4:
+            if (!std::memcmp(s, "POST", 4)) return post_method;
+            if (!std::memcmp(s, "HEAD", 4)) return head_method;
+            break;
+         case 5:
+            if (!std::memcmp(s, "PATCH", 5)) return patch_method;
+            if (!std::memcmp(s, "TRACE", 5)) return trace_method;
+            break;
+         case 6:
+            if (!std::memcmp(s, "DELETE", 6)) return delete_method;
+            break;
+         case 7:
+            if (!std::memcmp(s, "OPTIONS", 7)) return options_method;
+            if (!std::memcmp(s, "CONNECT", 7)) return connect_method;
+            break;
+         }
+         return other_method;
       }
-      
-      boost::asio::io_service& get_io_service() {
-         return stream_.get_io_service();
+
+      // Standard header field names. RequestParser and HeaderMap tag
+      // fields with these so that lookups of them compare integers.
+      enum header_names {
+         other_header,
+         accept_header,
+         accept_charset_header,
+         accept_encoding_header,
+         accept_language_header,
+         accept_ranges_header,
+         age_header,
+         allow_header,
+         authorization_header,
+         cache_control_header,
+         connection_header,
+         content_disposition_header,
+         content_encoding_header,
+         content_language_header,
+         content_length_header,
+         content_location_header,
+         content_range_header,
+         content_type_header,
+         cookie_header,
+         date_header,
+         etag_header,
+         expect_header,
+         expires_header,
+         from_header,
+         host_header,
+         if_match_header,
+         if_modified_since_header,
+         if_none_match_header,
+         if_range_header,
+         if_unmodified_since_header,
+         last_modified_header,
+         location_header,
+         max_forwards_header,
+         origin_header,
+         pragma_header,
+         proxy_authenticate_header,
+         proxy_authorization_header,
+         range_header,
+         referer_header,
+         retry_after_header,
+         sec_websocket_accept_header,
+         sec_websocket_key_header,
+         sec_websocket_protocol_header,
+         sec_websocket_version_header,
+         server_header,
+         set_cookie_header,
+         te_header,
+         trailer_header,
+         transfer_encoding_header,
+         upgrade_header,
+         upgrade_insecure_requests_header,
+         user_agent_header,
+         vary_header,
+         via_header,
+         warning_header,
+         www_authenticate_header,
+         x_forwarded_for_header,
+         x_requested_with_header,
+         header_name_count
+      };
+
+      // Tables for a perfect hash of the standard header names. This
+      // is a class template only so that the constexpr arrays have a
+      // single definition across translation units.
+      template<typename Unused = void>
+      struct HeaderTable {
+         struct Name {
+            const char* data;
+            size_t size;
+         };
+
+         // Canonical spelling, indexed by header_names.
+         static constexpr Name names[header_name_count] = {
+            { "", 0 },
+            { "Accept", 6 },
+            { "Accept-Charset", 14 },
+            { "Accept-Encoding", 15 },
+            { "Accept-Language", 15 },
+            { "Accept-Ranges", 13 },
+            { "Age", 3 },
+            { "Allow", 5 },
+            { "Authorization", 13 },
+            { "Cache-Control", 13 },
+            { "Connection", 10 },
+            { "Content-Disposition", 19 },
+            { "Content-Encoding", 16 },
+            { "Content-Language", 16 },
+            { "Content-Length", 14 },
+            { "Content-Location", 16 },
+            { "Content-Range", 13 },
+            { "Content-Type", 12 },
+            { "Cookie", 6 },
+            { "Date", 4 },
+            { "ETag", 4 },
+            { "Expect", 6 },
+            { "Expires", 7 },
+            { "From", 4 },
+            { "Host", 4 },
+            { "If-Match", 8 },
+            { "If-Modified-Since", 17 },
+            { "If-None-Match", 13 },
+            { "If-Range", 8 },
+            { "If-Unmodified-Since", 19 },
+            { "Last-Modified", 13 },
+            { "Location", 8 },
+            { "Max-Forwards", 12 },
+            { "Origin", 6 },
+            { "Pragma", 6 },
+            { "Proxy-Authenticate", 18 },
+            { "Proxy-Authorization", 19 },
+            { "Range", 5 },
+            { "Referer", 7 },
+            { "Retry-After", 11 },
+            { "Sec-WebSocket-Accept", 20 },
+            { "Sec-WebSocket-Key", 17 },
+            { "Sec-WebSocket-Protocol", 22 },
+            { "Sec-WebSocket-Version", 21 },
+            { "Server", 6 },
+            { "Set-Cookie", 10 },
+            { "TE", 2 },
+            { "Trailer", 7 },
+            { "Transfer-Encoding", 17 },
+            { "Upgrade", 7 },
+            { "Upgrade-Insecure-Requests", 25 },
+            { "User-Agent", 10 },
+            { "Vary", 4 },
+            { "Via", 3 },
+            { "Warning", 7 },
+            { "WWW-Authenticate", 16 },
+            { "X-Forwarded-For", 15 },
+            { "X-Requested-With", 16 }
+         };
+
+         // Case-insensitive weights of the letters a-z, found by
+         // search so that header_slot() does not collide for the
+         // standard names.
+         static constexpr unsigned char weights[26] = {
+            34, 0, 60, 32, 3, 49, 1, 32, 23, 0, 0, 51, 32, 58, 10, 25, 0, 10,
+            10, 19, 51, 56, 39, 23, 39, 0
+         };
+
+         // Standard name (if any) for each header_slot().
+         enum { SlotCount = 64 };
+         static constexpr header_names slots[SlotCount] = {
+            connection_header,
+            pragma_header,
+            sec_websocket_key_header,
+            accept_charset_header,
+            if_none_match_header,
+            cookie_header,
+            content_location_header,
+            x_requested_with_header,
+            etag_header,
+            content_disposition_header,
+            origin_header,
+            content_type_header,
+            content_range_header,
+            content_encoding_header,
+            allow_header,
+            content_language_header,
+            user_agent_header,
+            other_header,
+            range_header,
+            sec_websocket_protocol_header,
+            expires_header,
+            from_header,
+            upgrade_insecure_requests_header,
+            set_cookie_header,
+            te_header,
+            sec_websocket_version_header,
+            server_header,
+            referer_header,
+            expect_header,
+            via_header,
+            other_header,
+            retry_after_header,
+            last_modified_header,
+            other_header,
+            if_range_header,
+            vary_header,
+            trailer_header,
+            transfer_encoding_header,
+            proxy_authorization_header,
+            date_header,
+            age_header,
+            authorization_header,
+            content_length_header,
+            if_modified_since_header,
+            other_header,
+            if_unmodified_since_header,
+            proxy_authenticate_header,
+            warning_header,
+            x_forwarded_for_header,
+            sec_websocket_accept_header,
+            accept_encoding_header,
+            other_header,
+            accept_language_header,
+            location_header,
+            max_forwards_header,
+            host_header,
+            other_header,
+            accept_ranges_header,
+            www_authenticate_header,
+            accept_header,
+            cache_control_header,
+            upgrade_header,
+            other_header,
+            if_match_header
+         };
+      };
+
+      template<typename Unused>
+      constexpr typename HeaderTable<Unused>::Name HeaderTable<Unused>::names[];
+      template<typename Unused>
+      constexpr unsigned char HeaderTable<Unused>::weights[];
+      template<typename Unused>
+      constexpr header_names HeaderTable<Unused>::slots[];
+
+      constexpr unsigned int header_weight(char c) {
+         return
+            c >= 'a' && c <= 'z' ? HeaderTable<>::weights[c - 'a'] :
+            c >= 'A' && c <= 'Z' ? HeaderTable<>::weights[c - 'A'] :
+            0;
       }
 
-      template<typename MutableBufferSequence, typename ReadHandler>
-      void async_read_some(
-         const MutableBufferSequence& buffers,
-         ReadHandler&& handler) {
-         if (!readBuffer_.empty()) {
-            // Call the synchronous function. It won't block because
-            // the data are buffered.
-            boost::system::error_code error;
-            const auto nBytes = read_some(buffers, error);
-            get_io_service().post([=]() mutable {
-                  handler(error, nBytes);
-               });
-         }
-         else {
-            auto this_ = this->shared_from_this();
-            strand_.dispatch([=]() mutable {
-                  // Wrapping the handler is unnecessary because the
-                  // call is not a composed operation.
-                  this_->stream_.async_read_some(buffers, handler);
-               });
-         }
+      // Hash a non-empty name by its length and the weights of its
+      // first and last characters.
+      constexpr size_t header_slot(const char* s, size_t n) {
+         return (n + header_weight(s[0]) + header_weight(s[n - 1])) % HeaderTable<>::SlotCount;
       }
 
-      template<typename ConstBufferSequence, typename WriteHandler>
-      void async_write_some(
-         const ConstBufferSequence& buffers,
-         WriteHandler&& handler) {
-         auto this_ = this->shared_from_this();
-         strand_.dispatch([=]() mutable {
-               // Wrapping the handler is unnecessary because the call
-               // is not a composed operation.
-               this_->stream_.async_write_some(buffers, handler);
-            });
+      constexpr size_t constexpr_strlen(const char* s) {
+         return *s ? 1 + constexpr_strlen(s + 1) : 0;
       }
 
-      template<typename MutableBufferSequence>
-      size_t read_some(
-         const MutableBufferSequence& buffers,
-         boost::system::error_code& error) {
-         if (!readBuffer_.empty()) {
-            const auto nBytes = std::min(readBuffer_.size(), boost::asio::buffer_size(buffers));
-            const auto iBegin = readBuffer_.begin();
-            const auto iEnd = iBegin + nBytes;
-            std::copy(iBegin, iEnd, boost::asio::buffers_begin(buffers));
-            readBuffer_.erase(iBegin, iEnd);
-            return nBytes;
+      constexpr bool header_table_is_perfect(size_t i = other_header + 1) {
+         return i == header_name_count || (
+            constexpr_strlen(HeaderTable<>::names[i].data) == HeaderTable<>::names[i].size &&
+            static_cast<size_t>(HeaderTable<>::slots[
+               header_slot(HeaderTable<>::names[i].data, HeaderTable<>::names[i].size)]) == i &&
+            header_table_is_perfect(i + 1));
+      }
+      static_assert(header_table_is_perfect(), "header name table is not a perfect hash");
+
+      inline char to_lower(char c) {
+         return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+      }
+
+      inline bool caseless_equal(boost::string_ref a, boost::string_ref b) {
+         if (a.size() != b.size())
+            return false;
+         for (size_t i = 0; i < a.size(); ++i) {
+            if (to_lower(a[i]) != to_lower(b[i]))
+               return false;
          }
-         else
-            return stream_.read_some(buffers, error);
+         return true;
       }
-      
-      template<typename MutableBufferSequence>
-      size_t read_some(
-         const MutableBufferSequence& buffers) {
-         boost::system::error_code error;
-         const auto nBytes = read_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
+
+      // Parse a non-empty string of decimal digits. Signs, spaces and
+      // values that overflow are rejected.
+      inline bool parse_decimal(boost::string_ref s, uint64_t& n) {
+         if (s.empty())
+            return false;
+         n = 0;
+         for (char c : s) {
+            if (c < '0' || c > '9')
+               return false;
+            const unsigned int digit = c - '0';
+            if (n > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+               return false;
+            n = 10 * n + digit;
+         }
+         return true;
       }
 
-      template<typename ConstBufferSequence>
-      size_t write_some(
-         const ConstBufferSequence& buffers,
-         boost::system::error_code& error) {
-         return stream_.write_some(buffers, error);
+      // Identify a standard header name without allocating.
+      inline header_names header_type(const char* s, size_t n) {
+         if (!n)
+            return other_header;
+         const header_names type = HeaderTable<>::slots[header_slot(s, n)];
+         const auto& name = HeaderTable<>::names[type];
+         return caseless_equal(boost::string_ref(s, n), boost::string_ref(name.data, name.size)) ?
+            type : other_header;
       }
 
-      template<typename ConstBufferSequence>
-      size_t write_some(
-         const ConstBufferSequence& buffers) {
-         boost::system::error_code error;
-         const auto nBytes = write_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
+      inline const char* header_name(header_names type) {
+         return HeaderTable<>::names[type].data;
       }
-      
-      template<typename ConstBufferSequence>
-      void put_back(const ConstBufferSequence& buffers) {
-         readBuffer_.insert(
-            readBuffer_.begin(),
-            boost::asio::buffers_begin(buffers), boost::asio::buffers_end(buffers));
+
+      // RFC 7230 tchar.
+      inline bool is_token_char(char c) {
+         // Indexed by octet; a table beats the branches in the hot loops.
+         static const bool tokenChars[256] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+            0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+         };
+         return tokenChars[static_cast<unsigned char>(c)];
       }
 
-   protected:
-      template<typename... Args>
-      Stream(Args&&... args)
-         : stream_(std::forward<Args>(args)...)
-         , strand_(stream_.get_io_service()) {
+      inline bool is_space(char c) {
+         return c == ' ' || (c >= '\t' && c <= '\r');
       }
 
-   private:
-      T stream_;
-      boost::asio::io_service::strand strand_;
-      std::deque<char> readBuffer_;
-   };
+      // Set bit i of lf and colon when block[i] is LF or a colon,
+      // respectively, for a block of ScanBlockSize bytes. The vector
+      // implementations are selected at runtime by scan_delimiters().
+      enum { ScanBlockSize = 64 };
 
-   // This is a wrapped boost::asio TCP stream.
-   class TCP : public Stream<boost::asio::ip::tcp::socket> {
-   public:
-      template<typename CreateHandler>
-      static void async_connect(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         CreateHandler handler) {
-         std::shared_ptr<TCP> tcp(new TCP(acceptor.get_io_service()));
-         acceptor.async_accept(
-            tcp->stream(),
-            [=](const boost::system::error_code& error) mutable {
-               if (error)
-                  tcp.reset();
-               handler(error, tcp);
-            });
+      inline void scan_delimiters_scalar(const char* block, uint64_t& lf, uint64_t& colon) {
+         lf = colon = 0;
+         for (size_t i = 0; i < ScanBlockSize; ++i) {
+            lf |= static_cast<uint64_t>(block[i] == '\n') << i;
+            colon |= static_cast<uint64_t>(block[i] == ':') << i;
+         }
       }
 
-      static std::shared_ptr<TCP> create(boost::asio::ip::tcp::socket&& socket) {
-         return std::shared_ptr<TCP>(new TCP(std::move(socket)));
+#ifdef CHUNKY_X86_SIMD
+      __attribute__((target("sse2")))
+      inline void scan_delimiters_sse2(const char* block, uint64_t& lf, uint64_t& colon) {
+         const __m128i lfs = _mm_set1_epi8('\n');
+         const __m128i colons = _mm_set1_epi8(':');
+         lf = colon = 0;
+         for (size_t i = 0; i < ScanBlockSize; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+            lf |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lfs)))) << i;
+            colon |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, colons)))) << i;
+         }
       }
 
-      ~TCP() {
-         if (stream().is_open()) {
-            boost::system::error_code error;
-            stream().shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
-            stream().close(error);
+      __attribute__((target("avx2")))
+      inline void scan_delimiters_avx2(const char* block, uint64_t& lf, uint64_t& colon) {
+         const __m256i lfs = _mm256_set1_epi8('\n');
+         const __m256i colons = _mm256_set1_epi8(':');
+         lf = colon = 0;
+         for (size_t i = 0; i < ScanBlockSize; i += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+            lf |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lfs)))) << i;
+            colon |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, colons)))) << i;
          }
       }
-   private:
-      TCP(boost::asio::io_service& io)
-         : Stream<boost::asio::ip::tcp::socket>(io) {
+#endif
+
+      typedef void (*ScanDelimitersFunc)(const char*, uint64_t&, uint64_t&);
+      inline ScanDelimitersFunc select_scan_delimiters() {
+#ifdef CHUNKY_X86_SIMD
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2"))
+            return &scan_delimiters_avx2;
+         if (__builtin_cpu_supports("sse2"))
+            return &scan_delimiters_sse2;
+#endif
+         return &scan_delimiters_scalar;
       }
 
-      TCP(boost::asio::ip::tcp::socket&& socket)
-         : Stream<boost::asio::ip::tcp::socket>(std::move(socket)) {
+      inline void scan_delimiters(const char* block, uint64_t& lf, uint64_t& colon) {
+         static const ScanDelimitersFunc f = select_scan_delimiters();
+         f(block, lf, colon);
       }
-   };
 
-#ifdef BOOST_ASIO_SSL_HPP
-   class TLS : public Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> > {
-   public:
-      typedef boost::system::error_code error_code;
-      
-      template<typename CreateHandler>
-      static void async_connect(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         boost::asio::ssl::context& context,
-         CreateHandler handler) {
-         // Accept a TCP connection.
-         std::shared_ptr<TLS> tls(new TLS(acceptor.get_io_service(), context));
-         acceptor.async_accept(
-            tls->stream().lowest_layer(),
-            [=](const error_code& error) {
-               if (error) {
-                  handler(error, tls);
-                  return;
-               }
+      // Bitmask of the positions of c in the first n < 64 bytes.
+      inline uint64_t find_all(const char* data, size_t n, char c) {
+         uint64_t mask = 0;
+         const char* end = data + n;
+         for (const char* p = data;
+              (p = static_cast<const char*>(std::memchr(p, c, end - p))) != nullptr;
+              ++p)
+            mask |= static_cast<uint64_t>(1) << (p - data);
+         return mask;
+      }
 
-               // Perform TLS handshake.
-               tls->stream().async_handshake(
-                  boost::asio::ssl::stream_base::server,
-                  [=](const error_code& error) {
-                        handler(error, tls);
-                  });
-            });
+      inline size_t count_trailing_zeros(uint64_t x) {
+#ifdef __GNUC__
+         return __builtin_ctzll(x);
+#else
+         size_t n = 0;
+         for (; !(x & 1); x >>= 1)
+            ++n;
+         return n;
+#endif
       }
 
-      template<typename ShutdownHandler>
-      void async_shutdown(ShutdownHandler&& handler) {
-         stream().async_shutdown(std::forward<ShutdownHandler>(handler));
+      // Return a pointer to the first '%' or '+' in [p, end), or end.
+      // The vector implementations are selected at runtime by
+      // find_escape().
+      inline const char* find_escape_scalar(const char* p, const char* end) {
+         while (p != end && *p != '%' && *p != '+')
+            ++p;
+         return p;
       }
-      
-   private:
-      TLS(boost::asio::io_service& io, boost::asio::ssl::context& context)
-         : Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> >(io, context) {
+
+#ifdef CHUNKY_X86_SIMD
+      __attribute__((target("sse2")))
+      inline const char* find_escape_sse2(const char* p, const char* end) {
+         const __m128i percents = _mm_set1_epi8('%');
+         const __m128i pluses = _mm_set1_epi8('+');
+         for (; end - p >= 16; p += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const unsigned int mask = _mm_movemask_epi8(
+               _mm_or_si128(_mm_cmpeq_epi8(v, percents), _mm_cmpeq_epi8(v, pluses)));
+            if (mask)
+               return p + count_trailing_zeros(mask);
+         }
+         return find_escape_scalar(p, end);
       }
-   
-   };
-#endif // BOOST_ASIO_SSL_HPP
 
-   template<typename T>
-   class HTTPTransaction : boost::noncopyable {
-   public:
-      typedef std::map<std::string, std::string, detail::CaselessCompare> Headers;
-      typedef std::map<std::string, std::string> Query;
-      
-      typedef boost::system::error_code error_code;
-      typedef std::function<void(const error_code&)> Handler;
-      typedef std::function<void(const error_code&, const std::shared_ptr<HTTPTransaction>&)> CreateHandler;
-      
-      HTTPTransaction(const std::shared_ptr<T>& stream)
-         : stream_(stream)
-         , streambuf_(buffer_size())
-         , requestBytes_(0)
-         , requestChunksPending_(false)
-         , responseStatus_(0)
-         , responseBytes_(0)
-         , responseChunked_(false) {
+      __attribute__((target("avx2")))
+      inline const char* find_escape_avx2(const char* p, const char* end) {
+         const __m256i percents = _mm256_set1_epi8('%');
+         const __m256i pluses = _mm256_set1_epi8('+');
+         for (; end - p >= 32; p += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            const uint32_t mask = _mm256_movemask_epi8(
+               _mm256_or_si256(_mm256_cmpeq_epi8(v, percents), _mm256_cmpeq_epi8(v, pluses)));
+            if (mask)
+               return p + count_trailing_zeros(mask);
+         }
+         return find_escape_sse2(p, end);
       }
+#endif
 
-      const std::string& request_method() const { return requestMethod_; }
-      const std::string& request_version() const { return requestVersion_; }
-      const std::string& request_resource() const { return requestResource_; }
-      const Headers& request_headers() const { return requestHeaders_; }
-      const std::string request_header(
-         const std::string& key,
-         const std::string& defaultValue = std::string()) const {
-         auto i = request_headers().find(key);
-         return i != request_headers().end() ? i->second : defaultValue;
+      typedef const char* (*FindEscapeFunc)(const char*, const char*);
+      inline FindEscapeFunc select_find_escape() {
+#ifdef CHUNKY_X86_SIMD
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2"))
+            return &find_escape_avx2;
+         if (__builtin_cpu_supports("sse2"))
+            return &find_escape_sse2;
+#endif
+         return &find_escape_scalar;
       }
-      
-      const std::string& request_path() const { return requestPath_; }
-      const std::string& request_fragment() const { return requestFragment_; }
-      const Query& request_query() const { return requestQuery_; }
-      
-      unsigned int& response_status() { return responseStatus_; }
-      Headers& response_headers() { return responseHeaders_; }
-      std::string& response_header(const std::string& key) {
-         return response_headers()[key];
+
+      inline const char* find_escape(const char* p, const char* end) {
+         static const FindEscapeFunc f = select_find_escape();
+         return f(p, end);
       }
-      
-      Headers& response_trailers() { return responseTrailers_; }
-      std::string& response_trailer(const std::string& key) {
-         return response_trailers()[key];
+
+      inline int hex_value(char c) {
+         if (c >= '0' && c <= '9')
+            return c - '0';
+         c |= 0x20;
+         return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
       }
 
-      // Either async_finish() or finish() must be called on each
-      // HTTPTransaction instance to ensure valid I/O on the stream. In
-      // most cases exactly one call should be made with no further
-      // usage of the instance (the exception is for returning 1xx
-      // status).
-      template<typename FinishHandler>
-      void async_finish(FinishHandler&& handler) {
-         // Use shared_ptr lifetime to execute the handler exactly
-         // once when both the final reads and writes (which may
-         // overlap in time) are complete.
-         std::shared_ptr<error_code> result(new error_code, [=](error_code* pointer) {
-               handler(*pointer);
-               delete pointer;
-            });
+      // Append s to out, converting '+' to ' ' and '%HH' to the octet
+      // HH. A '%' not followed by two hex digits is copied as is. The
+      // output never exceeds the input so it is sized once up front
+      // and unescaped runs are copied whole.
+      inline void percent_decode(boost::string_ref s, std::string& out) {
+         const size_t offset = out.size();
+         out.resize(offset + s.size());
+         char* q = &out[offset];
 
-         assert(response_status() >= 100);
-         if (response_status() >= 200) {
-            async_discard([=](const error_code& error) mutable {
-                  // Replace any unused bytes read by get_line().
-                  putback_buffer();
-                  *result = error;
-               });
-         }
+         const char* p = s.data();
+         const char* end = p + s.size();
+         while (p != end) {
+            const char* escape = find_escape(p, end);
+            std::memcpy(q, p, escape - p);
+            q += escape - p;
+            p = escape;
+            if (p == end)
+               break;
+
+            int hi, lo;
+            if (*p == '+') {
+               *q++ = ' ';
+               ++p;
+            }
+            else if (end - p >= 3 && (hi = hex_value(p[1])) >= 0 && (lo = hex_value(p[2])) >= 0) {
+               *q++ = static_cast<char>(hi << 4 | lo);
+               p += 3;
+            }
+            else
+               *q++ = *p++;
+         }
+         out.resize(q - out.data());
+      }
+
+      // Call f(key, value) with undecoded views of each parameter of an
+      // application/x-www-form-urlencoded string. Parameters without
+      // '=' or with an empty key are skipped.
+      template<typename Function>
+      void for_each_query_param(boost::string_ref s, Function&& f) {
+         while (!s.empty()) {
+            const size_t n = std::min(s.find('&'), s.size());
+            const boost::string_ref param = s.substr(0, n);
+            s.remove_prefix(std::min(n + 1, s.size()));
+
+            const size_t equals = param.find('=');
+            if (equals != 0 && equals != boost::string_ref::npos)
+               f(param.substr(0, equals), param.substr(equals + 1));
+         }
+      }
+
+      // Incremental parser for an HTTP/1.1 request line and headers
+      // (or for headers alone, e.g. chunked trailers). parse() is
+      // passed everything received so far, starting from the first
+      // byte of the head, and resumes scanning where the previous
+      // call stopped, so the head may arrive split across any number
+      // of reads. Results are recorded as offsets into the caller's
+      // buffer; nothing is copied.
+      //
+      // Received bytes are scanned once, 64 at a time, into LF and
+      // colon bitmasks. Line ends and the colon separating each field
+      // name are then found from the masks without rescanning.
+      class RequestParser {
+      public:
+         enum status { incomplete, complete, failed };
+
+         struct Field {
+            Span name;
+            Span value;
+            header_names type;
+         };
+
+         RequestParser() {
+            reset();
+         }
+
+         // Prepare to parse a request line followed by headers.
+         void reset() {
+            reset(request_line);
+         }
+
+         // Prepare to parse headers only.
+         void reset_headers() {
+            reset(header_line);
+         }
+
+         status parse(const char* data, size_t size) {
+            if (state_ == invalid)
+               return failed;
+
+            while (state_ != done) {
+               // Find the end of the next line, noting its first
+               // colon.
+               while (!lfMask_) {
+                  if (!lineColon_ && colonMask_)
+                     lineColon_ = blockOffset_ + count_trailing_zeros(colonMask_);
+
+                  if (scanned_ == size)
+                     return incomplete;
+
+                  // Scan the next block. A block at the end of the
+                  // received data may be short; the bytes after it
+                  // are scanned as a new block when they arrive.
+                  // Short blocks are usually the tail of a small
+                  // read, so only line ends are located with memchr
+                  // and parse_header_line() finds the colon itself
+                  // for lines overlapping one.
+                  blockOffset_ = scanned_;
+                  if (size - scanned_ >= ScanBlockSize) {
+                     scan_delimiters(data + scanned_, lfMask_, colonMask_);
+                     scanned_ += ScanBlockSize;
+                  }
+                  else {
+                     lfMask_ = find_all(data + scanned_, size - scanned_, '\n');
+                     colonMask_ = 0;
+                     scanned_ = size;
+                     colonsFrom_ = size;
+                  }
+               }
+
+               const size_t lfIndex = count_trailing_zeros(lfMask_);
+               const uint64_t before = (lfMask_ & -lfMask_) - 1;
+               if (!lineColon_ && (colonMask_ & before))
+                  lineColon_ = blockOffset_ + count_trailing_zeros(colonMask_ & before);
+               lfMask_ &= lfMask_ - 1;
+               colonMask_ &= ~before;
+               const size_t lineEnd = blockOffset_ + lfIndex;
+
+               // Lines must be terminated by CRLF.
+               position_ = lineEnd + 1;
+               if (lineEnd == lineStart_ || data[lineEnd - 1] != '\r') {
+                  return fail(state_ == request_line ?
+                              invalid_request_line :
+                              invalid_request_header);
+               }
+
+               const bool ok = state_ == request_line ?
+                  parse_request_line(data, lineEnd - 1) :
+                  parse_header_line(data, lineEnd - 1);
+               if (!ok)
+                  return failed;
+
+               lineStart_ = position_;
+               lineColon_ = 0;
+            }
+
+            return complete;
+         }
+
+         // Reason for a failed parse.
+         errors error() const { return error_; }
+
+         // Number of bytes in the head, valid after a complete parse.
+         size_t size() const { return position_; }
+
+         const Span& method() const { return method_; }
+         methods method_type() const { return methodType_; }
+         const Span& resource() const { return resource_; }
+         const Span& version() const { return version_; }
+         const std::vector<Field>& fields() const { return fields_; }
+
+      private:
+         enum state { request_line, header_line, done, invalid };
+
+         state state_;
+         errors error_;
+         size_t position_;
+         size_t lineStart_;
+         size_t lineColon_; // first colon in the line, or 0 if not found
+
+         size_t scanned_;
+         size_t colonsFrom_; // colonMask_ is valid from here on
+         size_t blockOffset_;
+         uint64_t lfMask_;
+         uint64_t colonMask_;
+
+         Span method_;
+         methods methodType_;
+         Span resource_;
+         Span version_;
+         std::vector<Field> fields_;
+
+         void reset(state initialState) {
+            state_ = initialState;
+            position_ = 0;
+            lineStart_ = 0;
+            lineColon_ = 0;
+            scanned_ = 0;
+            colonsFrom_ = 0;
+            blockOffset_ = 0;
+            lfMask_ = 0;
+            colonMask_ = 0;
+            fields_.clear();
+         }
+
+         status fail(errors e) {
+            state_ = invalid;
+            error_ = e;
+            return failed;
+         }
+
+         // Parse [lineStart_, end), which excludes the CRLF.
+         bool parse_request_line(const char* data, size_t end) {
+            // RFC 7230 section 3.5 recommends ignoring empty lines
+            // before the request line.
+            if (end == lineStart_)
+               return true;
+
+            size_t i = lineStart_;
+            while (i < end && is_token_char(data[i]))
+               ++i;
+            if (i == lineStart_ || i == end || data[i] != ' ') {
+               fail(invalid_request_line);
+               return false;
+            }
+            method_.offset = lineStart_;
+            method_.size = i - lineStart_;
+            methodType_ = detail::method_type(data + method_.offset, method_.size);
+
+            const size_t resource = ++i;
+            while (i < end && !is_space(data[i]))
+               ++i;
+            if (i == resource || i == end || data[i] != ' ') {
+               fail(invalid_request_line);
+               return false;
+            }
+            resource_.offset = resource;
+            resource_.size = i - resource;
+
+            // Version must be HTTP/d.d and specifically HTTP/1.1.
+            const char* v = data + ++i;
+            if (end - i != 8 ||
+                std::memcmp(v, "HTTP/", 5) ||
+                v[5] < '0' || v[5] > '9' ||
+                v[6] != '.' ||
+                v[7] < '0' || v[7] > '9') {
+               fail(invalid_request_line);
+               return false;
+            }
+            version_.offset = i;
+            version_.size = 8;
+
+            if (v[5] != '1' || v[7] != '1') {
+               fail(unsupported_http_version);
+               return false;
+            }
+
+            state_ = header_line;
+            return true;
+         }
+
+         // Parse [lineStart_, end), which excludes the CRLF.
+         bool parse_header_line(const char* data, size_t end) {
+            // An empty line terminates the head.
+            if (end == lineStart_) {
+               state_ = done;
+               return true;
+            }
+
+            // The field name is a token followed immediately by a
+            // colon.
+            if (lineStart_ < colonsFrom_) {
+               const char* colon = static_cast<const char*>(
+                  std::memchr(data + lineStart_, ':', end - lineStart_));
+               lineColon_ = colon ? colon - data : 0;
+            }
+            size_t i = lineStart_;
+            while (i < lineColon_ && is_token_char(data[i]))
+               ++i;
+            if (i == lineStart_ || i != lineColon_) {
+               fail(invalid_request_header);
+               return false;
+            }
+
+            Field field;
+            field.name.offset = lineStart_;
+            field.name.size = i - lineStart_;
+            field.type = header_type(data + lineStart_, field.name.size);
+
+            // Trim optional whitespace around the value.
+            ++i;
+            while (i < end && (data[i] == ' ' || data[i] == '\t'))
+               ++i;
+            while (end > i && (data[end - 1] == ' ' || data[end - 1] == '\t'))
+               --end;
+            field.value.offset = i;
+            field.value.size = end - i;
+
+            fields_.push_back(field);
+            return true;
+         }
+      };
+
+      // Bump allocator for per-transaction strings. Memory is only
+      // released when the Arena is cleared or destroyed.
+      class Arena : boost::noncopyable {
+      public:
+         explicit Arena(size_t blockSize = 4096)
+            : blockSize_(blockSize)
+            , next_(nullptr)
+            , available_(0) {
+         }
+
+         char* allocate(size_t n) {
+            if (n > available_) {
+               const size_t size = std::max(n, blockSize_);
+               blocks_.emplace_back(new char[size]);
+               next_ = blocks_.back().get();
+               available_ = size;
+            }
+
+            char* p = next_;
+            next_ += n;
+            available_ -= n;
+            return p;
+         }
+
+         boost::string_ref copy(const char* data, size_t n) {
+            char* p = allocate(n);
+            std::memcpy(p, data, n);
+            return boost::string_ref(p, n);
+         }
+
+         void clear() {
+            blocks_.clear();
+            next_ = nullptr;
+            available_ = 0;
+         }
+
+      private:
+         size_t blockSize_;
+         std::vector<std::unique_ptr<char[]> > blocks_;
+         char* next_;
+         size_t available_;
+      };
+
+      // Case-insensitive FNV-1a.
+      inline uint32_t header_hash(boost::string_ref s) {
+         uint32_t h = 2166136261u;
+         for (char c : s)
+            h = (h ^ static_cast<unsigned char>(to_lower(c))) * 16777619u;
+         return h;
+      }
+
+      // A request header name or value, referencing characters owned
+      // elsewhere (see Arena). It converts to std::string, so code
+      // written when request headers held std::string values still
+      // compiles.
+      class HeaderValue : public boost::string_ref {
+      public:
+         HeaderValue() {}
+         HeaderValue(const char* s) : boost::string_ref(s) {}
+         HeaderValue(const char* data, size_t size) : boost::string_ref(data, size) {}
+         HeaderValue(boost::string_ref s) : boost::string_ref(s) {}
+
+         operator std::string() const { return to_string(); }
+         std::string str() const { return to_string(); }
+      };
+
+      // Flat, insertion-ordered header container with case-insensitive
+      // lookup. Standard names are found in constant time through
+      // their header_names tag; other names are compared by hash
+      // before characters. String may be std::string or HeaderValue;
+      // with HeaderValue the caller owns the characters.
+      //
+      // It has the std::map operations handlers used on the map it
+      // replaced: find(), count(), operator[], at(), insert() of a
+      // value_type and erase() by name or iterator. Unlike std::map,
+      // iteration is in insertion order rather than sorted by name,
+      // and, like std::vector, insertion and erasure invalidate
+      // iterators and references to values.
+      template<typename String>
+      class HeaderMap {
+      public:
+         typedef String key_type;
+         typedef String mapped_type;
+         typedef std::pair<String, String> value_type;
+         typedef typename std::vector<value_type>::iterator iterator;
+         typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+         HeaderMap() {
+            reset_index();
+         }
+
+         iterator begin() { return fields_.begin(); }
+         iterator end() { return fields_.end(); }
+         const_iterator begin() const { return fields_.begin(); }
+         const_iterator end() const { return fields_.end(); }
+         size_t size() const { return fields_.size(); }
+         bool empty() const { return fields_.empty(); }
+
+         void reserve(size_t n) {
+            fields_.reserve(n);
+            keys_.reserve(n);
+         }
+
+         void clear() {
+            fields_.clear();
+            keys_.clear();
+            reset_index();
+         }
+
+         iterator find(header_names type) {
+            return begin() + index_of(type);
+         }
+
+         const_iterator find(header_names type) const {
+            return begin() + index_of(type);
+         }
+
+         iterator find(boost::string_ref name) {
+            return begin() + index_of(name);
+         }
+
+         const_iterator find(boost::string_ref name) const {
+            return begin() + index_of(name);
+         }
+
+         size_t count(boost::string_ref name) const {
+            return index_of(name) != fields_.size() ? 1 : 0;
+         }
+
+         String& operator[](boost::string_ref name) {
+            const size_t i = index_of(name);
+            if (i != fields_.size())
+               return fields_[i].second;
+            return insert(String(name.data(), name.size()), String())->second;
+         }
+
+         String& operator[](header_names type) {
+            const size_t i = index_of(type);
+            if (i != fields_.size())
+               return fields_[i].second;
+            return insert(String(header_name(type)), String(), type)->second;
+         }
+
+         // Throws std::out_of_range if there is no field named name.
+         const String& at(boost::string_ref name) const {
+            const size_t i = index_of(name);
+            if (i == fields_.size())
+               throw std::out_of_range("no header field " + name.to_string());
+            return fields_[i].second;
+         }
+
+         String& at(boost::string_ref name) {
+            return const_cast<String&>(static_cast<const HeaderMap&>(*this).at(name));
+         }
+
+         // As std::map::insert(), add a field unless there is one of
+         // the same name.
+         std::pair<iterator, bool> insert(const value_type& field) {
+            const auto i = find(boost::string_ref(field.first.data(), field.first.size()));
+            if (i != end())
+               return std::make_pair(i, false);
+            return std::make_pair(insert(field.first, field.second), true);
+         }
+
+         // Append a field without checking for an existing field of
+         // the same name.
+         iterator insert(const String& name, const String& value) {
+            return insert(name, value, header_type(name.data(), name.size()));
+         }
+
+         // As above, with the name already identified.
+         iterator insert(const String& name, const String& value, header_names type) {
+            Key key;
+            key.type = type;
+            key.hash = type == other_header ?
+               header_hash(boost::string_ref(name.data(), name.size())) : 0;
+            if (type != other_header && index_[type] < 0)
+               index_[type] = static_cast<int>(fields_.size());
+
+            fields_.push_back(value_type(name, value));
+            keys_.push_back(key);
+            return end() - 1;
+         }
+
+         size_t erase(boost::string_ref name) {
+            const size_t i = index_of(name);
+            if (i == fields_.size())
+               return 0;
+
+            // Remove every field with a matching key.
+            const Key key = keys_[i];
+            size_t n = 0;
+            for (size_t j = i; j < fields_.size(); ++j) {
+               if (keys_[j].type == key.type && keys_[j].hash == key.hash &&
+                   caseless_equal(fields_[j].first, name))
+                  ++n;
+               else {
+                  fields_[j - n] = std::move(fields_[j]);
+                  keys_[j - n] = keys_[j];
+               }
+            }
+            fields_.resize(fields_.size() - n);
+            keys_.resize(keys_.size() - n);
+            rebuild_index();
+            return n;
+         }
+
+         size_t erase(header_names type) {
+            return erase(boost::string_ref(header_name(type)));
+         }
+
+         // Remove one field, returning the iterator following it.
+         iterator erase(const_iterator position) {
+            const size_t i = position - fields_.cbegin();
+            fields_.erase(fields_.begin() + i);
+            keys_.erase(keys_.begin() + i);
+            rebuild_index();
+            return begin() + i;
+         }
+
+         iterator erase(iterator position) {
+            return erase(const_iterator(position));
+         }
+
+      private:
+         struct Key {
+            header_names type;
+            uint32_t hash; // only for other_header
+         };
+
+         std::vector<value_type> fields_;
+         std::vector<Key> keys_;
+         int index_[header_name_count];
+
+         void reset_index() {
+            std::fill(index_, index_ + header_name_count, -1);
+         }
+
+         void rebuild_index() {
+            reset_index();
+            for (size_t j = 0; j < keys_.size(); ++j) {
+               if (keys_[j].type != other_header && index_[keys_[j].type] < 0)
+                  index_[keys_[j].type] = static_cast<int>(j);
+            }
+         }
+
+         size_t index_of(header_names type) const {
+            return index_[type] < 0 ? fields_.size() : index_[type];
+         }
+
+         size_t index_of(boost::string_ref name) const {
+            const header_names type = header_type(name.data(), name.size());
+            if (type != other_header)
+               return index_of(type);
+
+            const uint32_t hash = header_hash(name);
+            for (size_t i = 0; i < keys_.size(); ++i) {
+               if (keys_[i].hash == hash && keys_[i].type == other_header &&
+                   caseless_equal(fields_[i].first, name))
+                  return i;
+            }
+            return fields_.size();
+         }
+      };
+
+      // Add the fields of a parsed head to headers, copying the head
+      // into arena once. Values of repeated fields are coalesced into
+      // a comma-separated list.
+      inline void add_fields(
+         HeaderMap<HeaderValue>& headers,
+         Arena& arena,
+         const char* head,
+         const RequestParser& parser) {
+         const char* copy = arena.copy(head, parser.size()).data();
+         headers.reserve(headers.size() + parser.fields().size());
+         for (const auto& field : parser.fields()) {
+            const boost::string_ref name(copy + field.name.offset, field.name.size);
+            const boost::string_ref value(copy + field.value.offset, field.value.size);
+
+            const auto i = field.type == other_header ?
+               headers.find(name) :
+               headers.find(field.type);
+            if (i != headers.end()) {
+               const size_t n = i->second.size() + 2 + value.size();
+               char* p = arena.allocate(n);
+               std::memcpy(p, i->second.data(), i->second.size());
+               std::memcpy(p + i->second.size(), ", ", 2);
+               std::memcpy(p + i->second.size() + 2, value.data(), value.size());
+               i->second = boost::string_ref(p, n);
+            }
+            else
+               headers.insert(name, value, field.type);
+         }
+      }
+
+      // Format t as an RFC 7231 IMF-fixdate, e.g.
+      // "Sun, 06 Nov 1994 08:49:37 GMT", into s[0..29). Names are
+      // written directly since strftime() is locale dependent.
+      inline void format_date(std::time_t t, char* s) {
+         std::tm tm;
+#ifdef _WIN32
+         gmtime_s(&tm, &t);
+#else
+         gmtime_r(&t, &tm);
+#endif
+         static const char days[] = "SunMonTueWedThuFriSat";
+         static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+         const unsigned int year = tm.tm_year + 1900;
+         std::memcpy(s, days + 3 * tm.tm_wday, 3);
+         s[3] = ',';
+         s[4] = ' ';
+         s[5] = '0' + tm.tm_mday / 10;
+         s[6] = '0' + tm.tm_mday % 10;
+         s[7] = ' ';
+         std::memcpy(s + 8, months + 3 * tm.tm_mon, 3);
+         s[11] = ' ';
+         s[12] = '0' + year / 1000 % 10;
+         s[13] = '0' + year / 100 % 10;
+         s[14] = '0' + year / 10 % 10;
+         s[15] = '0' + year % 10;
+         s[16] = ' ';
+         s[17] = '0' + tm.tm_hour / 10;
+         s[18] = '0' + tm.tm_hour % 10;
+         s[19] = ':';
+         s[20] = '0' + tm.tm_min / 10;
+         s[21] = '0' + tm.tm_min % 10;
+         s[22] = ':';
+         s[23] = '0' + tm.tm_sec / 10;
+         s[24] = '0' + tm.tm_sec % 10;
+         std::memcpy(s + 25, " GMT", 4);
+      }
+
+      // The current Date header value, shared by all transactions.
+      // Servers refresh it once per second from a timer (see
+      // BaseHTTPServer::listen()), so reading it is normally just a
+      // lock-free copy. The value is published with a seqlock:
+      // readers retry if the sequence is odd or changes while they
+      // copy. If no server timer is running, readers refresh it
+      // themselves when the second changes.
+      class DateCache : boost::noncopyable {
+      public:
+         enum { Size = 29 };
+
+         static DateCache& instance() {
+            static DateCache cache;
+            return cache;
+         }
+
+         // Copy the value to s, which must have room for Size bytes.
+         void read(char* s) {
+            if (!refreshers_.load(std::memory_order_relaxed))
+               refresh();
+
+            uint64_t words[WordCount];
+            for (;;) {
+               const unsigned int sequence = sequence_.load(std::memory_order_acquire);
+               if (sequence & 1)
+                  continue;
+               for (size_t i = 0; i < WordCount; ++i)
+                  words[i] = words_[i].load(std::memory_order_relaxed);
+               std::atomic_thread_fence(std::memory_order_acquire);
+               if (sequence_.load(std::memory_order_relaxed) == sequence)
+                  break;
+            }
+            std::memcpy(s, words, Size);
+         }
+
+         // Update the value if the second has changed. std::time()
+         // may read a coarse clock that lags the timer, so the
+         // precise clock is used.
+         void refresh() {
+            const std::time_t t = std::chrono::system_clock::to_time_t(
+               std::chrono::system_clock::now());
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (t == time_)
+               return;
+            time_ = t;
+
+            uint64_t words[WordCount] = {};
+            format_date(t, reinterpret_cast<char*>(words));
+
+            const unsigned int sequence = sequence_.load(std::memory_order_relaxed);
+            sequence_.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < WordCount; ++i)
+               words_[i].store(words[i], std::memory_order_relaxed);
+            sequence_.store(sequence + 2, std::memory_order_release);
+         }
+
+         // Count timers calling refresh() each second. Readers
+         // refresh only while there are none.
+         void add_refresher() {
+            refresh();
+            ++refreshers_;
+         }
+
+         void remove_refresher() {
+            --refreshers_;
+         }
+
+      private:
+         enum { WordCount = (Size + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+         std::atomic<unsigned int> sequence_;
+         std::atomic<uint64_t> words_[WordCount];
+         std::atomic<int> refreshers_;
+
+         std::mutex mutex_;
+         std::time_t time_;
+
+         DateCache()
+            : sequence_(0)
+            , refreshers_(0)
+            , time_(0) {
+            for (auto& word : words_)
+               word.store(0, std::memory_order_relaxed);
+         }
+      };
+
+      // Helpers for serializing a response head into a byte buffer.
+      inline void append(std::vector<char>& buffer, const char* s, size_t n) {
+         buffer.insert(buffer.end(), s, s + n);
+      }
+
+      inline void append(std::vector<char>& buffer, boost::string_ref s) {
+         append(buffer, s.data(), s.size());
+      }
+
+      inline void append_decimal(std::vector<char>& buffer, unsigned int n) {
+         char s[3 * sizeof(n)];
+         char* p = s + sizeof(s);
+         do {
+            *--p = '0' + n % 10;
+            n /= 10;
+         } while (n);
+         append(buffer, p, s + sizeof(s) - p);
+      }
+
+      inline void append_hex(std::vector<char>& buffer, size_t n) {
+         char s[2 * sizeof(n)];
+         char* p = s + sizeof(s);
+         do {
+            *--p = "0123456789abcdef"[n & 0xf];
+            n >>= 4;
+         } while (n);
+         append(buffer, p, s + sizeof(s) - p);
+      }
+
+      // Complete status lines, sorted by code. This is a class
+      // template only so that the constexpr array has a single
+      // definition across translation units.
+      template<typename Unused = void>
+      struct StatusTable {
+         struct Status {
+            unsigned int code;
+            const char* line;
+            size_t size;
+         };
+
+         enum { Count = 41 };
+         static constexpr Status statuses[Count] = {
+            { 100, "HTTP/1.1 100 Continue\r\n", 23 },
+            { 101, "HTTP/1.1 101 Switching Protocols\r\n", 34 },
+            { 200, "HTTP/1.1 200 OK\r\n", 17 },
+            { 201, "HTTP/1.1 201 Created\r\n", 22 },
+            { 202, "HTTP/1.1 202 Accepted\r\n", 23 },
+            { 203, "HTTP/1.1 203 Non-Authoritative Information\r\n", 44 },
+            { 204, "HTTP/1.1 204 No Content\r\n", 25 },
+            { 205, "HTTP/1.1 205 Reset Content\r\n", 28 },
+            { 206, "HTTP/1.1 206 Partial Content\r\n", 30 },
+            { 300, "HTTP/1.1 300 Multiple Choices\r\n", 31 },
+            { 301, "HTTP/1.1 301 Moved Permanently\r\n", 32 },
+            { 302, "HTTP/1.1 302 Found\r\n", 20 },
+            { 303, "HTTP/1.1 303 See Other\r\n", 24 },
+            { 304, "HTTP/1.1 304 Not Modified\r\n", 27 },
+            { 305, "HTTP/1.1 305 Use Proxy\r\n", 24 },
+            { 307, "HTTP/1.1 307 Temporary Redirect\r\n", 33 },
+            { 400, "HTTP/1.1 400 Bad Request\r\n", 26 },
+            { 401, "HTTP/1.1 401 Unauthorized\r\n", 27 },
+            { 402, "HTTP/1.1 402 Payment Required\r\n", 31 },
+            { 403, "HTTP/1.1 403 Forbidden\r\n", 24 },
+            { 404, "HTTP/1.1 404 Not Found\r\n", 24 },
+            { 405, "HTTP/1.1 405 Method Not Allowed\r\n", 33 },
+            { 406, "HTTP/1.1 406 Not Acceptable\r\n", 29 },
+            { 407, "HTTP/1.1 407 Proxy Authentication Required\r\n", 44 },
+            { 408, "HTTP/1.1 408 Request Timeout\r\n", 30 },
+            { 409, "HTTP/1.1 409 Conflict\r\n", 23 },
+            { 410, "HTTP/1.1 410 Gone\r\n", 19 },
+            { 411, "HTTP/1.1 411 Length Required\r\n", 30 },
+            { 412, "HTTP/1.1 412 Precondition Failed\r\n", 34 },
+            { 413, "HTTP/1.1 413 Payload Too Large\r\n", 32 },
+            { 414, "HTTP/1.1 414 URI Too Long\r\n", 27 },
+            { 415, "HTTP/1.1 415 Unsupported Media Type\r\n", 37 },
+            { 416, "HTTP/1.1 416 Range Not Satisfiable\r\n", 36 },
+            { 417, "HTTP/1.1 417 Expectation Failed\r\n", 33 },
+            { 426, "HTTP/1.1 426 Upgrade Required\r\n", 31 },
+            { 500, "HTTP/1.1 500 Internal Server Error\r\n", 36 },
+            { 501, "HTTP/1.1 501 Not Implemented\r\n", 30 },
+            { 502, "HTTP/1.1 502 Bad Gateway\r\n", 26 },
+            { 503, "HTTP/1.1 503 Service Unavailable\r\n", 34 },
+            { 504, "HTTP/1.1 504 Gateway Timeout\r\n", 30 },
+            { 505, "HTTP/1.1 505 HTTP Version Not Supported\r\n", 41 }
+         };
+      };
+
+      template<typename Unused>
+      constexpr typename StatusTable<Unused>::Status StatusTable<Unused>::statuses[];
+
+      constexpr bool status_table_is_valid(size_t i = 0) {
+         return i == StatusTable<>::Count || (
+            constexpr_strlen(StatusTable<>::statuses[i].line) == StatusTable<>::statuses[i].size &&
+            (i == 0 || StatusTable<>::statuses[i - 1].code < StatusTable<>::statuses[i].code) &&
+            status_table_is_valid(i + 1));
+      }
+      static_assert(status_table_is_valid(), "status table is not sorted or has a bad length");
+
+      inline void append_status_line(std::vector<char>& buffer, unsigned int code) {
+         typedef StatusTable<>::Status Status;
+         const Status* end = StatusTable<>::statuses + StatusTable<>::Count;
+         const Status* i = std::lower_bound(
+            StatusTable<>::statuses, end, code,
+            [](const Status& status, unsigned int code) { return status.code < code; });
+         if (i != end && i->code == code)
+            append(buffer, i->line, i->size);
+         else {
+            append(buffer, "HTTP/1.1 ");
+            append_decimal(buffer, code);
+            append(buffer, " \r\n");
+         }
+      }
+
+      // Append header fields and the terminating empty line.
+      template<typename Headers>
+      void append_fields(std::vector<char>& buffer, const Headers& headers) {
+         for (const auto& field : headers) {
+            append(buffer, field.first);
+            append(buffer, ": ");
+            append(buffer, field.second);
+            append(buffer, "\r\n");
+         }
+         append(buffer, "\r\n");
+      }
+
+      // A ConstBufferSequence over a range of buffers owned
+      // elsewhere. Asio copies the sequence into each operation, so
+      // this keeps the copy to a pair of pointers.
+      class BufferRange {
+      public:
+         typedef boost::asio::const_buffer value_type;
+         typedef const boost::asio::const_buffer* const_iterator;
+
+         BufferRange(const_iterator begin, const_iterator end)
+            : begin_(begin)
+            , end_(end) {
+         }
+
+         const_iterator begin() const { return begin_; }
+         const_iterator end() const { return end_; }
+
+      private:
+         const_iterator begin_;
+         const_iterator end_;
+      };
+
+      // A list of buffers for a gathered write. The first few are
+      // stored inline and any others in a vector whose capacity is
+      // kept across clear(), so refilling the list for each write
+      // does not allocate in steady state.
+      class GatherList : boost::noncopyable {
+      public:
+         enum { InlineCount = 8 };
+
+         GatherList()
+            : size_(0) {
+         }
+
+         void push_back(const boost::asio::const_buffer& buffer) {
+            if (size_ < InlineCount && overflow_.empty())
+               inline_[size_] = buffer;
+            else {
+               if (overflow_.empty())
+                  overflow_.assign(inline_, inline_ + size_);
+               overflow_.push_back(buffer);
+            }
+            ++size_;
+         }
+
+         void clear() {
+            overflow_.clear();
+            size_ = 0;
+         }
+
+         size_t size() const {
+            return size_;
+         }
+
+         BufferRange buffers() const {
+            const boost::asio::const_buffer* data = overflow_.empty() ? inline_ : overflow_.data();
+            return BufferRange(data, data + size_);
+         }
+
+      private:
+         boost::asio::const_buffer inline_[InlineCount];
+         std::vector<boost::asio::const_buffer> overflow_;
+         size_t size_;
+      };
+
+      // Bytes put back to a stream, to be read before the stream
+      // itself. They are kept contiguous at the end of a vector so
+      // that put back and reads are each a single copy, and the free
+      // space left in front by reads is reused by the next put back.
+      class PutBackBuffer : boost::noncopyable {
+      public:
+         PutBackBuffer()
+            : begin_(0) {
+         }
+
+         bool empty() const {
+            return begin_ == data_.size();
+         }
+
+         size_t size() const {
+            return data_.size() - begin_;
+         }
+
+         template<typename ConstBufferSequence>
+         void put_back(const ConstBufferSequence& buffers) {
+            const size_t nBytes = boost::asio::buffer_size(buffers);
+            if (nBytes > begin_) {
+               // Grow, moving existing bytes to the end.
+               const size_t nOld = size();
+               std::vector<char> data(std::max(nBytes + nOld, 2 * data_.size()));
+               if (nOld)
+                  std::memcpy(&data[data.size() - nOld], &data_[begin_], nOld);
+               data_.swap(data);
+               begin_ = data_.size() - nOld;
+            }
+
+            begin_ -= nBytes;
+            boost::asio::buffer_copy(boost::asio::buffer(data_.data() + begin_, nBytes), buffers);
+         }
+
+         template<typename MutableBufferSequence>
+         size_t read(const MutableBufferSequence& buffers) {
+            const size_t nBytes = boost::asio::buffer_copy(
+               buffers, boost::asio::buffer(data_.data() + begin_, size()));
+            begin_ += nBytes;
+            return nBytes;
+         }
+
+      private:
+         std::vector<char> data_;
+         size_t begin_;
+      };
+
+      // A connection's receive buffer. It starts with room for a
+      // typical request head and grows geometrically (as
+      // basic_streambuf does) up to the head limit.
+      class ReceiveBuffer : public boost::asio::streambuf {
+      public:
+         enum {
+            InitialSize = 4096,
+
+            // A connection keeps a buffer up to this size between
+            // requests.
+            RetainSize = 16384
+         };
+
+         explicit ReceiveBuffer(size_t maxSize)
+            : boost::asio::streambuf(maxSize) {
+            prepare(std::min(static_cast<size_t>(InitialSize), maxSize));
+         }
+
+         // Bytes held for the get and put areas.
+         size_t allocated() const {
+            return epptr() - eback();
+         }
+      };
+
+      // Recycled memory for asio handlers. A connection has only a
+      // few operations outstanding at once, so a handful of blocks,
+      // each grown to the largest handler it has held, serve every
+      // allocation in steady state. Blocks are claimed with an atomic
+      // flag because a handler may be allocated and freed on
+      // different threads.
+      class HandlerMemory : boost::noncopyable {
+      public:
+         enum { SlotCount = 4 };
+
+         HandlerMemory() {
+            for (auto& slot : slots_) {
+               slot.inUse.store(false, std::memory_order_relaxed);
+               slot.data.store(nullptr, std::memory_order_relaxed);
+               slot.size = 0;
+            }
+         }
+
+         ~HandlerMemory() {
+            for (auto& slot : slots_)
+               ::operator delete(slot.data.load(std::memory_order_relaxed));
+         }
+
+         void* allocate(size_t size) {
+            for (auto& slot : slots_) {
+               bool expected = false;
+               if (slot.inUse.load(std::memory_order_relaxed) ||
+                   !slot.inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                  continue;
+
+               if (slot.size < size) {
+                  void* data;
+                  try {
+                     data = ::operator new(size);
+                  }
+                  catch (...) {
+                     slot.inUse.store(false, std::memory_order_release);
+                     throw;
+                  }
+                  ::operator delete(slot.data.exchange(data, std::memory_order_relaxed));
+                  slot.size = size;
+               }
+               return slot.data.load(std::memory_order_relaxed);
+            }
+
+            // All blocks are in use.
+            return ::operator new(size);
+         }
+
+         void deallocate(void* pointer) {
+            for (auto& slot : slots_) {
+               if (slot.data.load(std::memory_order_relaxed) == pointer) {
+                  slot.inUse.store(false, std::memory_order_release);
+                  return;
+               }
+            }
+            ::operator delete(pointer);
+         }
+
+      private:
+         struct Slot {
+            std::atomic<bool> inUse;
+            std::atomic<void*> data;
+            size_t size;
+         };
+
+         Slot slots_[SlotCount];
+      };
+
+      // Wrap a handler so that asio allocates its operations from
+      // HandlerMemory. Invocation and continuation hooks are
+      // forwarded to the wrapped handler.
+      template<typename Handler>
+      class AllocHandler {
+      public:
+         template<typename H>
+         AllocHandler(const std::shared_ptr<HandlerMemory>& memory, H&& handler)
+            : memory_(memory)
+            , handler_(std::forward<H>(handler)) {
+         }
+
+         template<typename... Args>
+         void operator()(Args&&... args) {
+            handler_(std::forward<Args>(args)...);
+         }
+
+         friend void* asio_handler_allocate(size_t size, AllocHandler* handler) {
+            return handler->memory_->allocate(size);
+         }
+
+         friend void asio_handler_deallocate(void* pointer, size_t, AllocHandler* handler) {
+            handler->memory_->deallocate(pointer);
+         }
+
+         template<typename Function>
+         friend void asio_handler_invoke(Function& function, AllocHandler* handler) {
+            boost_asio_handler_invoke_helpers::invoke(function, handler->handler_);
+         }
+
+         template<typename Function>
+         friend void asio_handler_invoke(const Function& function, AllocHandler* handler) {
+            boost_asio_handler_invoke_helpers::invoke(function, handler->handler_);
+         }
+
+         friend bool asio_handler_is_continuation(AllocHandler* handler) {
+            return boost_asio_handler_cont_helpers::is_continuation(handler->handler_);
+         }
+
+      private:
+         std::shared_ptr<HandlerMemory> memory_;
+         Handler handler_;
+      };
+
+      template<typename Handler>
+      AllocHandler<typename std::decay<Handler>::type> make_alloc_handler(
+         const std::shared_ptr<HandlerMemory>& memory,
+         Handler&& handler) {
+         return AllocHandler<typename std::decay<Handler>::type>(
+            memory, std::forward<Handler>(handler));
+      }
+   }
+
+   namespace detail {
+      // Path parameters captured by a route match. Names reference
+      // the route table and values reference the request path, so
+      // matching does not allocate. The table snapshot is retained
+      // for the lifetime of the parameters.
+      class PathParameters {
+      public:
+         enum { Capacity = 8 };
+         typedef std::pair<boost::string_ref, boost::string_ref> value_type;
+         typedef const value_type* const_iterator;
+
+         PathParameters() : size_(0) {}
+
+         const_iterator begin() const { return parameters_; }
+         const_iterator end() const { return parameters_ + size_; }
+         size_t size() const { return size_; }
+         bool empty() const { return size_ == 0; }
+
+         const_iterator find(boost::string_ref name) const {
+            return std::find_if(
+               begin(), end(),
+               [=](const value_type& parameter) { return parameter.first == name; });
+         }
+
+         void push_back(boost::string_ref name, boost::string_ref value) {
+            assert(size_ < Capacity);
+            parameters_[size_++] = value_type(name, value);
+         }
+
+         void resize(size_t n) {
+            assert(n <= size_);
+            size_ = n;
+         }
+
+         void retain(const std::shared_ptr<const void>& owner) {
+            owner_ = owner;
+         }
+
+      private:
+         value_type parameters_[Capacity];
+         size_t size_;
+         std::shared_ptr<const void> owner_;
+      };
+
+      // Compressed radix tree of route patterns. A pattern is matched
+      // against the whole path. Within a pattern, ":name" matches a
+      // non-empty segment up to the next '/' and a trailing "*name"
+      // (or "*") matches the rest of the path, so "/static/*" routes a
+      // prefix. Static text is preferred over parameters, and
+      // parameters over wildcards, backtracking as needed. Exact
+      // paths, which may contain ':' and '*', are inserted with
+      // insert_exact().
+      //
+      // Nodes are immutable once inserted and shared between copies,
+      // so copying a router is cheap and an insertion copies only the
+      // nodes along its path.
+      template<typename Handler>
+      class Router {
+      public:
+         Router() : root_(std::make_shared<Node>()) {}
+
+         // An empty handler removes the route. Throws
+         // std::invalid_argument for a malformed pattern or one whose
+         // parameter names conflict with an existing route, and leaves
+         // the router unchanged.
+         void insert(const std::string& pattern, const Handler& handler) {
+            size_t nParameters = 0;
+            for (auto c : pattern)
+               nParameters += (c == ':' || c == '*');
+            if (nParameters > PathParameters::Capacity)
+               throw std::invalid_argument("too many route parameters: " + pattern);
+            set_root(insert(clone(root_), pattern, false, handler));
+         }
+
+         void insert_exact(const std::string& path, const Handler& handler) {
+            set_root(insert(clone(root_), path, true, handler));
+         }
+
+         // Returns the handler for path, or nullptr. Captured
+         // parameters are appended to parameters.
+         const Handler* find(boost::string_ref path, PathParameters& parameters) const {
+            return find(*root_, path, parameters);
+         }
+
+      private:
+         struct Node {
+            Node() : handler() {}
+
+            std::string label;
+            std::string name;
+            std::vector<std::shared_ptr<const Node> > children;
+            std::shared_ptr<const Node> parameter;
+            std::shared_ptr<const Node> wildcard;
+            Handler handler;
+         };
+         std::shared_ptr<const Node> root_;
+
+         static std::shared_ptr<Node> clone(const std::shared_ptr<const Node>& node) {
+            return node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+         }
+
+         void set_root(const std::shared_ptr<const Node>& root) {
+            root_ = root ? root : std::make_shared<Node>();
+         }
+
+         // Returns node, a private copy, with the route set, or null
+         // if node no longer leads to a handler.
+         static std::shared_ptr<const Node> insert(
+            const std::shared_ptr<Node>& node,
+            boost::string_ref pattern,
+            bool exact,
+            const Handler& handler) {
+            if (pattern.empty())
+               node->handler = handler;
+            else if (!exact && pattern[0] == ':') {
+               const auto name = pattern.substr(1, pattern.find('/') - 1);
+               if (node->parameter && node->parameter->name != name) {
+                  if (!handler)
+                     return node;
+                  throw std::invalid_argument("conflicting route parameter: " + name.to_string());
+               }
+               auto parameter = clone(node->parameter);
+               parameter->name = name.to_string();
+               node->parameter = insert(parameter, pattern.substr(name.size() + 1), exact, handler);
+            }
+            else if (!exact && pattern[0] == '*') {
+               const auto name = pattern.substr(1);
+               if (name.find('/') != boost::string_ref::npos)
+                  throw std::invalid_argument("route wildcard is not last: " + pattern.to_string());
+               if (node->wildcard && node->wildcard->name != name) {
+                  if (!handler)
+                     return node;
+                  throw std::invalid_argument("conflicting route wildcard: " + name.to_string());
+               }
+               auto wildcard = clone(node->wildcard);
+               wildcard->name = name.to_string();
+               wildcard->handler = handler;
+               node->wildcard = handler ? wildcard : nullptr;
+            }
+            else
+               insert_text(*node, pattern, exact, handler);
+
+            if (node->handler || !node->children.empty() || node->parameter || node->wildcard)
+               return node;
+            return nullptr;
+         }
+
+         // Static text up to the next parameter or wildcard shares the
+         // child with the same first character, which is split at the
+         // common prefix if necessary.
+         static void insert_text(
+            Node& node,
+            boost::string_ref pattern,
+            bool exact,
+            const Handler& handler) {
+            const auto text = exact ? pattern : pattern.substr(0, pattern.find_first_of(":*"));
+            for (auto i = node.children.begin(); i != node.children.end(); ++i) {
+               const auto& label = (*i)->label;
+               if (label[0] != text[0])
+                  continue;
+
+               const auto mismatch = std::mismatch(
+                  text.begin(), text.begin() + std::min(text.size(), label.size()),
+                  label.begin());
+               const size_t n = mismatch.first - text.begin();
+               std::shared_ptr<Node> child;
+               if (n == label.size())
+                  child = clone(*i);
+               else if (!handler)
+                  return;
+               else {
+                  auto rest = clone(*i);
+                  rest->label.erase(0, n);
+                  child = std::make_shared<Node>();
+                  child->label = label.substr(0, n);
+                  child->children.push_back(rest);
+               }
+
+               if (auto inserted = insert(child, pattern.substr(n), exact, handler))
+                  *i = inserted;
+               else
+                  node.children.erase(i);
+               return;
+            }
+
+            if (!handler)
+               return;
+            auto child = std::make_shared<Node>();
+            child->label = text.to_string();
+            node.children.push_back(insert(child, pattern.substr(text.size()), exact, handler));
+         }
+
+         static const Handler* find(
+            const Node& node,
+            boost::string_ref path,
+            PathParameters& parameters) {
+            if (path.empty() && node.handler)
+               return &node.handler;
+
+            if (!path.empty()) {
+               for (const auto& child : node.children) {
+                  if (child->label[0] == path[0]) {
+                     if (path.starts_with(child->label)) {
+                        if (auto handler = find(*child, path.substr(child->label.size()), parameters))
+                           return handler;
+                     }
+                     break;
+                  }
+               }
+
+               if (node.parameter) {
+                  const auto segment = path.substr(0, path.find('/'));
+                  if (!segment.empty()) {
+                     const size_t n = parameters.size();
+                     parameters.push_back(node.parameter->name, segment);
+                     if (auto handler = find(*node.parameter, path.substr(segment.size()), parameters))
+                        return handler;
+                     parameters.resize(n);
+                  }
+               }
+            }
+
+            if (node.wildcard && node.wildcard->handler) {
+               if (!node.wildcard->name.empty())
+                  parameters.push_back(node.wildcard->name, path);
+               return &node.wildcard->handler;
+            }
+            return nullptr;
+         }
+      };
+
+      // Routes to server handlers. Updates are serialized by a mutex
+      // and publish a new immutable router, so lookups read a
+      // snapshot without locking. Servers may share a table.
+      template<typename Handler>
+      class HandlerTable : boost::noncopyable {
+      public:
+         typedef detail::Router<Handler> Router;
+
+         HandlerTable()
+            : router_(std::make_shared<Router>()) {
+         }
+
+         // Set the handler for an exact path. An empty handler
+         // removes the route.
+         void set(const std::string& path, const Handler& handler) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto router = std::make_shared<Router>(*router_);
+            router->insert_exact(path, handler);
+            std::atomic_store(&router_, std::shared_ptr<const Router>(router));
+         }
+
+         // As set() for a route pattern. If the pattern is rejected
+         // the table is left unchanged.
+         void set_route(const std::string& pattern, const Handler& handler) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto router = std::make_shared<Router>(*router_);
+            router->insert(pattern, handler);
+            std::atomic_store(&router_, std::shared_ptr<const Router>(router));
+         }
+
+         std::shared_ptr<const Router> snapshot() const {
+            return std::atomic_load(&router_);
+         }
+
+      private:
+         std::mutex mutex_;
+         std::shared_ptr<const Router> router_;
+      };
+   }
+
+   namespace detail {
+      // Hashed timing wheel for connection timeouts. Rescheduling to
+      // a later deadline only stores the deadline, and the timer is
+      // moved to the later slot when its current slot comes around;
+      // only an earlier deadline takes the lock to link the timer
+      // again. Each tick therefore visits only the entries in one
+      // slot, however many connections are open.
+      class TimerWheel : boost::noncopyable {
+      public:
+         typedef std::chrono::steady_clock::duration duration;
+
+         // Base class for objects with a deadline. expire() is called
+         // from tick() once the deadline passes.
+         class Timer {
+         public:
+            Timer() : deadline_(0), linked_(0) {}
+            virtual ~Timer() {}
+
+         private:
+            friend class TimerWheel;
+            virtual void expire() = 0;
+
+            // Tick numbers of the deadline and of the slot visit the
+            // timer is linked for, or 0 for none.
+            std::atomic<uint64_t> deadline_;
+            std::atomic<uint64_t> linked_;
+         };
+
+         enum { DefaultSlotCount = 64 };
+         explicit TimerWheel(
+            duration resolution = std::chrono::seconds(1),
+            size_t nSlots = DefaultSlotCount)
+            : resolution_(resolution)
+            , slots_(nSlots)
+            , now_(1) {
+         }
+
+         duration resolution() const {
+            return resolution_;
+         }
+
+         // Set the timer to expire after at least timeout, replacing
+         // any previous deadline.
+         void schedule(const std::shared_ptr<Timer>& timer, duration timeout) {
+            const uint64_t nTicks = (timeout + resolution_ - duration(1)) / resolution_;
+            const uint64_t deadline = now_ + nTicks + 1;
+            timer->deadline_ = deadline;
+            if (needs_link(*timer, deadline)) {
+               std::lock_guard<std::mutex> lock(mutex_);
+               if (needs_link(*timer, deadline))
+                  link(timer, deadline);
+            }
+         }
+
+         void cancel(Timer& timer) {
+            timer.deadline_ = 0;
+         }
+
+         // Advance one resolution step and expire due timers.
+         void tick() {
+            std::vector<std::shared_ptr<Timer> > expired;
+            {
+               std::lock_guard<std::mutex> lock(mutex_);
+               const uint64_t now = ++now_;
+               auto& slot = slots_[now % slots_.size()];
+               visiting_.swap(slot);
+               for (const auto& entry : visiting_) {
+                  // Keep entries for a later turn of the wheel and
+                  // drop those superseded by an earlier link.
+                  auto timer = entry.timer.lock();
+                  if (!timer)
+                     continue;
+                  if (entry.tick > now) {
+                     slot.push_back(entry);
+                     continue;
+                  }
+                  if (timer->linked_ != entry.tick)
+                     continue;
+
+                  uint64_t deadline = timer->deadline_;
+                  if (deadline > now) {
+                     link(timer, deadline);
+                     continue;
+                  }
+
+                  if (deadline && timer->deadline_.compare_exchange_strong(deadline, 0))
+                     expired.push_back(timer);
+
+                  // Unlink, then relink if the timer was rescheduled
+                  // concurrently.
+                  timer->linked_ = 0;
+                  deadline = timer->deadline_;
+                  if (deadline)
+                     link(timer, deadline);
+               }
+               visiting_.clear();
+            }
+
+            for (const auto& timer : expired)
+               timer->expire();
+         }
+
+      private:
+         struct Entry {
+            std::weak_ptr<Timer> timer;
+            uint64_t tick;
+         };
+
+         duration resolution_;
+         std::mutex mutex_;
+         std::vector<std::vector<Entry> > slots_;
+         std::vector<Entry> visiting_;
+         std::atomic<uint64_t> now_;
+
+         static bool needs_link(const Timer& timer, uint64_t deadline) {
+            const uint64_t linked = timer.linked_;
+            return !linked || deadline < linked;
+         }
+
+         void link(const std::shared_ptr<Timer>& timer, uint64_t deadline) {
+            timer->linked_ = deadline;
+            slots_[deadline % slots_.size()].push_back(Entry{ timer, deadline });
+         }
+      };
+
+      // True if a read from stream can complete from data the stream
+      // itself holds, without the socket becoming readable.
+      template<typename T>
+      struct ReadBuffered {
+         static bool check(T&) { return false; }
+      };
+
+#ifndef _WIN32
+      // Wait until a descriptor is readable, failing with timed_out
+      // at deadline.
+      inline bool wait_readable(
+         int fd,
+         std::chrono::steady_clock::time_point deadline,
+         boost::system::error_code& error) {
+         pollfd p = { fd, POLLIN, 0 };
+         for (;;) {
+            // Round up so an unexpired deadline is not polled as 0.
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+               deadline - std::chrono::steady_clock::now() + std::chrono::microseconds(999));
+            const int n = ::poll(&p, 1, static_cast<int>(std::max<int64_t>(remaining.count(), 0)));
+            if (n > 0)
+               return true;
+            if (n == 0) {
+               error = make_error_code(boost::asio::error::timed_out);
+               return false;
+            }
+            if (errno != EINTR) {
+               error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+               return false;
+            }
+         }
+      }
+#endif
+   }
+
+   // This is a wrapper for a boost::asio stream class (e.g.
+   // boost::asio::ip::tcp::socket). It provides these features:
+   //
+   // 1. Asynchronous operations are thread-safe via a strand.
+   // 2. A put back buffer is available for overread data.
+   // 3. Stream lifetime is ensured (via shared_ptr) for asynchronous
+   //    operations.
+   // 4. A write buffer, gather list, and receive buffer are kept for
+   //    protocol framing, so their capacity is reused for the life
+   //    of the connection.
+   // 5. Handler memory is recycled for the connection's
+   //    asynchronous operations.
+   // 6. The stream can be closed by a timeout on a shared timer
+   //    wheel, and synchronous reads can be given a deadline.
+   template<typename T>
+   class Stream : public std::enable_shared_from_this<Stream<T> >
+                , public detail::TimerWheel::Timer
+                , boost::noncopyable {
+   public:
+      typedef T stream_t;
+      
+      virtual ~Stream() {}
+
+      stream_t& stream() {
+         return stream_;
+      }
+      
+      boost::asio::io_service& get_io_service() {
+         return stream_.get_io_service();
+      }
+
+      template<typename MutableBufferSequence, typename ReadHandler>
+      void async_read_some(
+         const MutableBufferSequence& buffers,
+         ReadHandler&& handler) {
+         if (!readBuffer_.empty()) {
+            // Call the synchronous function. It won't block because
+            // the data are buffered.
+            boost::system::error_code error;
+            const auto nBytes = read_some(buffers, error);
+            get_io_service().post(detail::make_alloc_handler(handlerMemory_, [=]() mutable {
+                  handler(error, nBytes);
+               }));
+         }
+         else {
+            auto this_ = this->shared_from_this();
+            strand_.dispatch(detail::make_alloc_handler(handlerMemory_, [=]() mutable {
+                  // Wrapping the handler is unnecessary because the
+                  // call is not a composed operation.
+                  this_->stream_.async_read_some(buffers, handler);
+               }));
+         }
+      }
+
+      template<typename ConstBufferSequence, typename WriteHandler>
+      void async_write_some(
+         const ConstBufferSequence& buffers,
+         WriteHandler&& handler) {
+         auto this_ = this->shared_from_this();
+         strand_.dispatch(detail::make_alloc_handler(handlerMemory_, [=]() mutable {
+               // Wrapping the handler is unnecessary because the call
+               // is not a composed operation.
+               this_->stream_.async_write_some(buffers, handler);
+            }));
+      }
+
+      template<typename MutableBufferSequence>
+      size_t read_some(
+         const MutableBufferSequence& buffers,
+         boost::system::error_code& error) {
+         if (!readBuffer_.empty())
+            return readBuffer_.read(buffers);
+#ifndef _WIN32
+         if (readDeadline_ != std::chrono::steady_clock::time_point() &&
+             !detail::ReadBuffered<T>::check(stream_) &&
+             !detail::wait_readable(stream_.lowest_layer().native_handle(), readDeadline_, error)) {
+            if (error == boost::asio::error::timed_out) {
+               boost::system::error_code ignored;
+               stream_.lowest_layer().shutdown(boost::asio::socket_base::shutdown_both, ignored);
+            }
+            return 0;
+         }
+#endif
+         return stream_.read_some(buffers, error);
+      }
+      
+      template<typename MutableBufferSequence>
+      size_t read_some(
+         const MutableBufferSequence& buffers) {
+         boost::system::error_code error;
+         const auto nBytes = read_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+
+      template<typename ConstBufferSequence>
+      size_t write_some(
+         const ConstBufferSequence& buffers,
+         boost::system::error_code& error) {
+         return stream_.write_some(buffers, error);
+      }
+
+      template<typename ConstBufferSequence>
+      size_t write_some(
+         const ConstBufferSequence& buffers) {
+         boost::system::error_code error;
+         const auto nBytes = write_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+      
+      template<typename ConstBufferSequence>
+      void put_back(const ConstBufferSequence& buffers) {
+         readBuffer_.put_back(buffers);
+      }
+
+      // Only one write may use these at a time.
+      std::vector<char>& write_buffer() {
+         return writeBuffer_;
+      }
+
+      detail::GatherList& gather_list() {
+         return gatherList_;
+      }
+
+      // The receive buffer is kept with the connection so bytes read
+      // past the end of one request stay in place for the next. It
+      // is created on first use with the given maximum size, and
+      // replaced if a large request grew it, so that idle connections
+      // stay small. It is only replaced when empty and not held by a
+      // transaction, which may still be reading its body into it
+      // when the client pipelines.
+      std::shared_ptr<detail::ReceiveBuffer> receive_buffer(size_t maxSize) {
+         if (!receiveBuffer_ ||
+             (receiveBuffer_.use_count() == 1 &&
+              receiveBuffer_->size() == 0 &&
+              receiveBuffer_->allocated() > detail::ReceiveBuffer::RetainSize))
+            receiveBuffer_ = std::make_shared<detail::ReceiveBuffer>(maxSize);
+         return receiveBuffer_;
+      }
+
+      // The strand that serializes this connection's asynchronous
+      // operations.
+      boost::asio::io_service::strand& strand() {
+         return strand_;
+      }
+
+      // Pass to detail::make_alloc_handler() for operations on this
+      // connection.
+      const std::shared_ptr<detail::HandlerMemory>& handler_memory() const {
+         return handlerMemory_;
+      }
+
+      // Fail synchronous reads with timed_out, and shut down the
+      // stream as expire() does, once deadline passes without data.
+      // The socket is polled by the reading thread, so unlike the
+      // timer wheel this works while a handler holds the only io
+      // thread. A default time_point removes the deadline.
+      void set_read_deadline(std::chrono::steady_clock::time_point deadline) {
+         readDeadline_ = deadline;
+      }
+
+      // Close the stream unless the timeout is rescheduled or
+      // cancelled before it elapses. This has no effect without a
+      // timer wheel, and a zero timeout cancels.
+      void set_timer_wheel(const std::shared_ptr<detail::TimerWheel>& wheel) {
+         timerWheel_ = wheel;
+      }
+
+      void expires_from_now(detail::TimerWheel::duration timeout) {
+         if (timerWheel_) {
+            if (timeout != detail::TimerWheel::duration::zero())
+               timerWheel_->schedule(this->shared_from_this(), timeout);
+            else
+               timerWheel_->cancel(*this);
+         }
+      }
+
+      void cancel_timeout() {
+         if (timerWheel_)
+            timerWheel_->cancel(*this);
+      }
+
+   protected:
+      template<typename... Args>
+      Stream(Args&&... args)
+         : stream_(std::forward<Args>(args)...)
+         , strand_(stream_.get_io_service())
+         , handlerMemory_(std::make_shared<detail::HandlerMemory>()) {
+      }
+
+   private:
+      T stream_;
+      boost::asio::io_service::strand strand_;
+      detail::PutBackBuffer readBuffer_;
+      std::shared_ptr<detail::ReceiveBuffer> receiveBuffer_;
+      std::vector<char> writeBuffer_;
+      detail::GatherList gatherList_;
+      std::shared_ptr<detail::HandlerMemory> handlerMemory_;
+      std::shared_ptr<detail::TimerWheel> timerWheel_;
+      std::chrono::steady_clock::time_point readDeadline_;
+
+      // Wheel timeouts are only armed around asynchronous operations,
+      // but a timer can fire just as its operation completes and the
+      // handler goes on to synchronous I/O, which does not run on
+      // the strand. So the socket is shut down rather than closed:
+      // pending operations fail and the peer sees the connection
+      // end, but the descriptor stays valid until the connection
+      // is released.
+      void expire() {
+         auto this_ = this->shared_from_this();
+         strand_.dispatch(detail::make_alloc_handler(handlerMemory_, [=]() {
+                  boost::system::error_code error;
+                  this_->stream_.lowest_layer().shutdown(
+                     boost::asio::socket_base::shutdown_both, error);
+               }));
+      }
+   };
+
+   // This is a wrapped boost::asio TCP stream.
+   class TCP : public Stream<boost::asio::ip::tcp::socket> {
+   public:
+      template<typename CreateHandler>
+      static void async_connect(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         CreateHandler handler) {
+         std::shared_ptr<TCP> tcp(new TCP(acceptor.get_io_service()));
+         acceptor.async_accept(
+            tcp->stream(),
+            detail::make_alloc_handler(tcp->handler_memory(), [=](const boost::system::error_code& error) mutable {
+               if (error)
+                  tcp.reset();
+               handler(error, tcp);
+            }));
+      }
+
+      static std::shared_ptr<TCP> create(boost::asio::ip::tcp::socket&& socket) {
+         return std::shared_ptr<TCP>(new TCP(std::move(socket)));
+      }
+
+      ~TCP() {
+         if (stream().is_open()) {
+            boost::system::error_code error;
+            stream().shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
+            stream().close(error);
+         }
+      }
+   private:
+      TCP(boost::asio::io_service& io)
+         : Stream<boost::asio::ip::tcp::socket>(io) {
+      }
+
+      TCP(boost::asio::ip::tcp::socket&& socket)
+         : Stream<boost::asio::ip::tcp::socket>(std::move(socket)) {
+      }
+   };
+
+#ifdef BOOST_ASIO_SSL_HPP
+   namespace detail {
+      // Decrypted data, or records received but not yet decrypted.
+      template<>
+      struct ReadBuffered<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> > {
+         static bool check(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& stream) {
+            SSL* ssl = stream.native_handle();
+            return SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+         }
+      };
+   }
+
+   class TLS : public Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> > {
+   public:
+      typedef boost::system::error_code error_code;
+      
+      template<typename CreateHandler>
+      static void async_connect(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         boost::asio::ssl::context& context,
+         CreateHandler handler) {
+         // Accept a TCP connection.
+         std::shared_ptr<TLS> tls(new TLS(acceptor.get_io_service(), context));
+         acceptor.async_accept(
+            tls->stream().lowest_layer(),
+            detail::make_alloc_handler(tls->handler_memory(), [=](const error_code& error) {
+               if (error) {
+                  handler(error, tls);
+                  return;
+               }
+
+               // Perform TLS handshake.
+               tls->stream().async_handshake(
+                  boost::asio::ssl::stream_base::server,
+                  detail::make_alloc_handler(tls->handler_memory(), [=](const error_code& error) {
+                        handler(error, tls);
+                  }));
+            }));
+      }
+
+      template<typename ShutdownHandler>
+      void async_shutdown(ShutdownHandler&& handler) {
+         stream().async_shutdown(std::forward<ShutdownHandler>(handler));
+      }
+      
+   private:
+      TLS(boost::asio::io_service& io, boost::asio::ssl::context& context)
+         : Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> >(io, context) {
+      }
+   
+   };
+#endif // BOOST_ASIO_SSL_HPP
+
+#ifndef _WIN32
+   namespace detail {
+      // Free list of fixed size blocks for reading files into. Up to
+      // MaxFree blocks are kept for reuse.
+      class BlockPool : boost::noncopyable {
+      public:
+         enum { BlockSize = 65536, MaxFree = 64 };
+
+         static BlockPool& instance() {
+            static BlockPool pool;
+            return pool;
+         }
+
+         std::unique_ptr<char[]> acquire() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.empty())
+               return std::unique_ptr<char[]>(new char[BlockSize]);
+
+            auto block = std::move(free_.back());
+            free_.pop_back();
+            return block;
+         }
+
+         void release(std::unique_ptr<char[]>&& block) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (block && free_.size() < MaxFree)
+               free_.push_back(std::move(block));
+         }
+
+      private:
+         std::mutex mutex_;
+         std::vector<std::unique_ptr<char[]> > free_;
+      };
+
+      // Read up to n bytes of a file at offset. Reading past the end
+      // of the file is an error.
+      inline size_t read_file(int fd, char* data, size_t n, uint64_t offset, boost::system::error_code& error) {
+         ssize_t result;
+         do {
+            result = ::pread(fd, data, n, static_cast<off_t>(offset));
+         } while (result < 0 && errno == EINTR);
+
+         if (result < 0) {
+            error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            return 0;
+         }
+         if (result == 0)
+            error = make_error_code(boost::asio::error::eof);
+         return result;
+      }
+
+      // Copy up to n bytes of a file at offset directly to a socket.
+      // The error is would_block when the socket is full, and
+      // operation_not_supported where the stream or file cannot be
+      // used (the caller then reads and writes instead).
+      template<typename SyncWriteStream>
+      size_t send_file_some(SyncWriteStream&, int, uint64_t, size_t, boost::system::error_code& error) {
+         error = make_error_code(boost::asio::error::operation_not_supported);
+         return 0;
+      }
+
+#ifdef __linux__
+      inline size_t send_file_some(
+         boost::asio::ip::tcp::socket& socket,
+         int fd,
+         uint64_t offset,
+         size_t n,
+         boost::system::error_code& error) {
+         // Make the descriptor non-blocking without changing the
+         // socket's synchronous operations.
+         socket.native_non_blocking(true, error);
+         if (error)
+            return 0;
+
+         off_t position = static_cast<off_t>(offset);
+         ssize_t result;
+         do {
+            result = ::sendfile(socket.native_handle(), fd, &position, std::min<size_t>(n, 1 << 30));
+         } while (result < 0 && errno == EINTR);
+
+         if (result < 0) {
+            if (errno == EINVAL || errno == ENOSYS)
+               error = make_error_code(boost::asio::error::operation_not_supported);
+            else
+               error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            return 0;
+         }
+         if (result == 0)
+            error = make_error_code(boost::asio::error::eof);
+         return result;
+      }
+#endif
+
+      // Wait until a descriptor is writable.
+      inline void wait_writable(int fd, boost::system::error_code& error) {
+         pollfd p = { fd, POLLOUT, 0 };
+         while (::poll(&p, 1, -1) < 0) {
+            if (errno != EINTR) {
+               error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+               return;
+            }
+         }
+      }
+   }
+#endif
+
+   namespace detail {
+      // Orders the responses of concurrently handled requests on a
+      // connection (see BaseHTTPServer::set_pipeline_depth()). Each
+      // transaction takes the next sequence number, and its response
+      // bytes are queued and written by a single write loop in
+      // sequence order, so responses never interleave.
+      //
+      // An asynchronous write to the head of line response completes
+      // when its bytes are written to the stream. One to a later
+      // response completes once its bytes are copied, until the
+      // response has more than MaxQueuedBytes queued; then it waits
+      // until the response reaches the head of line and is written.
+      //
+      // A synchronous write to the head of line response is written
+      // directly when no write is in progress. Otherwise it is copied
+      // whatever the limit: handlers run on io_service threads, and
+      // waiting for the responses ahead could block the only thread
+      // able to write them.
+      template<typename T>
+      class ResponseQueue : public std::enable_shared_from_this<ResponseQueue<T> >
+                          , boost::noncopyable {
+      public:
+         typedef boost::system::error_code error_code;
+         typedef std::function<void(const error_code&)> WriteHandler;
+
+         enum { MaxQueuedBytes = 1 << 20 };
+
+         explicit ResponseQueue(const std::shared_ptr<T>& stream)
+            : stream_(stream)
+            , next_(0)
+            , head_(0)
+            , last_(std::numeric_limits<uint64_t>::max())
+            , writing_(false) {
+         }
+
+         uint64_t push() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return next_++;
+         }
+
+         // The number of responses not yet completely written.
+         size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return next_ - head_;
+         }
+
+         // False if the response will not be sent because an earlier
+         // one closes the connection or a write failed.
+         bool expects(uint64_t sequence) const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return sequence <= last_ && !error_;
+         }
+
+         // Queue bytes produced by append(std::vector<char>&) and call
+         // handler as described above.
+         template<typename Append>
+         void async_append(uint64_t sequence, Append append, WriteHandler handler) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (auto error = check(sequence)) {
+               post(handler, error);
+               return;
+            }
+
+            auto& response = responses_[sequence];
+            append(response.bytes);
+            if (sequence != head_ && response.bytes.size() <= MaxQueuedBytes)
+               post(handler, error_code());
+            else
+               response.handlers.push_back(std::move(handler));
+            write();
+         }
+
+         // Synchronously queue bytes produced by
+         // append(std::vector<char>&) as described above.
+         template<typename Append>
+         error_code append(uint64_t sequence, Append append) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (auto error = check(sequence))
+               return error;
+
+            auto& response = responses_[sequence];
+            append(response.bytes);
+            if (sequence != head_ || writing_) {
+               write();
+               return error_code();
+            }
+
+            // Write the response's queued bytes from this thread.
+            std::vector<char> bytes;
+            std::vector<WriteHandler> handlers;
+            bytes.swap(response.bytes);
+            handlers.swap(response.handlers);
+            writing_ = true;
+            lock.unlock();
+
+            error_code error;
+            if (!bytes.empty())
+               boost::asio::write(*stream_, boost::asio::buffer(bytes), error);
+
+            lock.lock();
+            writing_ = false;
+            complete(handlers, error);
+            if (error)
+               fail(error);
+            else
+               write();
+            return error;
+         }
+
+         // The response is complete; later responses may follow it.
+         void finish(uint64_t sequence) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (sequence <= last_) {
+               responses_[sequence].finished = true;
+               write();
+            }
+         }
+
+         // Drop responses after sequence, which closes the connection.
+         void close_after(uint64_t sequence) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            last_ = std::min(last_, sequence);
+            const auto dropped = responses_.upper_bound(last_);
+            for (auto i = dropped; i != responses_.end(); ++i)
+               complete(i->second.handlers, make_error_code(boost::asio::error::operation_aborted));
+            responses_.erase(dropped, responses_.end());
+         }
+
+         // Call handler once the response that closes the connection
+         // has been written, or a write fails.
+         void async_wait_last(WriteHandler handler) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (error_ || head_ > last_)
+               post(handler, error_);
+            else
+               lastHandlers_.push_back(std::move(handler));
+         }
+
+      private:
+         struct Response {
+            Response() : finished(false) {}
+
+            std::vector<char> bytes;
+            std::vector<WriteHandler> handlers;
+            bool finished;
+         };
+
+         std::shared_ptr<T> stream_;
+         mutable std::mutex mutex_;
+         std::map<uint64_t, Response> responses_;
+         uint64_t next_;
+         uint64_t head_;
+         uint64_t last_;
+         bool writing_;
+         std::vector<char> buffer_;
+         std::vector<WriteHandler> bufferHandlers_;
+         std::vector<WriteHandler> lastHandlers_;
+         error_code error_;
+
+         // The remaining members are called with the mutex held.
+         error_code check(uint64_t sequence) const {
+            if (error_)
+               return error_;
+            if (sequence > last_)
+               return make_error_code(boost::asio::error::operation_aborted);
+            return error_code();
+         }
+
+         void post(const WriteHandler& handler, const error_code& error) {
+            stream_->get_io_service().post(
+               make_alloc_handler(stream_->handler_memory(), std::bind(handler, error)));
+         }
+
+         void complete(std::vector<WriteHandler>& handlers, const error_code& error) {
+            for (const auto& handler : handlers)
+               post(handler, error);
+            handlers.clear();
+         }
+
+         void fail(const error_code& error) {
+            error_ = error;
+            for (auto& response : responses_)
+               complete(response.second.handlers, error);
+            responses_.clear();
+            complete(lastHandlers_, error);
+         }
+
+         // Start writing the head of line response if idle.
+         void write() {
+            if (writing_ || error_)
+               return;
+
+            for (auto i = responses_.begin();
+                 i != responses_.end() && i->first == head_;
+                 i = responses_.begin()) {
+               if (!i->second.bytes.empty()) {
+                  writing_ = true;
+                  buffer_.swap(i->second.bytes);
+                  bufferHandlers_.swap(i->second.handlers);
+                  auto this_ = this->shared_from_this();
+                  boost::asio::async_write(
+                     *stream_, boost::asio::buffer(buffer_),
+                     make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+                        std::lock_guard<std::mutex> lock(this_->mutex_);
+                        this_->writing_ = false;
+                        this_->buffer_.clear();
+                        this_->complete(this_->bufferHandlers_, error);
+                        if (error)
+                           this_->fail(error);
+                        else
+                           this_->write();
+                     }));
+                  return;
+               }
+
+               // Writes that added no bytes are complete.
+               complete(i->second.handlers, error_code());
+               if (!i->second.finished)
+                  return;
+               responses_.erase(i);
+               ++head_;
+            }
+
+            if (head_ > last_)
+               complete(lastHandlers_, error_code());
+         }
+      };
+   }
+
+   namespace detail {
+      // The entity tag of a content coding of the representation
+      // tagged etag, e.g. "abc" becomes "abc-gzip".
+      inline std::string coded_etag(boost::string_ref etag, boost::string_ref coding) {
+         if (etag.size() < 2 || etag.back() != '"')
+            return etag.to_string();
+         std::string s(etag.data(), etag.size() - 1);
+         s += '-';
+         s.append(coding.data(), coding.size());
+         s += '"';
+         return s;
+      }
+
+      // True if an Accept-Encoding value allows a content coding,
+      // i.e. lists it without q=0.
+      inline bool accepts_encoding(boost::string_ref acceptEncoding, boost::string_ref coding) {
+         while (!acceptEncoding.empty()) {
+            auto comma = acceptEncoding.find(',');
+            auto element = acceptEncoding.substr(0, comma);
+            acceptEncoding = comma == boost::string_ref::npos ?
+               boost::string_ref() : acceptEncoding.substr(comma + 1);
+
+            auto semicolon = element.find(';');
+            auto token = element.substr(0, semicolon);
+            while (!token.empty() && (token.front() == ' ' || token.front() == '\t'))
+               token.remove_prefix(1);
+            while (!token.empty() && (token.back() == ' ' || token.back() == '\t'))
+               token.remove_suffix(1);
+            if (!caseless_equal(token, coding))
+               continue;
+
+            if (semicolon == boost::string_ref::npos)
+               return true;
+            auto parameters = element.substr(semicolon);
+            auto equals = parameters.find('=');
+            if (equals == boost::string_ref::npos)
+               return true;
+            auto q = parameters.substr(equals + 1);
+            while (!q.empty() && q.front() == ' ')
+               q.remove_prefix(1);
+            return !(q.starts_with("0") && q.find_first_not_of("0. ") == boost::string_ref::npos);
+         }
+         return false;
+      }
+
+      // An inclusive byte range of a representation.
+      struct ByteRange {
+         uint64_t first;
+         uint64_t last;
+
+         uint64_t size() const { return last - first + 1; }
+      };
+
+      enum range_result {
+         range_ignored,          // no Range, or one to ignore
+         range_satisfiable,
+         range_unsatisfiable
+      };
+
+      // Parse a Range value (RFC 7233) against a representation of
+      // size bytes into its satisfiable ranges. Malformed values,
+      // units other than bytes, and more than maxRanges ranges are
+      // ignored, so the full representation is sent.
+      inline range_result parse_ranges(
+         boost::string_ref value,
+         uint64_t size,
+         std::vector<ByteRange>& ranges,
+         size_t maxRanges = 16) {
+         ranges.clear();
+         if (value.size() < 6 || !caseless_equal(value.substr(0, 6), "bytes="))
+            return range_ignored;
+         value.remove_prefix(6);
+
+         size_t nSpecs = 0;
+         while (!value.empty()) {
+            auto comma = value.find(',');
+            auto spec = value.substr(0, comma);
+            value = comma == boost::string_ref::npos ?
+               boost::string_ref() : value.substr(comma + 1);
+
+            while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t'))
+               spec.remove_prefix(1);
+            while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t'))
+               spec.remove_suffix(1);
+            if (spec.empty())
+               continue;
+            if (++nSpecs > maxRanges)
+               return range_ignored;
+
+            const auto dash = spec.find('-');
+            if (dash == boost::string_ref::npos)
+               return range_ignored;
+
+            ByteRange range;
+            uint64_t n;
+            if (dash == 0) {
+               // A suffix: the last n bytes.
+               if (!parse_decimal(spec.substr(1), n))
+                  return range_ignored;
+               if (n == 0 || size == 0)
+                  continue;
+               range.first = size - std::min(n, size);
+               range.last = size - 1;
+            }
+            else {
+               if (!parse_decimal(spec.substr(0, dash), range.first))
+                  return range_ignored;
+               if (dash + 1 == spec.size())
+                  range.last = size - 1;
+               else if (!parse_decimal(spec.substr(dash + 1), range.last) ||
+                        range.last < range.first)
+                  return range_ignored;
+               if (range.first >= size)
+                  continue;
+               range.last = std::min(range.last, size - 1);
+            }
+            ranges.push_back(range);
+         }
+
+         if (nSpecs == 0)
+            return range_ignored;
+         return ranges.empty() ? range_unsatisfiable : range_satisfiable;
+      }
+
+      // Serialized multipart/byteranges framing: the delimiter and
+      // part headers preceding each range, then the close delimiter.
+      class ByteRangesParts {
+      public:
+         ByteRangesParts(
+            uint64_t size,
+            const std::vector<ByteRange>& ranges,
+            boost::string_ref contentType) {
+            static std::atomic<uint64_t> counter(
+               std::chrono::steady_clock::now().time_since_epoch().count());
+            std::ostringstream boundary;
+            boundary << "chunky" << std::hex << (counter++ * 0x9e3779b97f4a7c15ull);
+            boundary_ = boundary.str();
+
+            for (const auto& range : ranges) {
+               std::ostringstream part;
+               part << "\r\n--" << boundary_ << "\r\n";
+               if (!contentType.empty())
+                  part << "Content-Type: " << contentType << "\r\n";
+               part << "Content-Range: bytes " << range.first << '-' << range.last << '/' << size
+                    << "\r\n\r\n";
+               parts_.push_back(part.str());
+            }
+            parts_.push_back("\r\n--" + boundary_ + "--\r\n");
+         }
+
+         const std::string& boundary() const { return boundary_; }
+
+         // One per range, then the close delimiter.
+         const std::vector<std::string>& parts() const { return parts_; }
+
+      private:
+         std::string boundary_;
+         std::vector<std::string> parts_;
+      };
+   }
+
+   namespace detail {
+      // Incremental parser for chunked transfer coding framing: chunk
+      // sizes, extensions (skipped), and delimiters. It stops at each
+      // chunk's payload, whose size the caller consumes before
+      // calling end_data(), and after the terminating chunk, where
+      // trailers follow.
+      class ChunkDecoder {
+      public:
+         enum State {
+            size_state,
+            extension_state,
+            size_lf_state,
+            data_state,
+            data_cr_state,
+            data_lf_state,
+            last_state
+         };
+
+         enum {
+            MaxSizeDigits = 2 * sizeof(size_t),
+            MaxExtensionSize = 4096
+         };
+
+         ChunkDecoder() {
+            reset();
+         }
+
+         void reset() {
+            state_ = size_state;
+            size_ = 0;
+            count_ = 0;
+         }
+
+         State state() const { return state_; }
+
+         // The size of the current chunk in data_state.
+         size_t size() const { return size_; }
+
+         void end_data() {
+            state_ = data_cr_state;
+         }
+
+         // Parse framing from [p, end) until payload, the end of the
+         // terminating chunk, or an error. Returns the end of the
+         // parsed bytes.
+         const char* parse(const char* p, const char* end, boost::system::error_code& error) {
+            for (; p != end; ++p) {
+               const char c = *p;
+               switch (state_) {
+               case size_state:
+                  if (std::isxdigit(static_cast<unsigned char>(c))) {
+                     if (++count_ > MaxSizeDigits) {
+                        error = make_error_code(invalid_chunk_length);
+                        return p;
+                     }
+                     size_ = 16 * size_ + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                     break;
+                  }
+                  if (!count_) {
+                     error = make_error_code(invalid_chunk_length);
+                     return p;
+                  }
+                  count_ = 0;
+                  if (c == '\r')
+                     state_ = size_lf_state;
+                  else if (c == ';' || c == ' ' || c == '\t')
+                     state_ = extension_state;
+                  else {
+                     error = make_error_code(invalid_chunk_length);
+                     return p;
+                  }
+                  break;
+
+               case extension_state:
+                  if (c == '\r')
+                     state_ = size_lf_state;
+                  else if (++count_ > MaxExtensionSize) {
+                     error = make_error_code(invalid_chunk_length);
+                     return p;
+                  }
+                  break;
+
+               case size_lf_state:
+                  if (c != '\n') {
+                     error = make_error_code(invalid_chunk_length);
+                     return p;
+                  }
+                  count_ = 0;
+                  state_ = size_ ? data_state : last_state;
+                  return p + 1;
+
+               case data_cr_state:
+                  if (c != '\r') {
+                     error = make_error_code(invalid_chunk_delimiter);
+                     return p;
+                  }
+                  state_ = data_lf_state;
+                  break;
+
+               case data_lf_state:
+                  if (c != '\n') {
+                     error = make_error_code(invalid_chunk_delimiter);
+                     return p;
+                  }
+                  reset();
+                  break;
+
+               case data_state:
+               case last_state:
+                  return p;
+               }
+            }
+            return p;
+         }
+
+      private:
+         State state_;
+         size_t size_;
+         size_t count_;
+      };
+
+      // The first non-empty buffer of a sequence, for reads that
+      // fill one buffer at a time.
+      template<typename MutableBufferSequence>
+      boost::asio::mutable_buffer first_buffer(const MutableBufferSequence& buffers) {
+         for (const auto& b : buffers) {
+            const boost::asio::mutable_buffer buffer(b);
+            if (boost::asio::buffer_size(buffer))
+               return buffer;
+         }
+         return boost::asio::mutable_buffer();
+      }
+   }
+
+#ifdef ZLIB_H
+   namespace detail {
+      // zlib state for the gzip or deflate (zlib format) content
+      // coding. Output of each call replaces the previous output.
+      class Deflater : boost::noncopyable {
+      public:
+         enum { OutputStep = 16384 };
+
+         Deflater(bool gzip, int level)
+            : gzip_(gzip)
+            , level_(level) {
+            std::memset(&stream_, 0, sizeof(stream_));
+            if (deflateInit2(&stream_, level, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+               throw std::bad_alloc();
+         }
+
+         ~Deflater() {
+            deflateEnd(&stream_);
+         }
+
+         bool gzip() const { return gzip_; }
+
+         // Start a new stream.
+         void reset(int level) {
+            deflateReset(&stream_);
+            if (level != level_ && deflateParams(&stream_, level, Z_DEFAULT_STRATEGY) == Z_OK)
+               level_ = level;
+         }
+
+         // Compress buffers and flush, so each write reaches the
+         // client whole, or end the stream if finish is set.
+         template<typename ConstBufferSequence>
+         const std::vector<char>& deflate(const ConstBufferSequence& buffers, bool finish) {
+            output_.clear();
+            for (const auto& b : buffers) {
+               const boost::asio::const_buffer cb(b);
+               const char* data = boost::asio::buffer_cast<const char*>(cb);
+               size_t n = boost::asio::buffer_size(cb);
+               while (n) {
+                  const uInt step = static_cast<uInt>(std::min<size_t>(n, 1 << 30));
+                  run(data, step, Z_NO_FLUSH);
+                  data += step;
+                  n -= step;
+               }
+            }
+            run(nullptr, 0, finish ? Z_FINISH : Z_SYNC_FLUSH);
+            return output_;
+         }
+
+      private:
+         z_stream stream_;
+         bool gzip_;
+         int level_;
+         std::vector<char> output_;
+
+         void run(const char* data, uInt n, int flush) {
+            stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            stream_.avail_in = n;
+            int result;
+            do {
+               const size_t used = output_.size();
+               output_.resize(used + OutputStep);
+               stream_.next_out = reinterpret_cast<Bytef*>(&output_[used]);
+               stream_.avail_out = OutputStep;
+               result = ::deflate(&stream_, flush);
+               output_.resize(output_.size() - stream_.avail_out);
+            } while (flush == Z_FINISH ?
+                     result == Z_OK :
+                     stream_.avail_in || stream_.avail_out == 0);
+         }
+      };
+
+      // Free list of Deflaters, which are costly to initialize. Up to
+      // MaxFree are kept for reuse.
+      class DeflaterPool : boost::noncopyable {
+      public:
+         enum { MaxFree = 16 };
+
+         static DeflaterPool& instance() {
+            static DeflaterPool pool;
+            return pool;
+         }
+
+         std::unique_ptr<Deflater> acquire(bool gzip, int level) {
+            std::unique_ptr<Deflater> deflater;
+            {
+               std::lock_guard<std::mutex> lock(mutex_);
+               for (auto i = free_.rbegin(); i != free_.rend(); ++i) {
+                  if ((*i)->gzip() == gzip) {
+                     deflater = std::move(*i);
+                     free_.erase(std::next(i).base());
+                     break;
+                  }
+               }
+            }
+
+            if (deflater)
+               deflater->reset(level);
+            else
+               deflater.reset(new Deflater(gzip, level));
+            return deflater;
+         }
+
+         void release(std::unique_ptr<Deflater>&& deflater) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (deflater && free_.size() < MaxFree)
+               free_.push_back(std::move(deflater));
+            deflater.reset();
+         }
+
+      private:
+         std::mutex mutex_;
+         std::vector<std::unique_ptr<Deflater> > free_;
+      };
+
+      // zlib state for decoding a gzip or deflate (zlib format) body.
+      // Encoded bytes are read into input_buffer() and committed, then
+      // inflated into the caller's buffers.
+      class Inflater : boost::noncopyable {
+      public:
+         enum { InputSize = 16384 };
+
+         Inflater()
+            : input_(InputSize)
+            , done_(false) {
+            std::memset(&stream_, 0, sizeof(stream_));
+            if (inflateInit2(&stream_, 15 + 32) != Z_OK)
+               throw std::bad_alloc();
+         }
+
+         ~Inflater() {
+            inflateEnd(&stream_);
+         }
+
+         // True at the end of the encoded stream.
+         bool done() const { return done_; }
+
+         // Total decoded bytes.
+         uint64_t size() const { return stream_.total_out; }
+
+         boost::asio::mutable_buffers_1 input_buffer() {
+            return boost::asio::buffer(input_);
+         }
+
+         void commit(size_t nBytes) {
+            stream_.next_in = reinterpret_cast<Bytef*>(input_.data());
+            stream_.avail_in = static_cast<uInt>(nBytes);
+         }
+
+         // Decode committed input until it or the buffers run out.
+         template<typename MutableBufferSequence>
+         size_t inflate(const MutableBufferSequence& buffers, boost::system::error_code& error) {
+            size_t nBytes = 0;
+            for (const auto& b : buffers) {
+               const boost::asio::mutable_buffer mb(b);
+               const size_t size = std::min<size_t>(boost::asio::buffer_size(mb), 1 << 30);
+               stream_.next_out = boost::asio::buffer_cast<Bytef*>(mb);
+               stream_.avail_out = static_cast<uInt>(size);
+               while (stream_.avail_out && stream_.avail_in && !done_) {
+                  const int result = ::inflate(&stream_, Z_NO_FLUSH);
+                  if (result == Z_STREAM_END)
+                     done_ = true;
+                  else if (result != Z_OK) {
+                     error = make_error_code(invalid_content_encoding);
+                     break;
+                  }
+               }
+               nBytes += size - stream_.avail_out;
+               if (stream_.avail_out || error)
+                  break;
+            }
+            return nBytes;
+         }
+
+      private:
+         z_stream stream_;
+         std::vector<char> input_;
+         bool done_;
+      };
+   }
+#endif // ZLIB_H
+
+   template<typename T>
+   class HTTPTransaction : boost::noncopyable {
+   public:
+      // Request header values reference storage owned by the
+      // transaction and are valid for its lifetime.
+      typedef detail::HeaderMap<std::string> Headers;
+      typedef detail::HeaderMap<detail::HeaderValue> RequestHeaders;
+      typedef std::map<std::string, std::string> Query;
+      typedef detail::PathParameters PathParameters;
+      typedef detail::ByteRange ByteRange;
+      
+      typedef boost::system::error_code error_code;
+
+      // Read timeouts. idle limits the wait for the first byte of a
+      // request, head the time from the first byte until the head is
+      // complete, and body each read of the request body. A zero
+      // duration disables a timeout. Asynchronous reads are timed if
+      // the stream has a timer wheel, and synchronous reads by a read
+      // deadline (see Stream::set_read_deadline()). Either way the
+      // connection is shut down.
+      struct Timeouts {
+         typedef detail::TimerWheel::duration duration;
+         Timeouts()
+            : idle(std::chrono::seconds(60))
+            , head(std::chrono::seconds(30))
+            , body(std::chrono::seconds(60)) {
+         }
+
+         duration idle;
+         duration head;
+         duration body;
+      };
+
+#ifdef ZLIB_H
+      // Response compression, available when <zlib.h> is included
+      // before this header. When enabled, a response with a body of
+      // at least minimumSize bytes (by Content-Length, or else the
+      // first write) and no Content-Encoding or Content-Range is sent
+      // gzip or deflate coded as Accept-Encoding allows, and chunked.
+      // level is a zlib compression level.
+      struct Compression {
+         Compression()
+            : enabled(false)
+            , level(Z_DEFAULT_COMPRESSION)
+            , minimumSize(1024) {
+         }
+
+         bool enabled;
+         int level;
+         size_t minimumSize;
+      };
+
+      // Request body decoding, available with response compression.
+      // When enabled, a request body with Content-Encoding gzip,
+      // x-gzip or deflate is decoded as it is read, so read_some()
+      // and async_read_some() return the decoded bytes. Decoding more
+      // than maxSize bytes fails with request_body_too_large.
+      struct Decompression {
+         Decompression()
+            : enabled(false)
+            , maxSize(64 << 20) {
+         }
+
+         bool enabled;
+         uint64_t maxSize;
+      };
+#endif
+      typedef std::function<void(const error_code&)> Handler;
+      typedef std::function<void(const error_code&, const std::shared_ptr<HTTPTransaction>&)> CreateHandler;
+      
+      // If the request line and headers (or a chunk header or
+      // trailers) exceed headLimit then a read error will be
+      // returned. The limit is fixed by the first transaction on a
+      // connection.
+      enum { DefaultHeadLimit = 65536 };
+      HTTPTransaction(const std::shared_ptr<T>& stream, size_t headLimit = DefaultHeadLimit)
+         : stream_(stream)
+         , receiveBuffer_(stream->receive_buffer(headLimit))
+         , streambuf_(*receiveBuffer_)
+         , requestBytes_(0)
+         , requestChunksPending_(false)
+         , requestChunkedBytes_(0)
+         , maxBodySize_(std::numeric_limits<uint64_t>::max())
+         , headTimeoutSet_(false)
+         , responseStatus_(0)
+         , responseBytes_(0)
+         , responseChunked_(false)
+         , responseSequence_(0)
+#ifdef ZLIB_H
+         , requestDecodingChecked_(false)
+#endif
+      {
+      }
+
+      ~HTTPTransaction() {
+         if (responseQueue_)
+            responseQueue_->finish(responseSequence_);
+#ifdef ZLIB_H
+         detail::DeflaterPool::instance().release(std::move(deflater_));
+#endif
+      }
+
+      const std::string& request_method() const { return requestMethod_; }
+      const std::string& request_version() const { return requestVersion_; }
+      const std::string& request_resource() const { return requestResource_; }
+      const RequestHeaders& request_headers() const { return requestHeaders_; }
+      const std::string request_header(
+         const std::string& key,
+         const std::string& defaultValue = std::string()) const {
+         auto i = request_headers().find(key);
+         return i != request_headers().end() ? i->second.to_string() : defaultValue;
+      }
+      
+      const std::string& request_path() const { return requestPath_; }
+      const std::string& request_fragment() const { return requestFragment_; }
+      const Query& request_query() const { return requestQuery_; }
+
+      // The satisfiable ranges of a GET request's Range header for a
+      // representation of size bytes. The caller checks If-Range,
+      // which needs the representation's validators.
+      detail::range_result request_ranges(uint64_t size, std::vector<ByteRange>& ranges) const {
+         ranges.clear();
+         auto range = request_headers().find(detail::range_header);
+         if (range == request_headers().end() ||
+             requestParser_.method_type() != detail::get_method)
+            return detail::range_ignored;
+         return detail::parse_ranges(range->second, size, ranges);
+      }
+
+      // Set a 416 response for a representation of size bytes. The
+      // response still has to be finished.
+      void set_range_unsatisfiable(uint64_t size) {
+         response_status() = 416;
+         response_headers()[detail::content_range_header] = "bytes */" + std::to_string(size);
+         response_headers()[detail::content_length_header] = "0";
+      }
+
+      const Timeouts& timeouts() const { return timeouts_; }
+      void set_timeouts(const Timeouts& timeouts) { timeouts_ = timeouts; }
+
+      // A request with a larger Content-Length fails to be created
+      // with request_body_too_large, and reading a larger chunked
+      // body fails with the same error. Set before the request is
+      // read. The default is unlimited.
+      uint64_t max_body_size() const { return maxBodySize_; }
+      void set_max_body_size(uint64_t nBytes) { maxBodySize_ = nBytes; }
+
+#ifdef ZLIB_H
+      // Set before the first write of the response.
+      const Compression& compression() const { return compression_; }
+      void set_compression(const Compression& compression) { compression_ = compression; }
+
+      // Set before the first read of the request body.
+      const Decompression& decompression() const { return decompression_; }
+      void set_decompression(const Decompression& decompression) { decompression_ = decompression; }
+#endif
+
+      // True until the request body has been read.
+      bool request_body_pending() const {
+         return requestBytes_ || requestChunksPending_;
+      }
+
+      // True if bytes of a following request have been received,
+      // i.e. the client is pipelining.
+      bool next_request_buffered() const {
+         return !request_body_pending() && streambuf_.size();
+      }
+
+      // Write the response through a connection's queue in sequence
+      // order instead of directly to the stream. The response is
+      // complete when the transaction is destroyed.
+      void set_response_queue(
+         const std::shared_ptr<detail::ResponseQueue<T> >& queue,
+         uint64_t sequence) {
+         responseQueue_ = queue;
+         responseSequence_ = sequence;
+      }
+
+      // Parameters captured by the server route, e.g. "id" for the
+      // route "/items/:id".
+      PathParameters& path_parameters() { return pathParameters_; }
+      const PathParameters& path_parameters() const { return pathParameters_; }
+      const std::string path_parameter(
+         const std::string& name,
+         const std::string& defaultValue = std::string()) const {
+         auto i = path_parameters().find(name);
+         return i != path_parameters().end() ? i->second.to_string() : defaultValue;
+      }
+      
+      unsigned int& response_status() { return responseStatus_; }
+      Headers& response_headers() { return responseHeaders_; }
+      std::string& response_header(const std::string& key) {
+         return response_headers()[key];
+      }
+      
+      Headers& response_trailers() { return responseTrailers_; }
+      std::string& response_trailer(const std::string& key) {
+         return response_trailers()[key];
+      }
+
+      // Either async_finish() or finish() must be called on each
+      // HTTPTransaction instance to ensure valid I/O on the stream. In
+      // most cases exactly one call should be made with no further
+      // usage of the instance (the exception is for returning 1xx
+      // status).
+      template<typename FinishHandler>
+      void async_finish(FinishHandler&& handler) {
+         // Use shared_ptr lifetime to execute the handler exactly
+         // once when both the final reads and writes (which may
+         // overlap in time) are complete.
+         std::shared_ptr<error_code> result(new error_code, [=](error_code* pointer) {
+               handler(*pointer);
+               delete pointer;
+            });
+
+         // Unused bytes after the body stay in the connection's
+         // receive buffer for the next transaction. For 1xx status
+         // they are put back on the stream, which may be taken over
+         // by another protocol.
+         assert(response_status() >= 100);
+         if (response_status() >= 200) {
+            async_discard([=](const error_code& error) mutable {
+                  *result = error;
+               });
+         }
          else
             putback_buffer();
          
          // Output final empty chunk.
          async_write_some(
             boost::asio::null_buffers(),
-            [=](const error_code& error, size_t) {
+            detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
                *result = error;
-            });
+            }));
       }
       
       // Either async_finish() or finish() must be called on each
@@ -370,414 +3500,1075 @@ namespace chunky {
       // usage of the instance(the exception is for returning 1xx
       // status).
       void finish() {
+         // See async_finish() for unused bytes.
          assert(response_status() >= 100);
          if (response_status() >= 200) {
             sync_discard([=](const error_code& error) {
                   if (error)
                      throw boost::system::system_error(error);
-               
-                  // Replace any unused bytes read by get_line().
-                  putback_buffer();
                });
          }
-         else
-            putback_buffer();
-         
-         // Replace any unused bytes read by get_line().
-         if (auto unused = streambuf_.size()) {
-            stream()->put_back(streambuf_.data());
-            streambuf_.consume(unused);
+         else
+            putback_buffer();
+
+         // Output final empty chunk.
+         write_some(boost::asio::null_buffers());
+      }
+      
+      // Either async_finish() or finish() must be called on each
+      // HTTPTransaction instance to ensure valid I/O on the stream. In
+      // most cases exactly one call should be made with no further
+      // usage of the instance(the exception is for returning 1xx
+      // status).
+      void finish(error_code& error) {
+         try {
+            finish();
+         }
+         catch (const boost::system::system_error& e) {
+            error = e.code();
+         }
+      }
+
+      boost::asio::io_service& get_io_service() {
+         return stream()->get_io_service();
+      }
+      
+      template<typename MutableBufferSequence, typename ReadHandler>
+      void async_read_some(MutableBufferSequence&& buffers, ReadHandler&& handler) {
+         using namespace std::placeholders;
+         if (requestMethod_.empty()) {
+            auto fillBufferFunc = std::bind(&HTTPTransaction::async_fill_buffer, this, _1);
+            create(fillBufferFunc, true, [=](const error_code& error) mutable {
+                  if (error) {
+                     handler(error, 0);
+                     return;
+                  }
+
+                  async_read_some(buffers, handler);
+               });
+            return;
+         }
+
+#ifdef ZLIB_H
+         if (start_decompression()) {
+            async_inflate_some(buffers, handler);
+            return;
+         }
+#endif
+         async_read_body_some(buffers, handler);
+      }
+
+      template<typename MutableBufferSequence>
+      size_t read_some(MutableBufferSequence&& buffers, error_code& error) {
+         using namespace std::placeholders;
+         if (requestMethod_.empty()) {
+            auto fillBufferFunc = std::bind(&HTTPTransaction::sync_fill_buffer, this, _1);
+            create(fillBufferFunc, false, [&](const error_code& e) {
+                  error = e;
+               });
+            if (error)
+               return 0;
+         }
+
+#ifdef ZLIB_H
+         if (start_decompression())
+            return inflate_some(buffers, error);
+#endif
+         return read_body_some(buffers, error);
+      }
+
+      template<typename MutableBufferSequence>
+      size_t read_some(MutableBufferSequence&& buffers) {
+         error_code error;
+         size_t nBytes = read_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+      template<typename ConstBufferSequence, typename WriteHandler>
+      void async_write_some(ConstBufferSequence&& buffers, WriteHandler&& handler) {
+         auto nBytes = boost::asio::buffer_size(buffers);
+         start_compression(nBytes);
+         if (responseQueue_) {
+            async_queue_write(buffers, nBytes, std::forward<WriteHandler>(handler));
+            return;
+         }
+
+         // Add prefix (response line, response headers, and chunk
+         // header) and suffix (chunk delimiter) around the client
+         // buffers.
+         prepare_write(buffers, nBytes);
+
+         // Count the bytes now because the transaction may be gone
+         // when the write completes.
+         responseBytes_ += nBytes;
+         boost::asio::async_write(
+            *stream(), stream_->gather_list().buffers(),
+            WriteOp<typename std::decay<WriteHandler>::type>(
+               stream_, nBytes, std::forward<WriteHandler>(handler)));
+      }
+      
+      template<typename ConstBufferSequence>
+      size_t write_some(ConstBufferSequence&& buffers, error_code& error) {
+         auto nBytes = boost::asio::buffer_size(buffers);
+         start_compression(nBytes);
+         if (responseQueue_) {
+            error = queue_write(buffers, nBytes);
+            return error ? 0 : nBytes;
+         }
+
+         // Add prefix (response line, response headers, and chunk
+         // header) and suffix (chunk delimiter) around the client
+         // buffers.
+         prepare_write(buffers, nBytes);
+
+         boost::asio::write(*stream(), stream_->gather_list().buffers(), error);
+         responseBytes_ += nBytes;
+         return nBytes;
+      }
+      
+      template<typename ConstBufferSequence>
+      size_t write_some(ConstBufferSequence&& buffers) {
+         error_code error;
+         size_t nBytes = write_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+
+      // Respond 206 with ranges of body, a representation of
+      // contentType. A single range is sent as is; several are sent as
+      // multipart/byteranges, gathered with slices of body, which must
+      // remain valid until the handler is called.
+      template<typename WriteHandler>
+      void async_write_ranges(
+         boost::asio::const_buffer body,
+         const std::vector<ByteRange>& ranges,
+         boost::string_ref contentType,
+         WriteHandler handler) {
+         const uint64_t size = boost::asio::buffer_size(body);
+         auto parts = prepare_ranges(size, ranges, contentType);
+         auto buffers = std::make_shared<std::vector<boost::asio::const_buffer> >();
+         for (size_t i = 0; i < ranges.size(); ++i) {
+            if (parts)
+               buffers->push_back(boost::asio::buffer(parts->parts()[i]));
+            buffers->push_back(boost::asio::buffer(body + ranges[i].first, ranges[i].size()));
+         }
+         if (parts)
+            buffers->push_back(boost::asio::buffer(parts->parts().back()));
+
+         boost::asio::async_write(
+            *this, *buffers,
+            [=](const error_code& error, size_t nBytes) mutable {
+               handler(error, nBytes);
+
+               // References for lifetime extension.
+               buffers.get();
+               parts.get();
+            });
+      }
+
+#ifndef _WIN32
+      // Send length bytes of a file from offset, as a write of that
+      // many bytes would. The region is sent with sendfile(2) on TCP
+      // connections where available and is otherwise read through
+      // pooled buffers. The caller keeps fd open until the send
+      // completes.
+      template<typename SendHandler>
+      void async_send_file(int fd, uint64_t offset, size_t length, SendHandler handler) {
+         if (!length) {
+            stream_->get_io_service().post(
+               detail::make_alloc_handler(
+                  stream_->handler_memory(), std::bind(handler, error_code(), 0)));
+            return;
+         }
+
+         start_compression(length);
+         if (responseQueue_ || compressing()) {
+            // Queued and compressed responses are copied, so read the
+            // region into a pooled block and write it as any other.
+            std::make_shared<CopyFileOp<SendHandler> >(
+               *this, fd, offset, length, std::move(handler))->start();
+            return;
+         }
+
+         const size_t prefixSize = prepare_send_file(length);
+         std::make_shared<SendFileOp<SendHandler> >(
+            stream_, fd, offset, length, prefixSize, std::move(handler))->start();
+      }
+
+      size_t send_file(int fd, uint64_t offset, size_t length, error_code& error) {
+         if (!length)
+            return 0;
+
+         start_compression(length);
+         if (responseQueue_ || compressing()) {
+            const auto block = detail::BlockPool::instance().acquire();
+            size_t nSent = 0;
+            while (nSent < length && !error) {
+               const auto n = detail::read_file(
+                  fd, block.get(), std::min<size_t>(length - nSent, detail::BlockPool::BlockSize),
+                  offset + nSent, error);
+               if (!error)
+                  nSent += write_some(boost::asio::buffer(block.get(), n), error);
+            }
+            return nSent;
+         }
+
+         const size_t prefixSize = prepare_send_file(length);
+         auto& buffer = stream_->write_buffer();
+         boost::asio::write(*stream(), boost::asio::buffer(buffer.data(), prefixSize), error);
+
+         bool direct = true;
+         std::unique_ptr<char[]> block;
+         size_t nSent = 0;
+         while (nSent < length && !error) {
+            if (direct) {
+               nSent += detail::send_file_some(
+                  stream_->stream(), fd, offset + nSent, length - nSent, error);
+               if (error == boost::asio::error::would_block) {
+                  error = error_code();
+                  detail::wait_writable(stream_->stream().lowest_layer().native_handle(), error);
+               }
+               else if (error == boost::asio::error::operation_not_supported) {
+                  error = error_code();
+                  direct = false;
+               }
+               continue;
+            }
+
+            if (!block)
+               block = detail::BlockPool::instance().acquire();
+            const auto n = detail::read_file(
+               fd, block.get(), std::min<size_t>(length - nSent, detail::BlockPool::BlockSize),
+               offset + nSent, error);
+            if (!error)
+               nSent += boost::asio::write(*stream(), boost::asio::buffer(block.get(), n), error);
+         }
+         detail::BlockPool::instance().release(std::move(block));
+
+         if (!error && buffer.size() > prefixSize) {
+            boost::asio::write(
+               *stream(), boost::asio::buffer(buffer.data() + prefixSize, buffer.size() - prefixSize), error);
+         }
+         return nSent;
+      }
+
+      size_t send_file(int fd, uint64_t offset, size_t length) {
+         error_code error;
+         size_t nBytes = send_file(fd, offset, length, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+
+      // Respond 206 with ranges of a file of size bytes, as
+      // async_write_ranges() does, sending each range with
+      // async_send_file().
+      template<typename WriteHandler>
+      void async_send_file_ranges(
+         int fd,
+         uint64_t size,
+         const std::vector<ByteRange>& ranges,
+         boost::string_ref contentType,
+         WriteHandler handler) {
+         auto parts = prepare_ranges(size, ranges, contentType);
+         if (!parts) {
+            async_send_file(fd, ranges[0].first, ranges[0].size(), std::move(handler));
+            return;
+         }
+
+         std::make_shared<SendRangesOp<WriteHandler> >(
+            *this, fd, ranges, parts, std::move(handler))->start();
+      }
+#endif
+
+      std::shared_ptr<T>& stream() {
+         return stream_;
+      }
+
+      // Convert '+' to ' ' and percent decoding.
+      static std::string decode(boost::string_ref s) {
+         std::string result;
+         detail::percent_decode(s, result);
+         return result;
+      }
+
+      template<typename Iterator>
+      static std::string decode(Iterator&& bgn, Iterator&& end) {
+         return decode(std::string(bgn, end));
+      }
+
+      static Query parse_query(boost::string_ref s) {
+         Query query;
+         detail::for_each_query_param(s, [&](boost::string_ref key, boost::string_ref value) {
+               query[decode(key)] = decode(value);
+            });
+         return query;
+      }
+
+      // Call f(key, value) for each query parameter with views into s
+      // that are still encoded, so the handler decodes only what it
+      // uses.
+      template<typename Function>
+      static void parse_query(boost::string_ref s, Function&& f) {
+         detail::for_each_query_param(s, std::forward<Function>(f));
+      }
+      
+   private:
+      enum { MaxDiscardBufferSize = 65536 };
+
+      // Completion handler for async_write_some(). This is a class
+      // instead of a lambda so that asio's allocation, invocation,
+      // and continuation hooks reach the client handler. It holds
+      // the stream, which owns the gathered buffers, because the
+      // transaction may be released before the write completes.
+      template<typename WriteHandler>
+      class WriteOp {
+      public:
+         template<typename Handler>
+         WriteOp(const std::shared_ptr<T>& stream, size_t nBytes, Handler&& handler)
+            : stream_(stream)
+            , nBytes_(nBytes)
+            , handler_(std::forward<Handler>(handler)) {
+         }
+
+         void operator()(const error_code& error, size_t) {
+            handler_(error, error ? 0 : nBytes_);
+         }
+
+         friend void* asio_handler_allocate(size_t size, WriteOp* op) {
+            return boost_asio_handler_alloc_helpers::allocate(size, op->handler_);
+         }
+
+         friend void asio_handler_deallocate(void* pointer, size_t size, WriteOp* op) {
+            boost_asio_handler_alloc_helpers::deallocate(pointer, size, op->handler_);
+         }
+
+         template<typename Function>
+         friend void asio_handler_invoke(Function& function, WriteOp* op) {
+            boost_asio_handler_invoke_helpers::invoke(function, op->handler_);
+         }
+
+         template<typename Function>
+         friend void asio_handler_invoke(const Function& function, WriteOp* op) {
+            boost_asio_handler_invoke_helpers::invoke(function, op->handler_);
+         }
+
+         friend bool asio_handler_is_continuation(WriteOp* op) {
+            return boost_asio_handler_cont_helpers::is_continuation(op->handler_);
+         }
+
+      private:
+         std::shared_ptr<T> stream_;
+         size_t nBytes_;
+         WriteHandler handler_;
+      };
+
+      // Set the 206 status and headers for ranges. Returns the
+      // multipart framing if there are several ranges.
+      std::shared_ptr<detail::ByteRangesParts> prepare_ranges(
+         uint64_t size,
+         const std::vector<ByteRange>& ranges,
+         boost::string_ref contentType) {
+         response_status() = 206;
+         auto& headers = response_headers();
+         headers.erase(detail::transfer_encoding_header);
+         if (ranges.size() == 1) {
+            std::ostringstream contentRange;
+            contentRange << "bytes " << ranges[0].first << '-' << ranges[0].last << '/' << size;
+            headers[detail::content_range_header] = contentRange.str();
+            if (!contentType.empty())
+               headers[detail::content_type_header] = contentType.to_string();
+            headers[detail::content_length_header] = std::to_string(ranges[0].size());
+            return nullptr;
+         }
+
+         auto parts = std::make_shared<detail::ByteRangesParts>(size, ranges, contentType);
+         uint64_t length = 0;
+         for (const auto& part : parts->parts())
+            length += part.size();
+         for (const auto& range : ranges)
+            length += range.size();
+         headers.erase(detail::content_range_header);
+         headers[detail::content_type_header] = "multipart/byteranges; boundary=" + parts->boundary();
+         headers[detail::content_length_header] = std::to_string(length);
+         return parts;
+      }
+
+#ifndef _WIN32
+      // State for async_send_file_ranges(): each part header is
+      // written, then its range is sent from the file.
+      template<typename WriteHandler>
+      class SendRangesOp : public std::enable_shared_from_this<SendRangesOp<WriteHandler> > {
+      public:
+         SendRangesOp(
+            HTTPTransaction& transaction,
+            int fd,
+            const std::vector<ByteRange>& ranges,
+            const std::shared_ptr<detail::ByteRangesParts>& parts,
+            WriteHandler&& handler)
+            : transaction_(transaction)
+            , fd_(fd)
+            , ranges_(ranges)
+            , parts_(parts)
+            , handler_(std::move(handler))
+            , index_(0)
+            , nBytes_(0) {
+         }
+
+         void start() {
+            auto self = this->shared_from_this();
+            const std::string& part = parts_->parts()[index_];
+            boost::asio::async_write(
+               transaction_, boost::asio::buffer(part),
+               [=](const error_code& error, size_t nBytes) {
+                  self->nBytes_ += nBytes;
+                  if (error || self->index_ == self->ranges_.size()) {
+                     self->handler_(error, self->nBytes_);
+                     return;
+                  }
+
+                  const auto& range = self->ranges_[self->index_++];
+                  self->transaction_.async_send_file(
+                     self->fd_, range.first, range.size(),
+                     [=](const error_code& error, size_t nBytes) {
+                        self->nBytes_ += nBytes;
+                        if (error)
+                           self->handler_(error, self->nBytes_);
+                        else
+                           self->start();
+                     });
+               });
+         }
+
+      private:
+         HTTPTransaction& transaction_;
+         int fd_;
+         std::vector<ByteRange> ranges_;
+         std::shared_ptr<detail::ByteRangesParts> parts_;
+         WriteHandler handler_;
+         size_t index_;
+         size_t nBytes_;
+      };
+
+      // State for async_send_file(). The prefix and suffix are in the
+      // stream's write buffer; the file region is sent between them
+      // with sendfile(2) or through a pooled block.
+      template<typename SendHandler>
+      class SendFileOp : public std::enable_shared_from_this<SendFileOp<SendHandler> > {
+      public:
+         SendFileOp(
+            const std::shared_ptr<T>& stream,
+            int fd,
+            uint64_t offset,
+            size_t length,
+            size_t prefixSize,
+            SendHandler&& handler)
+            : stream_(stream)
+            , fd_(fd)
+            , offset_(offset)
+            , length_(length)
+            , nSent_(0)
+            , prefixSize_(prefixSize)
+            , direct_(true)
+            , handler_(std::move(handler)) {
+         }
+
+         void start() {
+            auto self = this->shared_from_this();
+            boost::asio::async_write(
+               *stream_, boost::asio::buffer(stream_->write_buffer().data(), prefixSize_),
+               detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+                  if (error)
+                     self->complete(error);
+                  else
+                     self->send();
+               }));
+         }
+
+      private:
+         std::shared_ptr<T> stream_;
+         int fd_;
+         uint64_t offset_;
+         size_t length_;
+         size_t nSent_;
+         size_t prefixSize_;
+         bool direct_;
+         std::unique_ptr<char[]> block_;
+         SendHandler handler_;
+
+         void send() {
+            auto self = this->shared_from_this();
+            while (nSent_ < length_) {
+               error_code error;
+               if (direct_) {
+                  nSent_ += detail::send_file_some(
+                     stream_->stream(), fd_, offset_ + nSent_, length_ - nSent_, error);
+                  if (error == boost::asio::error::would_block) {
+                     // Wait for the socket to drain.
+                     stream_->async_write_some(
+                        boost::asio::null_buffers(),
+                        detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+                           if (error)
+                              self->complete(error);
+                           else
+                              self->send();
+                        }));
+                     return;
+                  }
+                  else if (error == boost::asio::error::operation_not_supported)
+                     direct_ = false;
+                  else if (error) {
+                     complete(error);
+                     return;
+                  }
+                  continue;
+               }
+
+               if (!block_)
+                  block_ = detail::BlockPool::instance().acquire();
+               const auto n = detail::read_file(
+                  fd_, block_.get(), std::min<size_t>(length_ - nSent_, detail::BlockPool::BlockSize),
+                  offset_ + nSent_, error);
+               if (error) {
+                  complete(error);
+                  return;
+               }
+
+               boost::asio::async_write(
+                  *stream_, boost::asio::buffer(block_.get(), n),
+                  detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t n) {
+                     self->nSent_ += n;
+                     if (error)
+                        self->complete(error);
+                     else
+                        self->send();
+                  }));
+               return;
+            }
+
+            const auto& buffer = stream_->write_buffer();
+            boost::asio::async_write(
+               *stream_, boost::asio::buffer(buffer.data() + prefixSize_, buffer.size() - prefixSize_),
+               detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+                  self->complete(error);
+               }));
+         }
+
+         void complete(const error_code& error) {
+            detail::BlockPool::instance().release(std::move(block_));
+            handler_(error, nSent_);
+         }
+      };
+
+      // State for async_send_file() on queued or compressed
+      // responses: the region is read a pooled block at a time and
+      // each block written with async_write_some().
+      template<typename SendHandler>
+      class CopyFileOp : public std::enable_shared_from_this<CopyFileOp<SendHandler> > {
+      public:
+         CopyFileOp(
+            HTTPTransaction& transaction,
+            int fd,
+            uint64_t offset,
+            size_t length,
+            SendHandler&& handler)
+            : transaction_(transaction)
+            , fd_(fd)
+            , offset_(offset)
+            , length_(length)
+            , nSent_(0)
+            , block_(detail::BlockPool::instance().acquire())
+            , handler_(std::move(handler)) {
+         }
+
+         void start() {
+            error_code error;
+            const auto n = detail::read_file(
+               fd_, block_.get(), std::min<size_t>(length_ - nSent_, detail::BlockPool::BlockSize),
+               offset_ + nSent_, error);
+            if (error) {
+               complete(error);
+               return;
+            }
+
+            auto self = this->shared_from_this();
+            boost::asio::async_write(
+               transaction_, boost::asio::buffer(block_.get(), n),
+               [=](const error_code& error, size_t n) {
+                  self->nSent_ += n;
+                  if (error || self->nSent_ == self->length_)
+                     self->complete(error);
+                  else
+                     self->start();
+               });
+         }
+
+      private:
+         HTTPTransaction& transaction_;
+         int fd_;
+         uint64_t offset_;
+         size_t length_;
+         size_t nSent_;
+         std::unique_ptr<char[]> block_;
+         SendHandler handler_;
+
+         void complete(const error_code& error) {
+            detail::BlockPool::instance().release(std::move(block_));
+            handler_(error, nSent_);
          }
+      };
 
-         // Output final empty chunk.
-         write_some(boost::asio::null_buffers());
+      // Serialize the prefix and suffix for a file region and count
+      // it as written. Returns the size of the prefix.
+      size_t prepare_send_file(size_t length) {
+         auto& buffer = stream_->write_buffer();
+         buffer.clear();
+         write_prefix(buffer, length);
+         const size_t prefixSize = buffer.size();
+         write_suffix(buffer, length);
+         responseBytes_ += length;
+         return prefixSize;
       }
+#endif
       
-      // Either async_finish() or finish() must be called on each
-      // HTTPTransaction instance to ensure valid I/O on the stream. In
-      // most cases exactly one call should be made with no further
-      // usage of the instance(the exception is for returning 1xx
-      // status).
-      void finish(error_code& error) {
-         try {
-            finish();
-         }
-         catch (const boost::system::system_error& e) {
-            error = e.code();
-         }
+      std::shared_ptr<T> stream_;
+      std::shared_ptr<detail::ReceiveBuffer> receiveBuffer_;
+      boost::asio::streambuf& streambuf_;
+      
+      std::string requestMethod_;
+      std::string requestVersion_;
+      std::string requestResource_;
+      RequestHeaders requestHeaders_;
+      detail::RequestParser requestParser_;
+      detail::Arena arena_;
+
+      std::string requestPath_;
+      PathParameters pathParameters_;
+      std::string requestFragment_;
+      Query requestQuery_;
+      
+      size_t requestBytes_;
+      bool requestChunksPending_;
+      detail::ChunkDecoder chunkDecoder_;
+      uint64_t requestChunkedBytes_;
+      uint64_t maxBodySize_;
+
+      Timeouts timeouts_;
+      bool headTimeoutSet_;
+      
+      unsigned int responseStatus_;
+      Headers responseHeaders_;
+      Headers responseTrailers_;
+
+      size_t responseBytes_;
+      bool responseChunked_;
+
+      std::shared_ptr<detail::ResponseQueue<T> > responseQueue_;
+      uint64_t responseSequence_;
+
+#ifdef ZLIB_H
+      Compression compression_;
+      std::unique_ptr<detail::Deflater> deflater_;
+      Decompression decompression_;
+      std::unique_ptr<detail::Inflater> inflater_;
+      bool requestDecodingChecked_;
+#endif
+
+      static const std::string& crlf() {
+         static const std::string s("\r\n");
+         return s;
       }
 
-      boost::asio::io_service& get_io_service() {
-         return stream()->get_io_service();
+      static const std::string& crlf2() {
+         static const std::string s("\r\n\r\n");
+         return s;
+      }
+
+      // Asynchronously guarantee that the body buffer contains the
+      // delimiter. This allows subsequent synchronous read_until()
+      // calls to succeed without blocking.
+      void async_load_buffer(const std::string& delimiter, Handler handler) {
+         stream_->expires_from_now(timeouts_.body);
+         boost::asio::async_read_until(
+            *stream(), streambuf_, delimiter,
+            detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+               stream_->cancel_timeout();
+               handler(error);
+            }));
+      }
+
+      // Synchronously guarantee that the body buffer contains the
+      // delimiter.
+      void sync_load_buffer(const std::string& delimiter, const Handler& handler) {
+         error_code error;
+         boost::asio::read_until(*stream(), streambuf_, delimiter, error);
+         handler(error);
+      }
+
+      // Asynchronously append at least one byte to the buffer.
+      void async_fill_buffer(Handler handler) {
+         boost::asio::async_read(
+            *stream(), streambuf_, boost::asio::transfer_at_least(1),
+            detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+               handler(error);
+            }));
+      }
+
+      // Synchronously append at least one byte to the buffer.
+      void sync_fill_buffer(const Handler& handler) {
+         error_code error;
+         boost::asio::read(*stream(), streambuf_, boost::asio::transfer_at_least(1), error);
+         handler(error);
+      }
+
+      void putback_buffer() {
+         if (auto unused = streambuf_.size()) {
+            stream()->put_back(streambuf_.data());
+            streambuf_.consume(unused);
+         }
       }
       
+      // Read the request body as it is framed, without decoding.
       template<typename MutableBufferSequence, typename ReadHandler>
-      void async_read_some(MutableBufferSequence&& buffers, ReadHandler&& handler) {
-         using namespace std::placeholders;
-         auto loadBufferFunc = std::bind(&HTTPTransaction::async_load_buffer, this, _1, _2);
-         if (requestMethod_.empty()) {
-            create(loadBufferFunc, [=](const error_code& error) mutable {
-                  if (error) {
-                     handler(error, 0);
-                     return;
-                  }
-
-                  async_read_some(buffers, handler);
-               });
+      void async_read_body_some(const MutableBufferSequence& buffers, ReadHandler handler) {
+         if (requestChunksPending_) {
+            async_read_chunked_some(detail::first_buffer(buffers), handler);
             return;
          }
-         
+
          // Take data from the streambuf first.
          size_t nBytesRead = 0;
          const auto bufferSize = boost::asio::buffer_size(buffers);
-         if (streambuf_.size()) {
+         if (requestBytes_ && streambuf_.size()) {
             auto nBytes = boost::asio::buffer_copy(buffers, streambuf_.data(), requestBytes_);
             streambuf_.consume(nBytes);
             requestBytes_ -= nBytes;
             nBytesRead += nBytes;
          }
 
+         const bool timed = bufferSize && !nBytesRead && requestBytes_;
+         if (timed)
+            stream_->expires_from_now(timeouts_.body);
          boost::asio::async_read(
             *stream(), buffers, boost::asio::transfer_exactly(nBytesRead ? 0 : requestBytes_),
-            [=](const error_code& error, size_t nBytes) mutable {
+            detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t nBytes) mutable {
+               if (timed)
+                  stream_->cancel_timeout();
                if (error) {
                   handler(error, nBytesRead);
                   return;
                }
 
-               // Read the chunk delimiter and next chunk header if chunked.
                requestBytes_ -= nBytes;
                nBytesRead += nBytes;
-               if (bufferSize && requestChunksPending_ && !requestBytes_) {
-                  loadBufferFunc(crlf(), [=](const error_code& error) mutable {
-                        if (error) {
-                           handler(error, nBytesRead);
-                           return;
-                        }
-                        
-                        std::string s = get_line();
-                        if (!s.empty()) {
-                           handler(make_error_code(invalid_chunk_delimiter), nBytesRead);
-                           return;
-                        }
-                        
-                        read_chunk_header(
-                           loadBufferFunc,
-                           [=](const error_code& error) mutable {
-                              handler(error, nBytesRead);
-                           });
-                     });
-               }
-               else {
-                  error_code error;
-                  if (nBytesRead == 0 && bufferSize > 0)
-                     error = make_error_code(boost::asio::error::eof);
-                  handler(error, nBytesRead);
-               }
-            });
+               handler(end_of_body(nBytesRead, bufferSize), nBytesRead);
+            }));
       }
 
       template<typename MutableBufferSequence>
-      size_t read_some(MutableBufferSequence&& buffers, error_code& error) {
-         using namespace std::placeholders;
-         auto loadBufferFunc = std::bind(&HTTPTransaction::sync_load_buffer, this, _1, _2);
-         if (requestMethod_.empty()) {
-            create(loadBufferFunc, [&](const error_code& e) {
-                  error = e;
-               });
-            if (error)
-               return 0;
-         }
-         
-         size_t result;
-         auto handler = [&](const error_code& e, size_t n) {
-            error = e;
-            result = n;
-         };
-         
+      size_t read_body_some(const MutableBufferSequence& buffers, error_code& error) {
+         if (requestChunksPending_)
+            return read_chunked_some(detail::first_buffer(buffers), error);
+
          // Take data from the streambuf first.
          size_t nBytesRead = 0;
          const auto bufferSize = boost::asio::buffer_size(buffers);
-         if (streambuf_.size()) {
+         if (requestBytes_ && streambuf_.size()) {
             auto nBytes = boost::asio::buffer_copy(buffers, streambuf_.data(), requestBytes_);
             streambuf_.consume(nBytes);
             requestBytes_ -= nBytes;
             nBytesRead += nBytes;
          }
 
-         // Jump through some hoops to make the inner lambda exactly
-         // the same as async_read_some().
+         const BodyReadDeadline deadline(*this);
          size_t nBytes = boost::asio::read(
             *stream(),
             buffers,
             boost::asio::transfer_exactly(nBytesRead ? 0 : requestBytes_),
             error);
-         [=](const std::function<void(const error_code&, size_t)>& f) {
-            f(error, nBytes);
-         }([=](const error_code& error, size_t nBytes) mutable {
-               if (error) {
-                  handler(error, nBytesRead);
-                  return;
-               }
+         if (error)
+            return nBytesRead;
 
-               // Read the chunk delimiter and next chunk header if chunked.
-               requestBytes_ -= nBytes;
-               nBytesRead += nBytes;
-               if (bufferSize && requestChunksPending_ && !requestBytes_) {
-                  using namespace std::placeholders;
-                  loadBufferFunc(crlf(), [=](const error_code& error) mutable {
-                        if (error) {
-                           handler(error, nBytesRead);
-                           return;
-                        }
-                        
-                        std::string s = get_line();
-                        if (!s.empty()) {
-                           handler(make_error_code(invalid_chunk_delimiter), nBytesRead);
-                           return;
-                        }
-                        
-                        read_chunk_header(
-                           loadBufferFunc,
-                           [=](const error_code& error) mutable {
-                              handler(error, nBytesRead);
-                           });
-                     });
-               }
-               else {
-                  error_code error;
-                  if (nBytesRead == 0 && bufferSize > 0)
-                     error = make_error_code(boost::asio::error::eof);
-                  handler(error, nBytesRead);
-               }
-            });
+         requestBytes_ -= nBytes;
+         nBytesRead += nBytes;
+         error = end_of_body(nBytesRead, bufferSize);
+         return nBytesRead;
+      }
 
-         return result;
+      static error_code end_of_body(size_t nBytesRead, size_t bufferSize) {
+         return nBytesRead == 0 && bufferSize > 0 ?
+            make_error_code(boost::asio::error::eof) : error_code();
       }
 
-      template<typename MutableBufferSequence>
-      size_t read_some(MutableBufferSequence&& buffers) {
-         error_code error;
-         size_t nBytes = read_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
+      // Decode chunked framing already in the streambuf, copying the
+      // payload of as many chunks as fit into buffer.
+      size_t decode_chunks(boost::asio::mutable_buffer buffer, error_code& error) {
+         char* out = boost::asio::buffer_cast<char*>(buffer);
+         const size_t size = boost::asio::buffer_size(buffer);
+         const char* begin = boost::asio::buffer_cast<const char*>(streambuf_.data());
+         const char* end = begin + streambuf_.size();
+         const char* p = begin;
+         size_t nBytes = 0;
+         while (p != end && nBytes < size && !error) {
+            if (chunkDecoder_.state() == detail::ChunkDecoder::data_state) {
+               const size_t n = std::min(
+                  std::min(size - nBytes, static_cast<size_t>(end - p)), requestBytes_);
+               std::memcpy(out + nBytes, p, n);
+               p += n;
+               nBytes += n;
+               requestBytes_ -= n;
+               if (!requestBytes_)
+                  chunkDecoder_.end_data();
+            }
+            else if (chunkDecoder_.state() == detail::ChunkDecoder::last_state)
+               break;
+            else {
+               p = chunkDecoder_.parse(p, end, error);
+               if (chunkDecoder_.state() == detail::ChunkDecoder::data_state) {
+                  requestBytes_ = chunkDecoder_.size();
+                  requestChunkedBytes_ += requestBytes_;
+                  if (requestChunkedBytes_ > maxBodySize_ || requestChunkedBytes_ < requestBytes_)
+                     error = make_error_code(request_body_too_large);
+               }
+            }
+         }
+
+         // Finish the body now if there are no trailers.
+         if (chunkDecoder_.state() == detail::ChunkDecoder::last_state &&
+             end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+            p += 2;
+            requestChunksPending_ = false;
+         }
+         streambuf_.consume(p - begin);
          return nBytes;
       }
 
-      template<typename ConstBufferSequence, typename WriteHandler>
-      void async_write_some(ConstBufferSequence&& buffers, WriteHandler&& handler) {
-         // Add prefix (response line, response headers, and chunk
-         // header) and suffix (chunk delimiter) around the client
-         // buffers.
-         auto nBytes = boost::asio::buffer_size(buffers);
-         auto chunk = std::make_shared<std::vector<boost::asio::const_buffer> >();
-         
-         auto prefix = std::make_shared<std::string>(prepare_write_prefix(nBytes));
-         if (!prefix->empty())
-            chunk->push_back(boost::asio::const_buffer(prefix->data(), prefix->size()));
+      // Read from a chunked body. Framing and payload are parsed in
+      // place from the streambuf, and payload is read directly into
+      // buffer when nothing is buffered.
+      template<typename ReadHandler>
+      void async_read_chunked_some(boost::asio::mutable_buffer buffer, ReadHandler handler) {
+         using namespace std::placeholders;
+         error_code error;
+         size_t nBytes = decode_chunks(buffer, error);
+         if (!nBytes && !error && !requestChunksPending_)
+            error = end_of_body(nBytes, boost::asio::buffer_size(buffer));
+         if (nBytes || error || !boost::asio::buffer_size(buffer)) {
+            stream_->get_io_service().post(
+               detail::make_alloc_handler(
+                  stream_->handler_memory(), std::bind(handler, error, nBytes)));
+            return;
+         }
 
-         for (const auto& buffer : buffers)
-            chunk->push_back(boost::asio::const_buffer(buffer));
-         
-         auto suffix = std::make_shared<std::string>(prepare_write_suffix(nBytes));
-         if (!suffix->empty())
-            chunk->push_back(boost::asio::const_buffer(suffix->data(), suffix->size()));
+         if (chunkDecoder_.state() == detail::ChunkDecoder::last_state) {
+            auto loadBufferFunc = std::bind(&HTTPTransaction::async_load_buffer, this, _1, _2);
+            read_chunk_trailers(loadBufferFunc, [=](const error_code& error) mutable {
+                  handler(error ? error : make_error_code(boost::asio::error::eof), 0);
+               });
+            return;
+         }
 
-         boost::asio::async_write(
-            *stream(), *chunk,
-            [=](const error_code& error, size_t) mutable {
+         stream_->expires_from_now(timeouts_.body);
+         if (chunkDecoder_.state() == detail::ChunkDecoder::data_state) {
+            stream()->async_read_some(
+               boost::asio::buffer(buffer, requestBytes_),
+               detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t nBytes) mutable {
+                  stream_->cancel_timeout();
+                  requestBytes_ -= nBytes;
+                  if (!requestBytes_)
+                     chunkDecoder_.end_data();
+                  handler(error, nBytes);
+               }));
+            return;
+         }
+
+         async_fill_buffer([=](const error_code& error) mutable {
+               stream_->cancel_timeout();
                if (error) {
                   handler(error, 0);
                   return;
                }
 
-               responseBytes_ += nBytes;
-               handler(error, nBytes);
-
-               // References for lifetime extension.
-               prefix.get();
-               suffix.get();
-               chunk.get();
+               async_read_chunked_some(buffer, handler);
             });
       }
-      
-      template<typename ConstBufferSequence>
-      size_t write_some(ConstBufferSequence&& buffers, error_code& error) {
-         // Add prefix (response line, response headers, and chunk
-         // header) and suffix (chunk delimiter) around the client
-         // buffers.
-         auto nBytes = boost::asio::buffer_size(buffers);
-         auto chunk = std::make_shared<std::vector<boost::asio::const_buffer> >();
-         
-         auto prefix = std::make_shared<std::string>(prepare_write_prefix(nBytes));
-         if (!prefix->empty())
-            chunk->push_back(boost::asio::const_buffer(prefix->data(), prefix->size()));
-
-         for (const auto& buffer : buffers)
-            chunk->push_back(boost::asio::const_buffer(buffer));
-         
-         auto suffix = std::make_shared<std::string>(prepare_write_suffix(nBytes));
-         if (!suffix->empty())
-            chunk->push_back(boost::asio::const_buffer(suffix->data(), suffix->size()));
-
-         boost::asio::write(*stream(), *chunk, error);
-         responseBytes_ += nBytes;
-         return nBytes;
-      }
-      
-      template<typename ConstBufferSequence>
-      size_t write_some(ConstBufferSequence&& buffers) {
-         error_code error;
-         size_t nBytes = write_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
-      }
-
-      std::shared_ptr<T>& stream() {
-         return stream_;
-      }
-
-      // Set or get the internal buffer size for all subsequent
-      // HTTPTransaction instances. If the request line and headers
-      // exceed this size then a read error will be returned.
-      static size_t buffer_size(size_t nBytes = 0) {
-         static size_t bufferSize = 10486376;
-         if (nBytes)
-            bufferSize = nBytes;
-         return bufferSize;
-      }
-      
-      // Convert '+' to ' ' and percent decoding.
-      template<typename Iterator>
-      static std::string decode(Iterator&& bgn, Iterator&& end) {
-         std::string result;
 
-         auto i = bgn;
-         std::smatch escapeMatch;
-         static std::regex escapeRegex("^([^+%]*)(?:\\+|(?:%([0-9A-Fa-f]{2})))");
-         while (i != end) {
-            // Look for a '+' or '%HH' where H is a valid hex digit.
-            if (std::regex_search(i, end, escapeMatch, escapeRegex)) {
-               // Concatenate everything up to the special character.
-               result += escapeMatch[1].str();
-
-               // Concatenate the unescaped character.
-               if (escapeMatch[2].matched)
-                  result += static_cast<char>(std::stoi(escapeMatch[2].str(), 0, 16));
-               else
-                  result += ' ';
+      size_t read_chunked_some(boost::asio::mutable_buffer buffer, error_code& error) {
+         using namespace std::placeholders;
+         const BodyReadDeadline deadline(*this);
+         for (;;) {
+            const size_t nBytes = decode_chunks(buffer, error);
+            if (!nBytes && !error && !requestChunksPending_)
+               error = end_of_body(nBytes, boost::asio::buffer_size(buffer));
+            if (nBytes || error || !boost::asio::buffer_size(buffer))
+               return nBytes;
 
-               // Update the iterator.
-               i = escapeMatch[0].second;
+            if (chunkDecoder_.state() == detail::ChunkDecoder::last_state) {
+               auto loadBufferFunc = std::bind(&HTTPTransaction::sync_load_buffer, this, _1, _2);
+               read_chunk_trailers(loadBufferFunc, [&](const error_code& e) {
+                     error = e ? e : make_error_code(boost::asio::error::eof);
+                  });
+               return 0;
             }
-            else {
-               // No matches so concatenate the remainder.
-               result += std::string(i, end);
-               i = end;
+
+            if (chunkDecoder_.state() == detail::ChunkDecoder::data_state) {
+               const size_t n = stream()->read_some(boost::asio::buffer(buffer, requestBytes_), error);
+               requestBytes_ -= n;
+               if (!requestBytes_)
+                  chunkDecoder_.end_data();
+               return n;
             }
+
+            sync_fill_buffer([&](const error_code& e) {
+                  error = e;
+               });
+            if (error)
+               return 0;
          }
-         
-         return result;
       }
 
-      static Query parse_query(const std::string& s) {
-         Query query;
-
-         auto i = s.begin();
-         std::smatch paramMatch;
-         static std::regex paramRegex("^([^=&]+)(=)?([^&]*)&?");
-         while (std::regex_search(i, s.end(), paramMatch, paramRegex)) {
-            if (paramMatch[2].matched) {
-               std::string key = decode(paramMatch[1].first, paramMatch[1].second);
-               std::string value = decode(paramMatch[3].first, paramMatch[3].second);
-               query[key] = value;
-            }
-            
-            i = paramMatch[0].second;
-         }
+      // Read trailers after the terminating chunk, which ends the
+      // body.
+      typedef std::function<void(const std::string&, const Handler&)> LoadBufferFunc;
+      void read_chunk_trailers(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
+         requestChunksPending_ = false;
+         loadBufferFunc(crlf(), [=](const error_code& error) {
+               if (error) {
+                  handler(error);
+                  return;
+               }
 
-         return query;
-      }
-      
-   private:
-      enum { MaxDiscardBufferSize = 65536 };
-      
-      std::shared_ptr<T> stream_;
-      boost::asio::streambuf streambuf_;
-      
-      std::string requestMethod_;
-      std::string requestVersion_;
-      std::string requestResource_;
-      Headers requestHeaders_;
+               // An empty line means no trailers.
+               const char* data = boost::asio::buffer_cast<const char*>(streambuf_.data());
+               if (data[0] == '\r' && data[1] == '\n') {
+                  streambuf_.consume(crlf().size());
+                  handler(error_code());
+                  return;
+               }
 
-      std::string requestPath_;
-      std::string requestFragment_;
-      Query requestQuery_;
-      
-      size_t requestBytes_;
-      bool requestChunksPending_;
-      
-      unsigned int responseStatus_;
-      Headers responseHeaders_;
-      Headers responseTrailers_;
+               loadBufferFunc(crlf2(), [=](const error_code& error) {
+                     handler(error ? error : read_request_trailers());
+                  });
+            });
+      }
 
-      size_t responseBytes_;
-      bool responseChunked_;
+#ifdef ZLIB_H
+      // Decide at the first body read whether to decode the body.
+      bool start_decompression() {
+         if (!requestDecodingChecked_) {
+            requestDecodingChecked_ = true;
+            auto contentEncoding = request_headers().find(detail::content_encoding_header);
+            if (decompression_.enabled && contentEncoding != request_headers().end() &&
+                (detail::caseless_equal(contentEncoding->second, "gzip") ||
+                 detail::caseless_equal(contentEncoding->second, "x-gzip") ||
+                 detail::caseless_equal(contentEncoding->second, "deflate")))
+               inflater_.reset(new detail::Inflater);
+         }
+         return inflater_ != nullptr;
+      }
 
-      static const std::string& crlf() {
-         static const std::string s("\r\n");
-         return s;
+      // Decode input the inflater already has. more is set if it
+      // needs more input to return anything.
+      template<typename MutableBufferSequence>
+      size_t inflate_buffered(const MutableBufferSequence& buffers, error_code& error, bool& more) {
+         more = false;
+         const size_t nBytes = inflater_->inflate(buffers, error);
+         if (error)
+            return nBytes;
+         if (inflater_->size() > decompression_.maxSize) {
+            error = make_error_code(request_body_too_large);
+            return 0;
+         }
+         if (nBytes || !boost::asio::buffer_size(buffers))
+            return nBytes;
+         if (inflater_->done())
+            error = make_error_code(boost::asio::error::eof);
+         else
+            more = true;
+         return 0;
       }
 
-      static const std::string& crlf2() {
-         static const std::string s("\r\n\r\n");
-         return s;
+      // Remaining body bytes are discarded undecoded.
+      void stop_decompression() {
+         requestDecodingChecked_ = true;
+         inflater_.reset();
       }
 
-      // Asynchronously guarantee that the body buffer contains the
-      // delimiter. This allows subsequent synchronous read_until()
-      // calls to succeed without blocking.
-      void async_load_buffer(const std::string& delimiter, const Handler& handler) {
-         boost::asio::async_read_until(
-            *stream(), streambuf_, delimiter,
-            [=](const error_code& error, size_t) {
-               handler(error);
-            });
+      // The end of the body before the end of the encoded stream.
+      static error_code truncated(const error_code& error) {
+         return error == boost::asio::error::eof ? make_error_code(invalid_content_encoding) : error;
       }
 
-      // Synchronously guarantee that the body buffer contains the
-      // delimiter.
-      void sync_load_buffer(const std::string& delimiter, const Handler& handler) {
+      template<typename MutableBufferSequence, typename ReadHandler>
+      void async_inflate_some(const MutableBufferSequence& buffers, ReadHandler handler) {
          error_code error;
-         boost::asio::read_until(*stream(), streambuf_, delimiter, error);
-         handler(error);
+         bool more;
+         const size_t nBytes = inflate_buffered(buffers, error, more);
+         if (!more) {
+            stream_->get_io_service().post(
+               detail::make_alloc_handler(
+                  stream_->handler_memory(), std::bind(handler, error, nBytes)));
+            return;
+         }
+
+         async_read_body_some(
+            inflater_->input_buffer(),
+            [=](const error_code& error, size_t nBytes) mutable {
+               if (error && !nBytes) {
+                  handler(truncated(error), 0);
+                  return;
+               }
+
+               inflater_->commit(nBytes);
+               async_inflate_some(buffers, handler);
+            });
       }
 
-      void putback_buffer() {
-         if (auto unused = streambuf_.size()) {
-            stream()->put_back(streambuf_.data());
-            streambuf_.consume(unused);
+      template<typename MutableBufferSequence>
+      size_t inflate_some(const MutableBufferSequence& buffers, error_code& error) {
+         for (;;) {
+            bool more;
+            const size_t nBytes = inflate_buffered(buffers, error, more);
+            if (!more)
+               return nBytes;
+
+            const size_t nRead = read_body_some(inflater_->input_buffer(), error);
+            if (error && !nRead) {
+               error = truncated(error);
+               return 0;
+            }
+            error = error_code();
+            inflater_->commit(nRead);
          }
       }
-      
+#endif
+
       // Asynchronously discard any unread body.
-      void async_discard(const Handler& handler) {
-         if (requestBytes_) {
-            auto bufferSize = std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize));
+      void async_discard(Handler handler) {
+#ifdef ZLIB_H
+         stop_decompression();
+#endif
+         if (request_body_pending()) {
+            auto bufferSize = requestBytes_ ?
+               std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize)) :
+               static_cast<size_t>(MaxDiscardBufferSize);
             auto buffer = std::make_shared<std::vector<char> >(bufferSize);
             boost::asio::async_read(
                *this, boost::asio::buffer(*buffer),
-               boost::asio::transfer_exactly(requestBytes_),
-               [=](const error_code& error, size_t) {
-                  if (error) {
+               boost::asio::transfer_exactly(requestBytes_ ? requestBytes_ : 1),
+               detail::make_alloc_handler(stream_->handler_memory(), [=](const error_code& error, size_t) {
+                  // The read reaching the end of a chunked body
+                  // reports eof.
+                  if (error && request_body_pending()) {
                      handler(error);
                      return;
                   }
 
                   async_discard(handler);
                   buffer.get();
-               });
+               }));
          }
          else
             handler(error_code());
@@ -785,15 +4576,20 @@ namespace chunky {
 
       // Synchronously discard any unread body.
       void sync_discard(const Handler& handler) {
-         while (requestBytes_) {
+#ifdef ZLIB_H
+         stop_decompression();
+#endif
+         while (request_body_pending()) {
             error_code error;
-            auto bufferSize = std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize));
+            auto bufferSize = requestBytes_ ?
+               std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize)) :
+               static_cast<size_t>(MaxDiscardBufferSize);
             auto buffer = std::make_shared<std::vector<char> >(bufferSize);
             boost::asio::read(
                *this, boost::asio::buffer(*buffer),
-               boost::asio::transfer_exactly(requestBytes_),
+               boost::asio::transfer_exactly(requestBytes_ ? requestBytes_ : 1),
                error);
-            if (error) {
+            if (error && request_body_pending()) {
                handler(error);
                return;
             }
@@ -804,328 +4600,567 @@ namespace chunky {
          handler(error_code());
       }
 
-      // Get the next line (through CRLF) from the underlying stream.
-      // The read is via the streambuf so it should not block if
-      // the buffer has previously been loaded.
-      std::string get_line() {
-         auto nBytes = boost::asio::read_until(*stream(), streambuf_, crlf());
-         auto i = boost::asio::buffers_begin(streambuf_.data());
-         std::string s(i, i + nBytes - crlf().size());
-         streambuf_.consume(nBytes);
-         return s;
-      }
-
       // Common synchronous/asynchronous create() helper.
-      typedef std::function<void(const std::string&, const Handler&)> LoadBufferFunc;
-      void create(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
-         loadBufferFunc(crlf2(), [=](const error_code& error) {
+      typedef std::function<void(const Handler&)> FillBufferFunc;
+      void create(const FillBufferFunc& fillBufferFunc, bool asynchronous, const Handler& handler) {
+         requestParser_.reset();
+         read_head(fillBufferFunc, asynchronous, [=](const error_code& error) {
+               if (asynchronous)
+                  stream_->cancel_timeout();
+               else
+                  stream_->set_read_deadline(std::chrono::steady_clock::time_point());
                if (error) {
                   handler(error);
                   return;
                }
+
+               const char* head = boost::asio::buffer_cast<const char*>(streambuf_.data());
+               read_request_line(head);
+               read_request_headers(head);
+               streambuf_.consume(requestParser_.size());
                
-               if (error_code error = read_request_line()) {
-                  handler(error);
-                  return;
-               }
-                  
-               if (error_code error = read_request_headers()) {
-                  handler(error);
-                  return;
-               }
-               
-               read_length(loadBufferFunc, [=](const error_code& error) {
-                     handler(error);
-                  });
+               handler(read_length());
             });
       }
 
-      error_code read_request_line() {
-         std::smatch requestMatch;
-         static const std::regex requestRegex("([-!#$%^&*+._'`|~0-9A-Za-z]+) (\\S+) (HTTP/\\d\\.\\d)");
-         if (!std::regex_match(get_line(), requestMatch, requestRegex))
-            return make_error_code(invalid_request_line);
-         
-         requestMethod_   = requestMatch[1];
-         requestResource_ = requestMatch[2];
-         requestVersion_  = requestMatch[3];
+      // Parse the request head in the streambuf, reading more data
+      // until it is complete.
+      void read_head(const FillBufferFunc& fillBufferFunc, bool asynchronous, const Handler& handler) {
+         const auto data = streambuf_.data();
+         switch (requestParser_.parse(
+                    boost::asio::buffer_cast<const char*>(data),
+                    boost::asio::buffer_size(data))) {
+         case detail::RequestParser::complete:
+            handler(error_code());
+            break;
+         case detail::RequestParser::failed:
+            handler(make_error_code(requestParser_.error()));
+            break;
+         case detail::RequestParser::incomplete:
+            // Fail as read_until() would if the head exceeds the
+            // buffer size.
+            if (streambuf_.size() >= streambuf_.max_size()) {
+               handler(make_error_code(boost::asio::error::not_found));
+               break;
+            }
+
+            // Wait up to the idle timeout for the first byte. The head
+            // timeout then runs once, from the first byte, so that
+            // trickled data cannot extend it.
+            if (!streambuf_.size())
+               set_head_timeout(asynchronous, timeouts_.idle);
+            else if (!headTimeoutSet_) {
+               headTimeoutSet_ = true;
+               set_head_timeout(asynchronous, timeouts_.head);
+            }
 
-         if (requestVersion_ != "HTTP/1.1")
-            return make_error_code(unsupported_http_version);
+            fillBufferFunc([=](const error_code& error) {
+                  if (error) {
+                     handler(error);
+                     return;
+                  }
 
-         std::smatch resourceMatch;
-         static const std::regex resourceRegex("(/[^?#]*)(?:\\?([^#]*))?(?:#(.*))?");
-         if (std::regex_match(requestResource_, resourceMatch, resourceRegex)) {
-            requestPath_ = decode(resourceMatch[1].first, resourceMatch[1].second);
-            requestFragment_ = decode(resourceMatch[3].first, resourceMatch[3].second);
-            requestQuery_ = parse_query(resourceMatch[2].str());
+                  read_head(fillBufferFunc, asynchronous, handler);
+               });
+            break;
          }
-         
-         return error_code();
       }
 
-      error_code read_request_headers() {
-         for (auto s = get_line(); !s.empty(); s = get_line()) {
-            const auto colon = s.find_first_of(':');
-            if (colon == std::string::npos)
-               return make_error_code(invalid_request_header);
+      // Time reads of the head on the timer wheel, or synchronous
+      // reads by a read deadline.
+      void set_head_timeout(bool asynchronous, detail::TimerWheel::duration timeout) {
+         if (asynchronous)
+            stream_->expires_from_now(timeout);
+         else if (timeout != detail::TimerWheel::duration::zero())
+            stream_->set_read_deadline(std::chrono::steady_clock::now() + timeout);
+         else
+            stream_->set_read_deadline(std::chrono::steady_clock::time_point());
+      }
 
-            std::string key = s.substr(0, colon);
-            std::string value = s.substr(colon + 1);
-            boost::algorithm::trim_left(value);
+      // Bounds the synchronous reads of one body read by the body
+      // timeout.
+      class BodyReadDeadline : boost::noncopyable {
+      public:
+         explicit BodyReadDeadline(HTTPTransaction& http)
+            : stream_(*http.stream_) {
+            if (http.timeouts_.body != detail::TimerWheel::duration::zero())
+               stream_.set_read_deadline(std::chrono::steady_clock::now() + http.timeouts_.body);
+         }
 
-            // Coalesce values with the same key.
-            const auto i = requestHeaders_.find(key);
-            if (i != requestHeaders_.end()) {
-               i->second += ", ";
-               i->second += value;
-            }
-            else
-               requestHeaders_.insert({{std::move(key), std::move(value)}});
+         ~BodyReadDeadline() {
+            stream_.set_read_deadline(std::chrono::steady_clock::time_point());
          }
 
-         return error_code();
+      private:
+         T& stream_;
+      };
+
+      void read_request_line(const char* head) {
+         const auto& method = requestParser_.method();
+         const auto& resource = requestParser_.resource();
+         const auto& version = requestParser_.version();
+         requestMethod_.assign(head + method.offset, method.size);
+         requestResource_.assign(head + resource.offset, resource.size);
+         requestVersion_.assign(head + version.offset, version.size);
+
+         // Split the resource into path, query, and fragment.
+         if (!requestResource_.empty() && requestResource_[0] == '/') {
+            boost::string_ref resource(requestResource_);
+            const size_t fragment = std::min(resource.find('#'), resource.size());
+            const size_t query = std::min(resource.substr(0, fragment).find('?'), fragment);
+            requestPath_ = decode(resource.substr(0, query));
+            if (query != fragment)
+               requestQuery_ = parse_query(resource.substr(query + 1, fragment - query - 1));
+            if (fragment != resource.size())
+               requestFragment_ = decode(resource.substr(fragment + 1));
+         }
+      }
+
+      void read_request_headers(const char* head) {
+         detail::add_fields(requestHeaders_, arena_, head, requestParser_);
       }
       
-      void read_length(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
-         auto contentLength = requestHeaders_.find("content-length");
-         if (contentLength != requestHeaders_.end()) {
-            boost::iostreams::filtering_istream is(
-               boost::make_iterator_range(
-                  contentLength->second.begin(),
-                  contentLength->second.end()));
-            is >> requestBytes_;
-            if (!is) {
-               handler(make_error_code(invalid_content_length));
-               return;
-            }
+      // Read trailers after the terminating chunk. The caller has
+      // loaded the buffer through the terminating empty line.
+      error_code read_request_trailers() {
+         requestParser_.reset_headers();
+         const char* head = boost::asio::buffer_cast<const char*>(streambuf_.data());
+         switch (requestParser_.parse(head, streambuf_.size())) {
+         case detail::RequestParser::complete:
+            read_request_headers(head);
+            streambuf_.consume(requestParser_.size());
+            return error_code();
+         case detail::RequestParser::failed:
+            return make_error_code(requestParser_.error());
+         default:
+            return make_error_code(invalid_request_header);
          }
-         
-         auto transferEncoding = requestHeaders_.find("transfer-encoding");
+      }
+      
+      error_code read_length() {
+         // Chunks are decoded, and checked against the maximum body
+         // size, as the body is read.
+         auto transferEncoding = requestHeaders_.find(detail::transfer_encoding_header);
          if (transferEncoding != requestHeaders_.end() &&
              transferEncoding->second != "identity") {
             requestBytes_ = 0U;
             requestChunksPending_ = true;
-            read_chunk_header(loadBufferFunc, handler);
+            return error_code();
+         }
+
+         auto contentLength = requestHeaders_.find(detail::content_length_header);
+         if (contentLength != requestHeaders_.end()) {
+            uint64_t length;
+            if (!detail::parse_decimal(contentLength->second, length) ||
+                length > std::numeric_limits<size_t>::max())
+               return make_error_code(invalid_content_length);
+            if (length > maxBodySize_)
+               return make_error_code(request_body_too_large);
+            requestBytes_ = static_cast<size_t>(length);
+         }
+         return error_code();
+      }
+
+      // Serialize the prefix (response line, response headers, and
+      // chunk header) and suffix (chunk delimiter or trailers) into
+      // the connection's write buffer and gather them with the
+      // client buffers.
+      template<typename ConstBufferSequence>
+      void prepare_write(const ConstBufferSequence& buffers, size_t nBytes) {
+         auto& buffer = stream_->write_buffer();
+         buffer.clear();
+         auto& gatherList = stream_->gather_list();
+         gatherList.clear();
+#ifdef ZLIB_H
+         if (deflater_) {
+            write_compressed(buffer, buffers, nBytes);
+            gatherList.push_back(boost::asio::const_buffer(buffer.data(), buffer.size()));
+            return;
+         }
+#endif
+
+         write_prefix(buffer, nBytes);
+         const size_t prefixSize = buffer.size();
+         write_suffix(buffer, nBytes);
+
+         if (prefixSize)
+            gatherList.push_back(boost::asio::const_buffer(buffer.data(), prefixSize));
+
+         for (const auto& b : buffers)
+            gatherList.push_back(boost::asio::const_buffer(b));
+
+         if (buffer.size() > prefixSize) {
+            gatherList.push_back(boost::asio::const_buffer(
+                                    buffer.data() + prefixSize, buffer.size() - prefixSize));
+         }
+      }
+
+      // Serialize a write into the response queue (see
+      // detail::ResponseQueue for when it completes).
+      template<typename ConstBufferSequence>
+      void queue_bytes(std::vector<char>& buffer, const ConstBufferSequence& buffers, size_t nBytes) {
+#ifdef ZLIB_H
+         if (deflater_) {
+            write_compressed(buffer, buffers, nBytes);
+            responseBytes_ += nBytes;
+            return;
+         }
+#endif
+         write_prefix(buffer, nBytes);
+         for (const auto& b : buffers) {
+            const boost::asio::const_buffer cb(b);
+            detail::append(
+               buffer,
+               boost::asio::buffer_cast<const char*>(cb),
+               boost::asio::buffer_size(cb));
+         }
+         write_suffix(buffer, nBytes);
+         responseBytes_ += nBytes;
+      }
+
+      template<typename ConstBufferSequence, typename WriteHandler>
+      void async_queue_write(const ConstBufferSequence& buffers, size_t nBytes, WriteHandler&& handler) {
+         typename std::decay<WriteHandler>::type h(std::forward<WriteHandler>(handler));
+         responseQueue_->async_append(
+            responseSequence_,
+            [&](std::vector<char>& buffer) { queue_bytes(buffer, buffers, nBytes); },
+            [=](const error_code& error) mutable { h(error, error ? 0 : nBytes); });
+      }
+
+      template<typename ConstBufferSequence>
+      error_code queue_write(const ConstBufferSequence& buffers, size_t nBytes) {
+         return responseQueue_->append(
+            responseSequence_,
+            [&](std::vector<char>& buffer) { queue_bytes(buffer, buffers, nBytes); });
+      }
+
+      bool compressing() const {
+#ifdef ZLIB_H
+         return deflater_ != nullptr;
+#else
+         return false;
+#endif
+      }
+
+      // Decide whether to compress the response at its first write,
+      // of nBytes, and if so set the response headers for it.
+      void start_compression(size_t nBytes) {
+#ifdef ZLIB_H
+         if (!compression_.enabled || responseBytes_ || deflater_)
+            return;
+
+         auto status = response_status();
+         auto& headers = response_headers();
+         if (status < 200 || status == 204 || status == 206 || status == 304 ||
+             requestParser_.method_type() == detail::head_method ||
+             headers.find(detail::content_encoding_header) != headers.end() ||
+             headers.find(detail::content_range_header) != headers.end())
+            return;
+
+         auto contentLength = headers.find(detail::content_length_header);
+         if (contentLength != headers.end()) {
+            uint64_t length;
+            if (!detail::parse_decimal(contentLength->second, length) ||
+                length < compression_.minimumSize)
+               return;
          }
+         else if (nBytes < compression_.minimumSize)
+            return;
+
+         auto acceptEncoding = request_headers().find(detail::accept_encoding_header);
+         if (acceptEncoding == request_headers().end())
+            return;
+         const char* encoding;
+         if (detail::accepts_encoding(acceptEncoding->second, "gzip"))
+            encoding = "gzip";
+         else if (detail::accepts_encoding(acceptEncoding->second, "deflate"))
+            encoding = "deflate";
          else
-            handler(error_code());
+            return;
+
+         deflater_ = detail::DeflaterPool::instance().acquire(
+            encoding[0] == 'g', compression_.level);
+         headers.erase(detail::content_length_header);
+         headers[detail::content_encoding_header] = encoding;
+         headers[detail::transfer_encoding_header] = "chunked";
+
+         // The coded body is a different representation: it needs its
+         // own entity tag, and byte ranges of it cannot be served.
+         auto etag = headers.find(detail::etag_header);
+         if (etag != headers.end())
+            etag->second = detail::coded_etag(etag->second, encoding);
+         headers.erase(detail::accept_ranges_header);
+         auto vary = headers.find(detail::vary_header);
+         if (vary == headers.end())
+            headers[detail::vary_header] = "Accept-Encoding";
+         else if (vary->second.find("Accept-Encoding") == std::string::npos)
+            vary->second += ", Accept-Encoding";
+#else
+         (void)nBytes;
+#endif
       }
 
-      void read_chunk_header(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
-         assert(requestBytes_ == 0);
-         assert(requestChunksPending_);
-         loadBufferFunc(crlf(), [=](const error_code& error) {
-               if (error) {
-                  handler(error);
-                  return;
-               }
-                  
-               // Chunk header begins with a hexadecimal chunk length.
-               std::istringstream is(get_line());
-               is >> std::hex >> requestBytes_;
-               if (!is) {
-                  handler(make_error_code(invalid_chunk_length));
-                  return;
-               }
-               
-               if (!requestBytes_) {
-                  requestChunksPending_ = false;
-
-                  // Read trailers after the terminating chunk. The
-                  // trailers end with an empty line, i.e. consecutive
-                  // CRLF, but when there are no trailers we have
-                  // already consumed the first CRLF. We restore it
-                  // before loading the buffer through the empty line.
-                  streambuf_.sungetc();
-                  streambuf_.sungetc();
-                  loadBufferFunc(crlf2(), [=](const error_code& error) {
-                        if (error) {
-                           handler(error);
-                           return;
-                        }
-
-                        // Skip the restored CRLF to position the
-                        // stream at the start of trailers.
-                        streambuf_.snextc();
-                        streambuf_.snextc();
-                        handler(read_request_headers());
-                     });
-               }
-               else
-                  handler(error);
-            });
+#ifdef ZLIB_H
+      // Serialize a write of nBytes through the deflater. The output
+      // zlib has ready is sent as a chunk, and a write of no bytes
+      // ends the stream and the chunked body.
+      template<typename ConstBufferSequence>
+      void write_compressed(std::vector<char>& buffer, const ConstBufferSequence& buffers, size_t nBytes) {
+         const auto& data = deflater_->deflate(buffers, nBytes == 0);
+         if (responseBytes_ == 0)
+            write_head(buffer);
+         if (!data.empty()) {
+            detail::append_hex(buffer, data.size());
+            detail::append(buffer, crlf());
+            detail::append(buffer, data.data(), data.size());
+            detail::append(buffer, crlf());
+         }
+         if (nBytes == 0) {
+            detail::append(buffer, "0");
+            detail::append(buffer, crlf());
+            detail::append_fields(buffer, response_trailers());
+            detail::DeflaterPool::instance().release(std::move(deflater_));
+         }
       }
+#endif
 
-      std::string prepare_write_prefix(size_t nBytes) {
+      void write_prefix(std::vector<char>& buffer, size_t nBytes) {
          // The prefix includes the status line and headers if this is
          // the first write.
-         std::ostringstream os;
-         if (responseBytes_ == 0) {
-            // Set Date header if not already present.
-            if (response_headers().find("date") == response_headers().end()) {
-               std::time_t t;
-               std::time(&t);
-               std::tm tm = *std::gmtime(&t);
-               char s[30];
-               auto n = strftime(s, sizeof(s), "%a, %d %b %Y %T GMT", &tm);
-               response_header("Date") = std::string(s, n);
-            }
+         if (responseBytes_ == 0)
+            write_head(buffer);
 
-            // RFC 2616 section 4.4:
-            //  Any response message which "MUST NOT" include a
-            //  message-body (such as the 1xx, 204, and 304 responses
-            //  and any response to a HEAD request) is always
-            //  terminated by the first empty line after the header
-            //  fields, regardless of the entity-header fields present
-            //  in the message.
-            auto status = response_status();
-            static const std::string head = "HEAD";
-            if (status >= 200 && status != 204 && status != 304 &&
-                request_method() != head) {
-               // Determine whether to use chunked transfer.
-               auto transferEncoding = response_headers().find("transfer-encoding");
-               if (transferEncoding != response_headers().end() &&
-                   transferEncoding->second != "identity") {
-                  responseChunked_ = true;
-                  response_headers().erase("content-length");
-               }
-               else if (response_headers().count("content-length") == 0) {
-                  responseChunked_ = true;
-                  response_header("Transfer-Encoding") = "chunked";
-               }
-            }
+         if (responseChunked_) {
+            detail::append_hex(buffer, nBytes);
+            detail::append(buffer, crlf());
+         }
+      }
 
-            write_status(os);
-            write_headers(os, response_headers());
+      void write_head(std::vector<char>& buffer) {
+         // RFC 2616 section 4.4:
+         //  Any response message which "MUST NOT" include a
+         //  message-body (such as the 1xx, 204, and 304 responses
+         //  and any response to a HEAD request) is always
+         //  terminated by the first empty line after the header
+         //  fields, regardless of the entity-header fields present
+         //  in the message.
+         auto status = response_status();
+         if (status >= 200 && status != 204 && status != 304 &&
+             requestParser_.method_type() != detail::head_method) {
+            // Determine whether to use chunked transfer.
+            auto transferEncoding = response_headers().find(detail::transfer_encoding_header);
+            if (transferEncoding != response_headers().end() &&
+                transferEncoding->second != "identity") {
+               responseChunked_ = true;
+               response_headers().erase(detail::content_length_header);
+            }
+            else if (response_headers().find(detail::content_length_header) == response_headers().end()) {
+               responseChunked_ = true;
+               response_headers()[detail::transfer_encoding_header] = "chunked";
+            }
          }
 
-         if (responseChunked_)
-            os << boost::format("%x%s") % nBytes % crlf();
-         
-         return os.str();
+         detail::append_status_line(buffer, responseStatus_);
+
+         // Send the cached Date unless the handler set one.
+         if (response_headers().find(detail::date_header) == response_headers().end()) {
+            char date[detail::DateCache::Size];
+            detail::DateCache::instance().read(date);
+            detail::append(buffer, "Date: ");
+            detail::append(buffer, date, sizeof(date));
+            detail::append(buffer, crlf());
+         }
+         detail::append_fields(buffer, response_headers());
       }
 
-      std::string prepare_write_suffix(size_t nBytes) {
-         std::ostringstream os;
+      void write_suffix(std::vector<char>& buffer, size_t nBytes) {
          if (responseChunked_) {
             // Add crlf to all chunks except the final one.
             if (nBytes)
-               os << crlf();
+               detail::append(buffer, crlf());
             else
-               write_headers(os, response_trailers());
-         }
-
-         return os.str();
-      }
-
-      void write_status(std::ostream& os) {
-         static std::map<unsigned int, std::string> reasons = {
-            { 100, "Continue" },
-            { 101, "Switching Protocols" },
-            { 200, "OK" },
-            { 201, "Created" },
-            { 202, "Accepted" },
-            { 203, "Non-Authoritative Information" },
-            { 204, "No Content" },
-            { 205, "Reset Content" },
-            { 206, "Partial Content" },
-            { 300, "Multiple Choices" },
-            { 301, "Moved Permanently" },
-            { 302, "Found" },
-            { 303, "See Other" },
-            { 304, "Not Modified" },
-            { 305, "Use Proxy" },
-            { 307, "Temporary Redirect" },
-            { 400, "Bad Request" },
-            { 401, "Unauthorized" },
-            { 402, "Payment Required" },
-            { 403, "Forbidden" },
-            { 404, "Not Found" },
-            { 405, "Method Not Allowed" },
-            { 406, "Not Acceptable" },
-            { 407, "Proxy Authentication Required" },
-            { 408, "Request Timeout" },
-            { 409, "Conflict" },
-            { 410, "Gone" },
-            { 411, "Length Required" },
-            { 412, "Precondition Failed" },
-            { 413, "Payload Too Large" },
-            { 414, "URI Too Long" },
-            { 415, "Unsupported Media Type" },
-            { 416, "Range Not Satisfiable" },
-            { 417, "Expectation Failed" },
-            { 426, "Upgrade Required" },
-            { 500, "Internal Server Error" },
-            { 501, "Not Implemented" },
-            { 502, "Bad Gateway" },
-            { 503, "Service Unavailable" },
-            { 504, "Gateway Timeout" },
-            { 505, "HTTP Version Not Supported" }
-         };
-
-         auto reason = reasons.find(responseStatus_);
-         os << boost::format("HTTP/1.1 %d %s%s")
-            % responseStatus_
-            % (reason != reasons.end() ? reason->second : std::string())
-            % crlf();
-      }
-
-      void write_headers(std::ostream& os, const Headers& headers) {
-         for (const auto& value : headers) {
-            os << boost::format("%s: %s%s")
-               % value.first
-               % value.second
-               % crlf();
+               detail::append_fields(buffer, response_trailers());
          }
-         os << crlf();
       }
    };
-   
+
    typedef HTTPTransaction<TCP> HTTP;
 #ifdef BOOST_ASIO_SSL_HPP
    typedef HTTPTransaction<TLS> HTTPS;
 #endif
 
-   template<typename Derived, typename T>
-   class BaseHTTPServer : public std::enable_shared_from_this<BaseHTTPServer<Derived, T> > {
-   public:
-      typedef boost::system::error_code error_code;
-      typedef HTTPTransaction<T> Transaction;
-      typedef std::function<void(const std::shared_ptr<Transaction>&)> Handler;
+   template<typename Derived, typename T>
+   class BaseHTTPServer : public std::enable_shared_from_this<BaseHTTPServer<Derived, T> > {
+   public:
+      typedef boost::system::error_code error_code;
+      typedef HTTPTransaction<T> Transaction;
+      typedef std::function<void(const std::shared_ptr<Transaction>&)> Handler;
+      typedef detail::HandlerTable<Handler> HandlerTable;
+
+      // Create and start a new server.
+      template<typename... Args>
+      static std::shared_ptr<Derived> create(Args&&... args) {
+         return std::shared_ptr<Derived>(new Derived(std::forward<Args>(args)...));
+      }
+
+      // Stop accepting new connections. References to the server will
+      // be dropped when all existing connections close.
+      void destroy() {
+         for (auto& acceptor : acceptors_)
+            strand_.dispatch([&]() { acceptor.cancel(); });
+         // The cancel may never run if the io_service is stopped, and
+         // the timer may already have fired with its handler queued,
+         // so the refresher is released here and the handler checks
+         // the flag.
+         release_date_refresher();
+         auto this_ = this->shared_from_this();
+         strand_.dispatch([=]() { this_->dateTimer_.cancel(); });
+      }
+      
+      // Add a local address/port to bind and listen.
+      virtual unsigned short listen(const boost::asio::ip::tcp::acceptor::endpoint_type& endpoint) {
+         return add_acceptor(endpoint, false);
+      }
+
+      // Add a local address/port to bind and listen with
+      // SO_REUSEPORT, so other servers may bind the same address and
+      // the kernel balances connections among them.
+      unsigned short listen_shared(const boost::asio::ip::tcp::acceptor::endpoint_type& endpoint) {
+         return add_acceptor(endpoint, true);
+      }
+
+      // Set the handler to invoke on an HTTP URI path. The handler
+      // for "" is used for unmatched paths.
+      virtual void set_handler(const std::string& path, const Handler& handler) {
+         handlers_->set(path, handler);
+      }
+
+      // Set the handler to invoke on paths matching a route pattern
+      // (see detail::Router), e.g. "/items/:id" or "/static/*file".
+      // An exact path set with set_handler() takes precedence over
+      // parameters. Throws std::invalid_argument if the pattern is
+      // malformed or conflicts with the parameter names of another
+      // route.
+      virtual void set_route(const std::string& pattern, const Handler& handler) {
+         handlers_->set_route(pattern, handler);
+      }
+
+      // Servers sharing a handler table see each other's
+      // set_handler() and set_route() calls. Set this before listen().
+      const std::shared_ptr<HandlerTable>& handler_table() const {
+         return handlers_;
+      }
+
+      void set_handler_table(const std::shared_ptr<HandlerTable>& handlers) {
+         handlers_ = handlers;
+      }
+
+      // By default handlers are invoked one at a time on the server
+      // strand. With concurrent dispatch each handler is invoked on
+      // its connection's strand, so running the io_service on
+      // multiple threads runs handlers in parallel. Handlers must
+      // then be thread-safe. Set this before listen().
+      virtual void set_concurrent_dispatch(bool concurrent) {
+         concurrentDispatch_ = concurrent;
+      }
+      
+      // Set or get the limit on request head size for subsequent
+      // connections (see HTTPTransaction).
+      virtual void set_head_limit(size_t nBytes) {
+         headLimit_ = nBytes;
+      }
+
+      size_t head_limit() const {
+         return headLimit_;
+      }
+
+      // Set or get the listen queue length for subsequent listen()
+      // calls. The default is the system maximum (SOMAXCONN).
+      virtual void set_accept_backlog(int backlog) {
+         acceptBacklog_ = backlog;
+      }
+
+      int accept_backlog() const {
+         return acceptBacklog_;
+      }
+
+      // Set or get the number of accepts kept pending on each
+      // subsequent listen() endpoint. When a burst of connections
+      // makes the acceptor ready, each pending accept completes in
+      // the same reactor wakeup. Set this before listen().
+      virtual void set_accept_concurrency(size_t nAccepts) {
+         acceptConcurrency_ = std::max<size_t>(nAccepts, 1);
+      }
+
+      size_t accept_concurrency() const {
+         return acceptConcurrency_;
+      }
+
+      // Set or get the read timeouts for subsequent requests (see
+      // HTTPTransaction::Timeouts). Timeouts are checked once per
+      // second by a timer wheel shared by the server's connections.
+      typedef typename Transaction::Timeouts Timeouts;
+      virtual void set_timeouts(const Timeouts& timeouts) {
+         timeouts_ = timeouts;
+      }
+
+      const Timeouts& timeouts() const {
+         return timeouts_;
+      }
+
+      // Set or get the maximum request body size for subsequent
+      // requests. A request declaring a larger Content-Length is
+      // answered with 413 before any of its body is read, and the
+      // connection is closed. Handlers see a larger chunked body
+      // fail with request_body_too_large as it is read.
+      virtual void set_max_body_size(uint64_t nBytes) {
+         maxBodySize_ = nBytes;
+      }
+
+      uint64_t max_body_size() const {
+         return maxBodySize_;
+      }
 
-      // Create and start a new server.
-      template<typename... Args>
-      static std::shared_ptr<Derived> create(Args&&... args) {
-         return std::shared_ptr<Derived>(new Derived(std::forward<Args>(args)...));
+      // Set or get the number of requests on a connection that may
+      // be handled at once. With a depth above 1, a request the
+      // client has pipelined behind one without a body is read and
+      // dispatched without waiting for the first to finish, and
+      // responses are queued in memory, up to a limit per response,
+      // to be sent in request order (see detail::ResponseQueue).
+      // The default of 1 handles
+      // requests one after another. Set this before listen().
+      virtual void set_pipeline_depth(size_t depth) {
+         pipelineDepth_ = std::max<size_t>(depth, 1);
       }
 
-      // Stop accepting new connections. References to the server will
-      // be dropped when all existing connections close.
-      void destroy() {
-         for (auto& acceptor : acceptors_)
-            strand_.dispatch([&]() { acceptor.cancel(); });
+      size_t pipeline_depth() const {
+         return pipelineDepth_;
       }
-      
-      // Add a local address/port to bind and listen.
-      virtual unsigned short listen(const boost::asio::ip::tcp::acceptor::endpoint_type& endpoint) {
-         acceptors_.emplace_back(io_, endpoint);
-         accept(acceptors_.back());
-         return acceptors_.back().local_endpoint().port();
+
+#ifdef ZLIB_H
+      // Set or get the response compression for subsequent requests
+      // (see HTTPTransaction::Compression). Disabled by default.
+      typedef typename Transaction::Compression Compression;
+      virtual void set_compression(const Compression& compression) {
+         compression_ = compression;
       }
 
-      // Set the handler to invoke on an HTTP URI path.
-      virtual void set_handler(const std::string& path, const Handler& handler) {
-         auto this_ = this->shared_from_this();
-         strand_.dispatch([=]() {
-               this_.get();
-               if (handler)
-                  handlers_[path] = handler;
-               else
-                  handlers_.erase(path);
-            });
+      const Compression& compression() const {
+         return compression_;
       }
-      
+
+      // Set or get request body decoding for subsequent requests (see
+      // HTTPTransaction::Decompression). Disabled by default.
+      typedef typename Transaction::Decompression Decompression;
+      virtual void set_decompression(const Decompression& decompression) {
+         decompression_ = decompression;
+      }
+
+      const Decompression& decompression() const {
+         return decompression_;
+      }
+#endif
+
       typedef std::function<void(const std::string&)> LogCallback;
       virtual void set_logger(const LogCallback& logCallback) {
          logCallback_ = logCallback;
@@ -1145,13 +5180,22 @@ namespace chunky {
       
       BaseHTTPServer(boost::asio::io_service& io)
          : io_(io)
-         , strand_(io_) {
-         handlers_[std::string()] = [this](const std::shared_ptr<Transaction>& http) {
-            default_handler(http);
-         };
+         , strand_(io_)
+         , dateTimer_(io_)
+         , dateTimerRunning_(false)
+         , handlerMemory_(std::make_shared<detail::HandlerMemory>())
+         , timerWheel_(std::make_shared<detail::TimerWheel>())
+         , maxBodySize_(std::numeric_limits<uint64_t>::max())
+         , headLimit_(Transaction::DefaultHeadLimit)
+         , acceptBacklog_(boost::asio::socket_base::max_connections)
+         , acceptConcurrency_(1)
+         , pipelineDepth_(1)
+         , concurrentDispatch_(false)
+         , handlers_(std::make_shared<HandlerTable>()) {
       }
 
       virtual ~BaseHTTPServer() {
+         release_date_refresher();
       }
 
       virtual boost::asio::io_service& get_io_service() { return io_; }
@@ -1193,22 +5237,88 @@ namespace chunky {
       boost::asio::io_service& io_;
       boost::asio::io_service::strand strand_;
       std::list<boost::asio::ip::tcp::acceptor> acceptors_;
+      boost::asio::steady_timer dateTimer_;
+      std::atomic<bool> dateTimerRunning_;
+      std::shared_ptr<detail::HandlerMemory> handlerMemory_;
+      std::shared_ptr<detail::TimerWheel> timerWheel_;
+      Timeouts timeouts_;
+#ifdef ZLIB_H
+      Compression compression_;
+      Decompression decompression_;
+#endif
+      uint64_t maxBodySize_;
+      size_t headLimit_;
+      int acceptBacklog_;
+      size_t acceptConcurrency_;
+      size_t pipelineDepth_;
+      bool concurrentDispatch_;
       
-      std::map<std::string, Handler> handlers_;
+      std::shared_ptr<HandlerTable> handlers_;
       LogCallback logCallback_;
 
+      unsigned short add_acceptor(
+         const boost::asio::ip::tcp::acceptor::endpoint_type& endpoint,
+         bool reusePort) {
+         boost::asio::ip::tcp::acceptor acceptor(io_);
+         acceptor.open(endpoint.protocol());
+         acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+         if (reusePort) {
+#ifdef SO_REUSEPORT
+            typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+            acceptor.set_option(reuse_port(true));
+#else
+            throw boost::system::system_error(
+               make_error_code(boost::asio::error::operation_not_supported));
+#endif
+         }
+         acceptor.bind(endpoint);
+         acceptor.listen(acceptBacklog_);
+
+         acceptors_.push_back(std::move(acceptor));
+         for (size_t i = 0; i < acceptConcurrency_; ++i)
+            accept(acceptors_.back());
+         bool running = false;
+         if (dateTimerRunning_.compare_exchange_strong(running, true)) {
+            detail::DateCache::instance().add_refresher();
+            refresh_date();
+         }
+         return acceptors_.back().local_endpoint().port();
+      }
+
+      // Called by whichever of destroy(), the destructor and the date
+      // timer's handler stops the timer first.
+      void release_date_refresher() {
+         if (dateTimerRunning_.exchange(false))
+            detail::DateCache::instance().remove_refresher();
+      }
+
+      // Refresh the shared Date value and advance the timer wheel at
+      // the start of each second until destroy().
+      void refresh_date() {
+         auto this_ = this->shared_from_this();
+         const auto now = std::chrono::system_clock::now().time_since_epoch();
+         dateTimer_.expires_from_now(
+            std::chrono::seconds(1) -
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+               now % std::chrono::seconds(1)));
+         dateTimer_.async_wait(strand_.wrap(detail::make_alloc_handler(handlerMemory_, [=](const error_code& error) {
+                  if (error || !this_->dateTimerRunning_) {
+                     this_->release_date_refresher();
+                     return;
+                  }
+
+                  detail::DateCache::instance().refresh();
+                  this_->timerWheel_->tick();
+                  this_->refresh_date();
+               })));
+      }
+
       void accept(boost::asio::ip::tcp::acceptor& acceptor) {
          auto this_ = this->shared_from_this();
          connect_transport(
             acceptor,
             [=, &acceptor](const error_code& error, const std::shared_ptr<Transport>& transport) {
-               if (!error) {
-                  log((boost::format("connect %s:%d")
-                       % transport->stream().lowest_layer().remote_endpoint().address().to_string()
-                       % transport->stream().lowest_layer().remote_endpoint().port()).str());
-                  create_transaction(transport);
-               }
-               else {
+               if (error) {
                   log(error);
 
                   // Stop accepting on system errors to avoid runaway.
@@ -1217,32 +5327,74 @@ namespace chunky {
                      return;
                }
 
-               strand_.dispatch([=, &acceptor]() { this_->accept(acceptor); });
+               // Re-arm before starting the connection so the accept
+               // stays pending while the transaction is set up.
+               strand_.dispatch(detail::make_alloc_handler(
+                                   handlerMemory_, [=, &acceptor]() { this_->accept(acceptor); }));
+
+               if (!error) {
+                  if (logCallback_) {
+                     error_code ignored;
+                     auto endpoint = transport->stream().lowest_layer().remote_endpoint(ignored);
+                     log((boost::format("connect %s:%d")
+                          % endpoint.address().to_string()
+                          % endpoint.port()).str());
+                  }
+                  transport->set_timer_wheel(timerWheel_);
+                  create_transaction(
+                     transport,
+                     pipelineDepth_ > 1 ? std::make_shared<ResponseQueue>(transport) : nullptr);
+               }
             });
       }
 
-      void create_transaction(const std::shared_ptr<Transport>& transport) {
+      typedef detail::ResponseQueue<Transport> ResponseQueue;
+
+      // Read and dispatch the next request on a connection. With a
+      // response queue, the next request may be started before this
+      // one is destroyed.
+      void create_transaction(
+         const std::shared_ptr<Transport>& transport,
+         const std::shared_ptr<ResponseQueue>& queue) {
          auto this_ = this->shared_from_this();
          auto keepalive = std::make_shared<bool>(true);
+         auto pipelined = queue ? std::make_shared<bool>(false) : nullptr;
+         const uint64_t sequence = queue ? queue->push() : 0;
          std::shared_ptr<Transaction> http(
-            new Transaction(transport),
+            new Transaction(transport, headLimit_),
             [=](Transaction* pointer) {
                *keepalive &= keep_alive(*pointer);
-               if (*keepalive) {
-                  get_io_service().post([=]() {
+               if (queue && !*keepalive)
+                  queue->close_after(sequence);
+               if (*keepalive && !(pipelined && *pipelined)) {
+                  get_io_service().post(detail::make_alloc_handler(transport->handler_memory(), [=]() {
                         this_.get();
-                        create_transaction(transport);
-                     });
+                        create_transaction(transport, queue);
+                     }));
                }
 
                delete pointer;
             });
+         http->set_timeouts(timeouts_);
+         http->set_max_body_size(maxBodySize_);
+#ifdef ZLIB_H
+         http->set_compression(compression_);
+         http->set_decompression(decompression_);
+#endif
+         if (queue)
+            http->set_response_queue(queue, sequence);
 
          // For convenience, issue a null read so that request
          // metadata is already valid for the callback.
          http->async_read_some(
             boost::asio::null_buffers(),
-            [=](boost::system::error_code error, size_t) {
+            detail::make_alloc_handler(transport->handler_memory(), [=](boost::system::error_code error, size_t) {
+               if (error == make_error_code(request_body_too_large)) {
+                  log(error);
+                  reject_body(http, queue);
+                  return;
+               }
+
                if (error) {
                   disconnect_transport(http->stream(), error);
                   log(error);
@@ -1250,29 +5402,132 @@ namespace chunky {
                   return;
                }
 
-               strand_.dispatch([=]() { dispatch_transaction(http); });
-            });
+               if (queue) {
+                  // An earlier response closes the connection.
+                  if (!queue->expects(sequence)) {
+                     *keepalive = false;
+                     return;
+                  }
+
+                  if (can_pipeline(*http) && queue->size() < pipelineDepth_) {
+                     *pipelined = true;
+                     create_transaction(transport, queue);
+                  }
+               }
+
+               auto& strand = concurrentDispatch_ ? transport->strand() : strand_;
+               strand.dispatch(detail::make_alloc_handler(
+                                  transport->handler_memory(), [=]() { dispatch_transaction(http); }));
+            }));
       }
       
+      enum { MaxLingerBytes = 1 << 20 };
+      enum { LingerSeconds = 5 };
+
+      // Answer 413 to a request whose body is too large, without
+      // reading the body, and close the connection.
+      void reject_body(
+         const std::shared_ptr<Transaction>& http,
+         const std::shared_ptr<ResponseQueue>& queue) {
+         http->response_status() = 413;
+         http->response_headers()[detail::connection_header] = "close";
+         http->response_headers()[detail::content_length_header] = "0";
+
+         auto this_ = this->shared_from_this();
+         auto transport = http->stream();
+         auto pending = std::make_shared<std::shared_ptr<Transaction> >(http);
+         http->async_finish([=](const boost::system::error_code& error) {
+               // Release the transaction so a queued response can
+               // complete.
+               pending->reset();
+               if (error)
+                  return;
+               if (!queue) {
+                  this_->linger(transport);
+                  return;
+               }
+               queue->async_wait_last([=](const boost::system::error_code& error) {
+                     if (!error)
+                        this_->linger(transport);
+                  });
+            });
+      }
+
+      // Closing a socket with unread data resets the connection, which
+      // can discard a response the client has not read yet. Instead,
+      // end the response stream and discard what the client still
+      // sends, until it closes, MaxLingerBytes arrive or LingerSeconds
+      // pass.
+      void linger(const std::shared_ptr<Transport>& transport) {
+         error_code error;
+         transport->stream().lowest_layer().shutdown(
+            boost::asio::socket_base::shutdown_send, error);
+         if (error)
+            return;
+
+         transport->expires_from_now(std::chrono::seconds(LingerSeconds));
+         discard(transport, std::make_shared<std::vector<char> >(16384), 0);
+      }
+
+      void discard(
+         const std::shared_ptr<Transport>& transport,
+         const std::shared_ptr<std::vector<char> >& buffer,
+         size_t nDiscarded) {
+         auto this_ = this->shared_from_this();
+         transport->async_read_some(
+            boost::asio::buffer(*buffer),
+            detail::make_alloc_handler(transport->handler_memory(), [=](const error_code& error, size_t n) {
+               if (error || nDiscarded + n >= MaxLingerBytes) {
+                  transport->cancel_timeout();
+                  return;
+               }
+               this_->discard(transport, buffer, nDiscarded + n);
+            }));
+      }
+
       void dispatch_transaction(const std::shared_ptr<Transaction>& transaction) {
-         auto i = handlers_.find(transaction->request_path());
-         if (i == handlers_.end())
-            i = handlers_.find(std::string());
-         i->second(transaction);
+         // Use the handler for the route matching the path, else the
+         // handler for the empty path, else default_handler().
+         const auto router = handlers_->snapshot();
+         auto& parameters = transaction->path_parameters();
+         auto handler = router->find(transaction->request_path(), parameters);
+         if (!handler)
+            handler = router->find(boost::string_ref(), parameters);
+         if (handler) {
+            parameters.retain(router);
+            (*handler)(transaction);
+         }
+         else
+            default_handler(transaction);
       }
       
+      // A request may be handled along with the next one if the
+      // client has already sent it, and the request does not end or
+      // take over the connection. Waiting for a request that has not
+      // arrived is left until the previous one is done, so the idle
+      // timeout does not run while a handler does.
+      bool can_pipeline(const Transaction& http) {
+         if (!http.next_request_buffered() ||
+             http.request_method() == "CONNECT" ||
+             http.request_headers().find(detail::upgrade_header) != http.request_headers().end())
+            return false;
+
+         auto requestConnection = http.request_headers().find(detail::connection_header);
+         return requestConnection == http.request_headers().end() ||
+            requestConnection->second != "close";
+      }
+
       bool keep_alive(Transaction& http) {
          if (http.response_status() == 101)
             return false;
          
-         static const std::string connection("Connection");
          static const std::string close("close");
-         auto requestConnection = http.request_headers().find(connection);
+         auto requestConnection = http.request_headers().find(detail::connection_header);
          if (requestConnection != http.request_headers().end() &&
              requestConnection->second == close)
             return false;
 
-         auto responseConnection = http.response_headers().find(connection);
+         auto responseConnection = http.response_headers().find(detail::connection_header);
          if (responseConnection != http.response_headers().end() &&
              responseConnection->second == close)
             return false;
@@ -1332,7 +5587,511 @@ namespace chunky {
       }
    };
 #endif
-   
+
+   // A server with one io_service and thread per shard (by default
+   // one per core). Every shard listens on the same endpoints with
+   // SO_REUSEPORT, so the kernel balances connections among shards
+   // and a connection stays on its shard's thread. Shards share one
+   // handler table. Server is SimpleHTTPServer or SimpleHTTPSServer,
+   // and constructor arguments after nShards are passed to each
+   // Server::create() after its io_service.
+   template<typename Server>
+   class ShardedHTTPServer : boost::noncopyable {
+   public:
+      typedef typename Server::Handler Handler;
+      typedef typename Server::LogCallback LogCallback;
+
+      template<typename... Args>
+      explicit ShardedHTTPServer(size_t nShards, Args&... args) {
+         if (!nShards)
+            nShards = std::max(1u, std::thread::hardware_concurrency());
+         for (size_t i = 0; i < nShards; ++i) {
+            ios_.emplace_back(new boost::asio::io_service);
+            servers_.push_back(Server::create(*ios_.back(), args...));
+            servers_.back()->set_handler_table(servers_.front()->handler_table());
+         }
+      }
+
+      ~ShardedHTTPServer() {
+         stop();
+      }
+
+      // Add a local address/port to bind and listen on every shard.
+      // Returns the port, which is chosen by the first shard if
+      // endpoint has port 0.
+      unsigned short listen(boost::asio::ip::tcp::acceptor::endpoint_type endpoint) {
+         for (auto& server : servers_)
+            endpoint.port(server->listen_shared(endpoint));
+         return endpoint.port();
+      }
+
+      void set_handler(const std::string& path, const Handler& handler) {
+         servers_.front()->set_handler(path, handler);
+      }
+
+      void set_route(const std::string& pattern, const Handler& handler) {
+         servers_.front()->set_route(pattern, handler);
+      }
+
+      void set_head_limit(size_t nBytes) {
+         for (auto& server : servers_)
+            server->set_head_limit(nBytes);
+      }
+
+      void set_accept_backlog(int backlog) {
+         for (auto& server : servers_)
+            server->set_accept_backlog(backlog);
+      }
+
+      void set_accept_concurrency(size_t nAccepts) {
+         for (auto& server : servers_)
+            server->set_accept_concurrency(nAccepts);
+      }
+
+      void set_timeouts(const typename Server::Timeouts& timeouts) {
+         for (auto& server : servers_)
+            server->set_timeouts(timeouts);
+      }
+
+      void set_max_body_size(uint64_t nBytes) {
+         for (auto& server : servers_)
+            server->set_max_body_size(nBytes);
+      }
+
+      void set_pipeline_depth(size_t depth) {
+         for (auto& server : servers_)
+            server->set_pipeline_depth(depth);
+      }
+
+#ifdef ZLIB_H
+      void set_compression(const typename Server::Compression& compression) {
+         for (auto& server : servers_)
+            server->set_compression(compression);
+      }
+
+      void set_decompression(const typename Server::Decompression& decompression) {
+         for (auto& server : servers_)
+            server->set_decompression(decompression);
+      }
+#endif
+
+      // The callback is invoked from every shard's thread.
+      void set_logger(const LogCallback& logCallback) {
+         for (auto& server : servers_)
+            server->set_logger(logCallback);
+      }
+
+      // Start a thread per shard, pinned to a core where supported.
+      void run() {
+         for (size_t i = 0; i < ios_.size(); ++i) {
+            auto& io = *ios_[i];
+            threads_.emplace_back([&io, i]() {
+#ifdef __linux__
+                  const unsigned nCores = std::thread::hardware_concurrency();
+                  if (nCores) {
+                     cpu_set_t cpus;
+                     CPU_ZERO(&cpus);
+                     CPU_SET(i % nCores, &cpus);
+                     pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+                  }
+#endif
+                  io.run();
+               });
+         }
+      }
+
+      // Stop accepting and wait for the shard threads to exit. Open
+      // connections are abandoned.
+      void stop() {
+         for (auto& server : servers_)
+            server->destroy();
+         for (auto& io : ios_)
+            io->stop();
+         for (auto& thread : threads_)
+            thread.join();
+         threads_.clear();
+      }
+
+      size_t size() const {
+         return servers_.size();
+      }
+
+      Server& shard(size_t i) {
+         return *servers_[i];
+      }
+
+   private:
+      std::vector<std::unique_ptr<boost::asio::io_service> > ios_;
+      std::vector<std::shared_ptr<Server> > servers_;
+      std::vector<std::thread> threads_;
+   };
+
+#ifndef _WIN32
+   namespace detail {
+      // LRU cache of file contents bounded by total size. Entries are
+      // keyed by path and valid while the file's size and
+      // modification time are unchanged.
+      class FileCache : boost::noncopyable {
+      public:
+         explicit FileCache(size_t capacity)
+            : capacity_(capacity)
+            , size_(0) {
+         }
+
+         std::shared_ptr<const std::string> find(
+            const std::string& path,
+            uint64_t fileSize,
+            std::time_t mtime) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto i = index_.find(path);
+            if (i == index_.end())
+               return nullptr;
+
+            auto entry = i->second;
+            if (entry->fileSize != fileSize || entry->mtime != mtime) {
+               erase(entry);
+               return nullptr;
+            }
+
+            entries_.splice(entries_.begin(), entries_, entry);
+            return entry->data;
+         }
+
+         void insert(
+            const std::string& path,
+            uint64_t fileSize,
+            std::time_t mtime,
+            const std::shared_ptr<const std::string>& data) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (data->size() > capacity_)
+               return;
+
+            auto i = index_.find(path);
+            if (i != index_.end())
+               erase(i->second);
+            while (size_ + data->size() > capacity_)
+               erase(std::prev(entries_.end()));
+
+            entries_.push_front(Entry{ path, fileSize, mtime, data });
+            index_[path] = entries_.begin();
+            size_ += data->size();
+         }
+
+         // Total bytes of cached contents.
+         size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return size_;
+         }
+
+      private:
+         struct Entry {
+            std::string path;
+            uint64_t fileSize;
+            std::time_t mtime;
+            std::shared_ptr<const std::string> data;
+         };
+
+         mutable std::mutex mutex_;
+         std::list<Entry> entries_;
+         std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+         size_t capacity_;
+         size_t size_;
+
+         void erase(std::list<Entry>::iterator entry) {
+            size_ -= entry->data->size();
+            index_.erase(entry->path);
+            entries_.erase(entry);
+         }
+      };
+
+      inline const char* content_type(boost::string_ref path) {
+         static const std::pair<const char*, const char*> types[] = {
+            { ".html", "text/html; charset=utf-8" },
+            { ".htm", "text/html; charset=utf-8" },
+            { ".css", "text/css; charset=utf-8" },
+            { ".js", "application/javascript; charset=utf-8" },
+            { ".json", "application/json" },
+            { ".map", "application/json" },
+            { ".txt", "text/plain; charset=utf-8" },
+            { ".csv", "text/csv; charset=utf-8" },
+            { ".xml", "application/xml" },
+            { ".svg", "image/svg+xml" },
+            { ".png", "image/png" },
+            { ".jpg", "image/jpeg" },
+            { ".jpeg", "image/jpeg" },
+            { ".gif", "image/gif" },
+            { ".ico", "image/x-icon" },
+            { ".webp", "image/webp" },
+            { ".woff", "font/woff" },
+            { ".woff2", "font/woff2" },
+            { ".wasm", "application/wasm" },
+            { ".pdf", "application/pdf" }
+         };
+
+         for (const auto& type : types) {
+            if (path.ends_with(type.first))
+               return type.second;
+         }
+         return "application/octet-stream";
+      }
+   }
+
+   // A handler serving files under a root directory. Register it on
+   // a wildcard route, e.g.
+   //
+   //    server->set_route("/static/*file", StaticFiles("/srv/www"));
+   //
+   // The last path parameter (or the whole path, without one) names
+   // the file, and a directory serves its index.html. Files up to
+   // maxCachedFile bytes are kept in an LRU cache of cacheSize bytes
+   // shared by copies of the handler; larger files are sent with
+   // send_file(). A ".br" or ".gz" sibling is sent instead of a file
+   // when Accept-Encoding allows. Responses carry ETag and
+   // Last-Modified, and If-None-Match or an identical
+   // If-Modified-Since gets 304. Range requests get 206 or 416,
+   // subject to If-Range.
+   class StaticFiles {
+   public:
+      enum {
+         DefaultCacheSize = 64 << 20,
+         DefaultMaxCachedFile = 1 << 20
+      };
+
+      explicit StaticFiles(
+         const std::string& root,
+         size_t cacheSize = DefaultCacheSize,
+         size_t maxCachedFile = DefaultMaxCachedFile)
+         : root_(root)
+         , maxCachedFile_(maxCachedFile)
+         , cache_(std::make_shared<detail::FileCache>(cacheSize)) {
+      }
+
+      template<typename Transaction>
+      void operator()(const std::shared_ptr<Transaction>& http) const {
+         if (http->request_method() != "GET" && http->request_method() != "HEAD") {
+            http->response_headers()[detail::allow_header] = "GET, HEAD";
+            respond_empty(http, 405);
+            return;
+         }
+
+         File file;
+         if (!find_file(*http, file)) {
+            respond_empty(http, 404);
+            return;
+         }
+
+         char date[detail::DateCache::Size];
+         detail::format_date(file.info.st_mtime, date);
+         const std::string lastModified(date, sizeof(date));
+         std::ostringstream os;
+         os << '"' << std::hex << file.info.st_mtime << '-' << file.info.st_size << '"';
+         const std::string etag = os.str();
+
+         auto& headers = http->response_headers();
+         headers[detail::etag_header] = etag;
+         headers[detail::last_modified_header] = lastModified;
+         headers[detail::vary_header] = "Accept-Encoding";
+         std::string matched;
+         if (not_modified(*http, etag, lastModified, matched)) {
+            headers[detail::etag_header] = matched;
+            respond_empty(http, 304);
+            return;
+         }
+
+         const uint64_t size = file.info.st_size;
+         const char* contentType = detail::content_type(file.path);
+         http->response_status() = 200;
+         headers[detail::accept_ranges_header] = "bytes";
+         if (file.encoding)
+            headers[detail::content_encoding_header] = file.encoding;
+
+         // Ranges apply only if If-Range, when present, still matches.
+         std::vector<detail::ByteRange> ranges;
+         auto ifRange = http->request_headers().find(detail::if_range_header);
+         if ((ifRange == http->request_headers().end() ||
+              ifRange->second == etag || ifRange->second == lastModified) &&
+             http->request_ranges(size, ranges) == detail::range_unsatisfiable) {
+            http->set_range_unsatisfiable(size);
+            finish(http);
+            return;
+         }
+
+         if (ranges.empty()) {
+            headers[detail::content_type_header] = contentType;
+            headers[detail::content_length_header] = std::to_string(size);
+            if (http->request_method() == "HEAD" || size == 0) {
+               finish(http);
+               return;
+            }
+         }
+
+         if (size <= maxCachedFile_) {
+            auto data = cache_->find(file.variant, size, file.info.st_mtime);
+            if (!data) {
+               data = read_file(file.variant, size);
+               if (!data) {
+                  respond_empty(http, 404);
+                  return;
+               }
+               cache_->insert(file.variant, size, file.info.st_mtime, data);
+            }
+
+            auto written = [=](const boost::system::error_code& error, size_t) {
+               if (!error)
+                  finish(http);
+               data.get();
+            };
+            if (ranges.empty())
+               boost::asio::async_write(*http, boost::asio::buffer(*data), written);
+            else
+               http->async_write_ranges(boost::asio::buffer(*data), ranges, contentType, written);
+            return;
+         }
+
+         const int fd = ::open(file.variant.c_str(), O_RDONLY);
+         if (fd < 0) {
+            respond_empty(http, 404);
+            return;
+         }
+         auto sent = [=](const boost::system::error_code& error, size_t) {
+            ::close(fd);
+            if (!error)
+               finish(http);
+         };
+         if (ranges.empty())
+            http->async_send_file(fd, 0, size, sent);
+         else
+            http->async_send_file_ranges(fd, size, ranges, contentType, sent);
+      }
+
+      const detail::FileCache& cache() const {
+         return *cache_;
+      }
+
+   private:
+      struct File {
+         std::string path;
+         std::string variant;
+         const char* encoding;
+         struct stat info;
+      };
+
+      std::string root_;
+      size_t maxCachedFile_;
+      std::shared_ptr<detail::FileCache> cache_;
+
+      static bool is_file(const std::string& path, struct stat& info) {
+         return ::stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+      }
+
+      template<typename Transaction>
+      bool find_file(const Transaction& http, File& file) const {
+         const auto& parameters = http.path_parameters();
+         boost::string_ref name = parameters.empty() ?
+            boost::string_ref(http.request_path()) : (parameters.end() - 1)->second;
+
+         // Refuse parent directory segments and embedded nulls.
+         for (boost::string_ref rest = name; ; ) {
+            const auto slash = rest.find('/');
+            if (rest.substr(0, slash) == "..")
+               return false;
+            if (slash == boost::string_ref::npos)
+               break;
+            rest.remove_prefix(slash + 1);
+         }
+         if (name.find('\0') != boost::string_ref::npos)
+            return false;
+
+         while (!name.empty() && name.front() == '/')
+            name.remove_prefix(1);
+         file.path = root_ + '/' + name.to_string();
+         if (name.empty() || name.back() == '/')
+            file.path += "index.html";
+         else if (::stat(file.path.c_str(), &file.info) == 0 && S_ISDIR(file.info.st_mode))
+            file.path += "/index.html";
+         if (!is_file(file.path, file.info))
+            return false;
+
+         // Prefer a precompressed sibling.
+         file.variant = file.path;
+         file.encoding = nullptr;
+         auto acceptEncoding = http.request_headers().find(detail::accept_encoding_header);
+         if (acceptEncoding != http.request_headers().end()) {
+            static const std::pair<const char*, const char*> encodings[] = {
+               { "br", ".br" },
+               { "gzip", ".gz" }
+            };
+            for (const auto& encoding : encodings) {
+               struct stat info;
+               if (detail::accepts_encoding(acceptEncoding->second, encoding.first) &&
+                   is_file(file.path + encoding.second, info)) {
+                  file.variant = file.path + encoding.second;
+                  file.encoding = encoding.first;
+                  file.info = info;
+                  break;
+               }
+            }
+         }
+         return true;
+      }
+
+      template<typename Transaction>
+      // A client holding a response compressed by the server has
+      // its coded entity tag, which is set as matched so that the 304
+      // refers to that representation.
+      static bool not_modified(
+         const Transaction& http,
+         const std::string& etag,
+         const std::string& lastModified,
+         std::string& matched) {
+         matched = etag;
+         const auto& headers = http.request_headers();
+         auto ifNoneMatch = headers.find(detail::if_none_match_header);
+         if (ifNoneMatch != headers.end()) {
+            boost::string_ref tags = ifNoneMatch->second;
+            if (tags == "*" || tags.find(etag) != boost::string_ref::npos)
+               return true;
+            for (const char* coding : { "gzip", "deflate" }) {
+               matched = detail::coded_etag(etag, coding);
+               if (tags.find(matched) != boost::string_ref::npos)
+                  return true;
+            }
+            return false;
+         }
+
+         auto ifModifiedSince = headers.find(detail::if_modified_since_header);
+         return ifModifiedSince != headers.end() && ifModifiedSince->second == lastModified;
+      }
+
+      static std::shared_ptr<const std::string> read_file(const std::string& path, uint64_t size) {
+         const int fd = ::open(path.c_str(), O_RDONLY);
+         if (fd < 0)
+            return nullptr;
+
+         auto data = std::make_shared<std::string>(size, '\0');
+         boost::system::error_code error;
+         for (size_t n = 0; n < size && !error; )
+            n += detail::read_file(fd, &(*data)[n], size - n, n, error);
+         ::close(fd);
+         return error ? nullptr : data;
+      }
+
+      template<typename Transaction>
+      static void respond_empty(const std::shared_ptr<Transaction>& http, unsigned int status) {
+         http->response_status() = status;
+         if (status != 304)
+            http->response_headers()[detail::content_length_header] = "0";
+         finish(http);
+      }
+
+      template<typename Transaction>
+      static void finish(const std::shared_ptr<Transaction>& http) {
+         http->async_finish([=](const boost::system::error_code&) {
+               http.get();
+            });
+      }
+   };
+#endif
 }
 
 #endif // CHUNKY_HPP
@@ -2,6 +2,8 @@
 #define BOOST_LOG_DYN_LINK
 #define BOOST_TEST_DYN_LINK
 
+#include <array>
+#include <fstream>
 #include <future>
 #include <iostream>
 #include <random>
@@ -11,6 +13,9 @@
 #include <boost/test/unit_test.hpp>
 
 #include <curl/curl.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 #include "chunky.hpp"
 
@@ -27,9 +32,15 @@ class TestServer {
    std::thread thread_;
 
 public:
-   TestServer(const chunky::SimpleHTTPServer::Handler& callback) {
+   // configure is called before the server listens, for settings
+   // that must not change once connections are served.
+   TestServer(
+      const chunky::SimpleHTTPServer::Handler& callback,
+      const std::function<void(chunky::SimpleHTTPServer&)>& configure = nullptr) {
       server_ = chunky::SimpleHTTPServer::create(io_);
       server_->set_handler("", callback);
+      if (configure)
+         configure(*server_);
 
       // Bind to the first resolution of "localhost" and an unused port.
       boost::asio::ip::tcp::resolver resolver(io_);
@@ -48,6 +59,7 @@ public:
    }
    
    unsigned short port() const { return port_; }
+   chunky::SimpleHTTPServer& server() { return *server_; }
    
    void log(const std::string& message) {
       LOG(info) << message;
@@ -496,4 +508,1615 @@ BOOST_AUTO_TEST_CASE(Query) {
       BOOST_CHECK_EQUAL(query.size(), 1);
       BOOST_CHECK_EQUAL(query.at("foo bar?"), "a =&");
    }
+
+   {
+      // Empty keys are skipped without ending the parse.
+      HTTP::Query query = HTTP::parse_query("=x&&a=b&c");
+      BOOST_CHECK_EQUAL(query.size(), 1);
+      BOOST_CHECK_EQUAL(query.at("a"), "b");
+   }
+
+   {
+      std::vector<std::pair<std::string, std::string> > params;
+      HTTP::parse_query("a+b=%41&c=", [&](boost::string_ref key, boost::string_ref value) {
+            params.emplace_back(key.to_string(), value.to_string());
+         });
+      BOOST_REQUIRE_EQUAL(params.size(), 2);
+      BOOST_CHECK_EQUAL(params[0].first, "a+b");
+      BOOST_CHECK_EQUAL(params[0].second, "%41");
+      BOOST_CHECK_EQUAL(params[1].first, "c");
+      BOOST_CHECK_EQUAL(params[1].second, "");
+   }
+
+   // Malformed escapes are copied and decoding continues.
+   BOOST_CHECK_EQUAL(HTTP::decode(std::string("100%+%zz%4a%4")), "100% %zzJ%4");
+   BOOST_CHECK_EQUAL(HTTP::decode(std::string("")), "");
+
+   // Escapes on either side of the vector block boundaries.
+   for (size_t n : { 15, 16, 17, 31, 32, 33, 64 }) {
+      const std::string plain(n, 'x');
+      BOOST_CHECK_EQUAL(HTTP::decode(plain + "%41" + plain + "+"), plain + "A" + plain + " ");
+   }
+}
+
+BOOST_AUTO_TEST_CASE(RequestParser) {
+   const std::string head =
+      "GET /foo?bar=baz HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Accept:  */*  \r\n"
+      "X-Empty:\r\n"
+      "\r\n"
+      "trailing body";
+
+   // The result must not depend on how the head is split across reads.
+   for (size_t split = 0; split <= head.size(); ++split) {
+      detail::RequestParser parser;
+      if (split < head.size() - 13)
+         BOOST_CHECK_EQUAL(parser.parse(head.data(), split), detail::RequestParser::incomplete);
+      BOOST_REQUIRE_EQUAL(parser.parse(head.data(), head.size()), detail::RequestParser::complete);
+      BOOST_CHECK_EQUAL(parser.size(), head.size() - 13);
+      BOOST_CHECK_EQUAL(parser.method_type(), detail::get_method);
+      BOOST_CHECK_EQUAL(head.substr(parser.resource().offset, parser.resource().size), "/foo?bar=baz");
+      BOOST_CHECK_EQUAL(head.substr(parser.version().offset, parser.version().size), "HTTP/1.1");
+
+      const auto& fields = parser.fields();
+      BOOST_REQUIRE_EQUAL(fields.size(), 3);
+      BOOST_CHECK_EQUAL(head.substr(fields[1].name.offset, fields[1].name.size), "Accept");
+      BOOST_CHECK_EQUAL(head.substr(fields[1].value.offset, fields[1].value.size), "*/*");
+      BOOST_CHECK_EQUAL(fields[2].value.size, 0);
+   }
+
+   // Lines and field names spanning scan blocks.
+   {
+      const std::string name(100, 'X');
+      const std::string value = "a:b" + std::string(150, 'v') + ":c";
+      const std::string head =
+         "GET / HTTP/1.1\r\n" + name + ":" + value + "\r\nHost:h\r\n\r\n";
+      for (size_t split = 0; split <= head.size(); ++split) {
+         detail::RequestParser parser;
+         parser.parse(head.data(), split);
+         BOOST_REQUIRE_EQUAL(parser.parse(head.data(), head.size()), detail::RequestParser::complete);
+         const auto& fields = parser.fields();
+         BOOST_REQUIRE_EQUAL(fields.size(), 2);
+         BOOST_CHECK_EQUAL(head.substr(fields[0].name.offset, fields[0].name.size), name);
+         BOOST_CHECK_EQUAL(head.substr(fields[0].value.offset, fields[0].value.size), value);
+         BOOST_CHECK_EQUAL(head.substr(fields[1].name.offset, fields[1].name.size), "Host");
+      }
+   }
+
+   const std::vector<std::pair<std::string, errors> > invalid = {
+      { "GET /\r\n\r\n", invalid_request_line },
+      { "GET  / HTTP/1.1\r\n\r\n", invalid_request_line },
+      { "G(T / HTTP/1.1\r\n\r\n", invalid_request_line },
+      { "GET / HTTP/1.1\n\r\n", invalid_request_line },
+      { "GET / HTTP/1.0\r\n\r\n", unsupported_http_version },
+      { "GET / HTTP/1.1\r\nHost localhost\r\n\r\n", invalid_request_header },
+      { "GET / HTTP/1.1\r\nHost : localhost\r\n\r\n", invalid_request_header },
+      { "GET / HTTP/1.1\r\n folded\r\n\r\n", invalid_request_header }
+   };
+   for (const auto& value : invalid) {
+      detail::RequestParser parser;
+      BOOST_CHECK_EQUAL(parser.parse(value.first.data(), value.first.size()), detail::RequestParser::failed);
+      BOOST_CHECK_EQUAL(parser.error(), value.second);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(ScanDelimiters) {
+   // Every implementation must agree with the scalar scan.
+   std::vector<detail::ScanDelimitersFunc> scans = { &detail::scan_delimiters };
+#ifdef CHUNKY_X86_SIMD
+   scans.push_back(&detail::scan_delimiters_sse2);
+   if (__builtin_cpu_supports("avx2"))
+      scans.push_back(&detail::scan_delimiters_avx2);
+#endif
+
+   std::string data;
+   for (size_t i = 0; i < 1000; ++i)
+      data += "ab\n:cd\r\xff"[(i * 7919) % 8];
+
+   for (size_t i = 0; i + detail::ScanBlockSize <= data.size(); ++i) {
+      uint64_t lf, colon;
+      detail::scan_delimiters_scalar(data.data() + i, lf, colon);
+      BOOST_CHECK_EQUAL(lf & 1, data[i] == '\n');
+      BOOST_CHECK_EQUAL(colon >> 63, data[i + 63] == ':');
+      for (auto scan : scans) {
+         uint64_t simdLF, simdColon;
+         scan(data.data() + i, simdLF, simdColon);
+         BOOST_CHECK_EQUAL(simdLF, lf);
+         BOOST_CHECK_EQUAL(simdColon, colon);
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(HeaderMap) {
+   HTTP::Headers headers;
+   headers["Content-Type"] = "text/plain";
+   headers["content-length"] = "42";
+   headers["X-Custom"] = "a";
+   headers["CONTENT-TYPE"] = "text/html";
+   BOOST_CHECK_EQUAL(headers.size(), 3);
+   BOOST_CHECK_EQUAL(headers.begin()->first, "Content-Type");
+   BOOST_CHECK_EQUAL(headers.find("content-type")->second, "text/html");
+   BOOST_CHECK_EQUAL(headers.find(detail::content_length_header)->second, "42");
+   BOOST_CHECK_EQUAL(headers.count("x-CUSTOM"), 1);
+   BOOST_CHECK(headers.find("X-Missing") == headers.end());
+   BOOST_CHECK(headers.find(detail::date_header) == headers.end());
+
+   // Known header positions must follow erasure.
+   BOOST_CHECK_EQUAL(headers.erase("content-type"), 1);
+   BOOST_CHECK_EQUAL(headers.erase("content-type"), 0);
+   BOOST_CHECK_EQUAL(headers.find(detail::content_length_header)->second, "42");
+   BOOST_CHECK_EQUAL(headers.erase("Content-Length"), 1);
+   BOOST_CHECK(headers.find(detail::content_length_header) == headers.end());
+   BOOST_CHECK_EQUAL(headers.size(), 1);
+
+   // Standard names are inserted in canonical form.
+   headers[detail::etag_header] = "\"1\"";
+   BOOST_CHECK_EQUAL(headers.find("etag")->first, "ETag");
+   BOOST_CHECK_EQUAL(headers.erase(detail::etag_header), 1);
+
+   // std::map operations.
+   BOOST_CHECK(headers.insert(HTTP::Headers::value_type("Date", "today")).second);
+   BOOST_CHECK(!headers.insert(HTTP::Headers::value_type("date", "tomorrow")).second);
+   BOOST_CHECK_EQUAL(headers.at("DATE"), "today");
+   BOOST_CHECK_THROW(headers.at("X-Missing"), std::out_of_range);
+   auto next = headers.erase(headers.find("x-custom"));
+   BOOST_REQUIRE(next != headers.end());
+   BOOST_CHECK_EQUAL(next->first, "Date");
+   BOOST_CHECK_EQUAL(headers.find(detail::date_header)->second, "today");
+   next = headers.erase(next);
+   BOOST_CHECK(next == headers.end());
+   BOOST_CHECK(headers.empty());
+
+   // Request headers reference a copy of the head in the arena, with
+   // repeated fields coalesced.
+   std::string head =
+      "GET / HTTP/1.1\r\n"
+      "Accept: text/html\r\n"
+      "Connection: close\r\n"
+      "accept: */*\r\n"
+      "\r\n";
+   detail::RequestParser parser;
+   BOOST_REQUIRE_EQUAL(parser.parse(head.data(), head.size()), detail::RequestParser::complete);
+
+   detail::Arena arena(16);
+   HTTP::RequestHeaders requestHeaders;
+   detail::add_fields(requestHeaders, arena, head.data(), parser);
+   head.assign(head.size(), 'x');
+   BOOST_CHECK_EQUAL(requestHeaders.size(), 2);
+   BOOST_CHECK_EQUAL(requestHeaders.find("ACCEPT")->second, "text/html, */*");
+   BOOST_CHECK_EQUAL(requestHeaders.find(detail::connection_header)->second, "close");
+
+   // Values convert to std::string.
+   const std::string accept = requestHeaders.find("accept")->second;
+   BOOST_CHECK_EQUAL(accept, "text/html, */*");
+   BOOST_CHECK_EQUAL(requestHeaders.at("Connection").str(), "close");
+}
+
+BOOST_AUTO_TEST_CASE(HeaderNames) {
+   for (int i = detail::other_header + 1; i < detail::header_name_count; ++i) {
+      const auto type = static_cast<detail::header_names>(i);
+      std::string name = detail::header_name(type);
+      BOOST_CHECK_EQUAL(detail::header_type(name.data(), name.size()), type);
+      std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+      BOOST_CHECK_EQUAL(detail::header_type(name.data(), name.size()), type);
+
+      // Near misses must not match.
+      name.pop_back();
+      BOOST_CHECK_NE(detail::header_type(name.data(), name.size()), type);
+   }
+
+   for (const std::string name : { "", "X", "Content-Lengths", "Content_Length", "X-Custom" })
+      BOOST_CHECK_EQUAL(detail::header_type(name.data(), name.size()), detail::other_header);
+
+   const std::string head =
+      "GET / HTTP/1.1\r\n"
+      "content-LENGTH: 0\r\n"
+      "X-Custom: 1\r\n"
+      "\r\n";
+   detail::RequestParser parser;
+   BOOST_REQUIRE_EQUAL(parser.parse(head.data(), head.size()), detail::RequestParser::complete);
+   BOOST_REQUIRE_EQUAL(parser.fields().size(), 2);
+   BOOST_CHECK_EQUAL(parser.fields()[0].type, detail::content_length_header);
+   BOOST_CHECK_EQUAL(parser.fields()[1].type, detail::other_header);
+}
+
+BOOST_AUTO_TEST_CASE(Date) {
+   char s[detail::DateCache::Size];
+   detail::format_date(784111777, s);
+   BOOST_CHECK_EQUAL(std::string(s, sizeof(s)), "Sun, 06 Nov 1994 08:49:37 GMT");
+   detail::format_date(1451606399, s);
+   BOOST_CHECK_EQUAL(std::string(s, sizeof(s)), "Thu, 31 Dec 2015 23:59:59 GMT");
+
+   // The cached value must be within a second of the clock.
+   const auto t0 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+   detail::DateCache::instance().read(s);
+   const auto t1 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+   char expected0[detail::DateCache::Size];
+   char expected1[detail::DateCache::Size];
+   detail::format_date(t0, expected0);
+   detail::format_date(t1, expected1);
+   BOOST_CHECK(!std::memcmp(s, expected0, sizeof(s)) || !std::memcmp(s, expected1, sizeof(s)));
+}
+
+BOOST_AUTO_TEST_CASE(ResponseHead) {
+   std::vector<char> buffer;
+   detail::append_status_line(buffer, 200);
+   detail::append_status_line(buffer, 505);
+   detail::append_status_line(buffer, 299);
+   detail::append_hex(buffer, 0);
+   detail::append(buffer, " ");
+   detail::append_hex(buffer, 0x1a2b);
+   detail::append(buffer, " ");
+   detail::append_decimal(buffer, 4294967295u);
+   detail::append(buffer, "\r\n");
+
+   HTTP::Headers headers;
+   headers["Content-Type"] = "text/plain";
+   headers[detail::content_length_header] = "5";
+   detail::append_fields(buffer, headers);
+
+   BOOST_CHECK_EQUAL(
+      std::string(buffer.begin(), buffer.end()),
+      "HTTP/1.1 200 OK\r\n"
+      "HTTP/1.1 505 HTTP Version Not Supported\r\n"
+      "HTTP/1.1 299 \r\n"
+      "0 1a2b 4294967295\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 5\r\n"
+      "\r\n");
+}
+
+BOOST_AUTO_TEST_CASE(GatherList) {
+   const char data[] = "0123456789abcdef";
+   detail::GatherList list;
+   for (int pass = 0; pass < 2; ++pass) {
+      // Fill past the inline capacity, then refill after clear().
+      list.clear();
+      const size_t n = detail::GatherList::InlineCount + 3;
+      for (size_t i = 0; i < n; ++i)
+         list.push_back(boost::asio::const_buffer(data + i, 1));
+
+      BOOST_CHECK_EQUAL(list.size(), n);
+      const auto buffers = list.buffers();
+      BOOST_CHECK_EQUAL(boost::asio::buffer_size(buffers), n);
+      BOOST_CHECK_EQUAL(
+         std::string(boost::asio::buffers_begin(buffers), boost::asio::buffers_end(buffers)),
+         std::string(data, n));
+   }
+
+   list.clear();
+   list.push_back(boost::asio::const_buffer(data, 4));
+   BOOST_CHECK_EQUAL(boost::asio::buffer_size(list.buffers()), 4);
+}
+
+BOOST_AUTO_TEST_CASE(HandlerMemory) {
+   detail::HandlerMemory memory;
+
+   // A freed block is reused, and grows for a larger handler.
+   void* a = memory.allocate(64);
+   memory.deallocate(a);
+   BOOST_CHECK_EQUAL(memory.allocate(32), a);
+   memory.deallocate(a);
+   void* b = memory.allocate(4096);
+   std::memset(b, 0, 4096);
+   memory.deallocate(b);
+   BOOST_CHECK_EQUAL(memory.allocate(4096), b);
+   memory.deallocate(b);
+
+   // Allocations beyond the recycled blocks fall back to the heap.
+   std::vector<void*> pointers;
+   for (int i = 0; i < detail::HandlerMemory::SlotCount + 2; ++i) {
+      pointers.push_back(memory.allocate(128));
+      std::memset(pointers.back(), i, 128);
+   }
+   std::sort(pointers.begin(), pointers.end());
+   BOOST_CHECK(std::adjacent_find(pointers.begin(), pointers.end()) == pointers.end());
+   for (auto pointer : pointers)
+      memory.deallocate(pointer);
+}
+
+BOOST_AUTO_TEST_CASE(PutBackBuffer) {
+   detail::PutBackBuffer buffer;
+   BOOST_CHECK(buffer.empty());
+
+   char out[16];
+   buffer.put_back(boost::asio::buffer(std::string("world")));
+   buffer.put_back(boost::asio::buffer(std::string("hello ")));
+   BOOST_CHECK_EQUAL(buffer.size(), 11);
+
+   BOOST_CHECK_EQUAL(buffer.read(boost::asio::buffer(out, 3)), 3);
+   BOOST_CHECK_EQUAL(std::string(out, 3), "hel");
+
+   // Put back into the space freed by the read.
+   buffer.put_back(boost::asio::buffer(std::string("HEL")));
+   BOOST_CHECK_EQUAL(buffer.read(boost::asio::buffer(out)), 11);
+   BOOST_CHECK_EQUAL(std::string(out, 11), "HELlo world");
+   BOOST_CHECK(buffer.empty());
+   BOOST_CHECK_EQUAL(buffer.read(boost::asio::buffer(out)), 0);
+
+   buffer.put_back(boost::asio::buffer(std::string("pipelined")));
+   BOOST_CHECK_EQUAL(buffer.read(boost::asio::buffer(out)), 9);
+   BOOST_CHECK_EQUAL(std::string(out, 9), "pipelined");
+}
+
+// Send a raw request on a new connection and return everything read
+// until the server closes it.
+static std::string exchange(unsigned short port, const std::string& request) {
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::socket socket(io);
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::ip::tcp::resolver::query query("localhost", std::to_string(port));
+   boost::asio::connect(socket, resolver.resolve(query));
+   boost::asio::write(socket, boost::asio::buffer(request));
+
+   boost::asio::streambuf response;
+   error_code error;
+   boost::asio::read(socket, response, error);
+   return std::string(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+}
+
+BOOST_AUTO_TEST_CASE(Pipelined) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         const std::string body = http->request_resource();
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(body.size());
+         boost::asio::write(*http, boost::asio::buffer(body));
+         http->finish();
+      });
+
+   // Send all requests at once so later requests are read along
+   // with earlier ones.
+   const std::string s = exchange(
+      server.port(),
+      "GET /one HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "PUT /two HTTP/1.1\r\nHost: localhost\r\nContent-Length: 4\r\n\r\nbody"
+      "GET /three HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   const auto one = s.find("\r\n\r\n/one");
+   const auto two = s.find("\r\n\r\n/two");
+   const auto three = s.find("\r\n\r\n/three");
+   BOOST_CHECK(one != std::string::npos);
+   BOOST_CHECK(two != std::string::npos && two > one);
+   BOOST_CHECK(three != std::string::npos && three > two);
+}
+
+BOOST_AUTO_TEST_CASE(HeadLimit) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   server.server().set_head_limit(1024);
+   BOOST_CHECK_EQUAL(server.server().head_limit(), 1024);
+
+   const std::string small = exchange(
+      server.port(),
+      "GET /small HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   BOOST_CHECK_EQUAL(small.substr(0, 15), "HTTP/1.1 200 OK");
+
+   const std::string large = exchange(
+      server.port(),
+      "GET /large HTTP/1.1\r\nHost: localhost\r\nX-Large: " + std::string(2048, 'x') +
+      "\r\nConnection: close\r\n\r\n");
+   BOOST_CHECK(large.empty());
+}
+
+BOOST_AUTO_TEST_CASE(ReceiveBuffer) {
+   boost::asio::io_service io;
+   auto tcp = chunky::TCP::create(boost::asio::ip::tcp::socket(io));
+   auto buffer = tcp->receive_buffer(1 << 20);
+   buffer->prepare(1 << 18);
+   BOOST_CHECK_GT(buffer->allocated(), detail::ReceiveBuffer::RetainSize);
+
+   // A grown buffer is kept while a transaction holds it...
+   BOOST_CHECK(tcp->receive_buffer(1 << 20) == buffer);
+
+   // ...and replaced once none does.
+   buffer.reset();
+   buffer = tcp->receive_buffer(1 << 20);
+   BOOST_CHECK_LE(buffer->allocated(), detail::ReceiveBuffer::RetainSize);
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentDispatch) {
+   TestServer server(
+      [](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 404;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      },
+      [](SimpleHTTPServer& server) { server.set_concurrent_dispatch(true); });
+   server.server().set_handler("/path", [](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+
+   std::vector<std::future<std::string> > responses;
+   for (int i = 0; i < 8; ++i) {
+      responses.push_back(std::async(std::launch::async, [&]() {
+               return exchange(
+                  server.port(),
+                  "GET /path HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+            }));
+   }
+   for (auto& response : responses)
+      BOOST_CHECK_EQUAL(response.get().substr(0, 15), "HTTP/1.1 200 OK");
+
+   // Removing the handler falls back to the default.
+   server.server().set_handler("/path", SimpleHTTPServer::Handler());
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(), "GET /path HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 12),
+      "HTTP/1.1 404");
+}
+
+BOOST_AUTO_TEST_CASE(Sharded) {
+   ShardedHTTPServer<SimpleHTTPServer> server(2);
+   BOOST_CHECK_EQUAL(server.size(), 2);
+   server.set_handler("/sharded", [](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::ip::tcp::resolver::query query("localhost", "");
+   const auto port = server.listen(*resolver.resolve(query));
+   server.run();
+
+   // Each shard sees the handler, whichever accepts the connection.
+   for (int i = 0; i < 8; ++i) {
+      BOOST_CHECK_EQUAL(
+         exchange(port, "GET /sharded HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 15),
+         "HTTP/1.1 200 OK");
+   }
+   server.stop();
+
+   // Stopping releases the shards' hold on the Date cache, so it
+   // refreshes on read again and later servers send the current date.
+   std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+   const auto t0 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+   char s[detail::DateCache::Size];
+   detail::DateCache::instance().read(s);
+   const auto t1 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+   char expected0[detail::DateCache::Size];
+   char expected1[detail::DateCache::Size];
+   detail::format_date(t0, expected0);
+   detail::format_date(t1, expected1);
+   BOOST_CHECK(!std::memcmp(s, expected0, sizeof(s)) || !std::memcmp(s, expected1, sizeof(s)));
+
+   TestServer second([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   auto date = [&]() {
+      const std::string response = exchange(
+         second.port(), "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+      const auto i = response.find("Date: ");
+      return i == std::string::npos ? std::string() : response.substr(i + 6, detail::DateCache::Size);
+   };
+   const std::string date0 = date();
+   std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+   BOOST_CHECK(!date0.empty());
+   BOOST_CHECK(date() != date0);
+}
+
+BOOST_AUTO_TEST_CASE(AcceptConcurrency) {
+   boost::asio::io_service io;
+   auto server = SimpleHTTPServer::create(io);
+   server->set_handler("", [](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   server->set_accept_backlog(16);
+   server->set_accept_concurrency(4);
+   BOOST_CHECK_EQUAL(server->accept_backlog(), 16);
+   BOOST_CHECK_EQUAL(server->accept_concurrency(), 4);
+
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::ip::tcp::resolver::query query("localhost", "");
+   const auto port = server->listen(*resolver.resolve(query));
+   std::thread thread([&]() { io.run(); });
+
+   // Open a burst of connections before sending any requests.
+   boost::asio::io_service clientIO;
+   std::vector<std::unique_ptr<boost::asio::ip::tcp::socket> > sockets;
+   boost::asio::ip::tcp::resolver clientResolver(clientIO);
+   boost::asio::ip::tcp::resolver::query clientQuery("localhost", std::to_string(port));
+   for (int i = 0; i < 16; ++i) {
+      sockets.emplace_back(new boost::asio::ip::tcp::socket(clientIO));
+      boost::asio::connect(*sockets.back(), clientResolver.resolve(clientQuery));
+   }
+
+   const std::string request("GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   for (auto& socket : sockets)
+      boost::asio::write(*socket, boost::asio::buffer(request));
+   for (auto& socket : sockets) {
+      boost::asio::streambuf response;
+      error_code error;
+      boost::asio::read(*socket, response, error);
+      const std::string s(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+      BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+   }
+
+   server->destroy();
+   thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(Router) {
+   detail::Router<const char*> router;
+   router.insert("/items", "items");
+   router.insert("/items/:id", "item");
+   router.insert("/items/:id/tags/:tag", "tag");
+   router.insert("/items/new", "new");
+   router.insert("/item", "singular");
+   router.insert("/static/*file", "static");
+   router.insert("/", "root");
+
+   // Parameters reference the path, so keep it alive for checks.
+   std::string path;
+   detail::PathParameters parameters;
+   auto route = [&](const std::string& s) {
+      path = s;
+      parameters.resize(0);
+      auto handler = router.find(path, parameters);
+      return handler ? *handler : std::string("none");
+   };
+
+   BOOST_CHECK_EQUAL(route("/"), "root");
+   BOOST_CHECK_EQUAL(route("/items"), "items");
+   BOOST_CHECK_EQUAL(route("/item"), "singular");
+   BOOST_CHECK_EQUAL(route("/items/new"), "new");
+   BOOST_CHECK(parameters.empty());
+
+   BOOST_CHECK_EQUAL(route("/items/42"), "item");
+   BOOST_REQUIRE_EQUAL(parameters.size(), 1);
+   BOOST_CHECK_EQUAL(parameters.find("id")->second, "42");
+
+   // Static text is preferred, falling back to the parameter.
+   BOOST_CHECK_EQUAL(route("/items/newer"), "item");
+   BOOST_CHECK_EQUAL(parameters.find("id")->second, "newer");
+
+   BOOST_CHECK_EQUAL(route("/items/42/tags/blue"), "tag");
+   BOOST_REQUIRE_EQUAL(parameters.size(), 2);
+   BOOST_CHECK_EQUAL(parameters.find("id")->second, "42");
+   BOOST_CHECK_EQUAL(parameters.find("tag")->second, "blue");
+
+   BOOST_CHECK_EQUAL(route("/static/css/site.css"), "static");
+   BOOST_CHECK_EQUAL(parameters.find("file")->second, "css/site.css");
+
+   BOOST_CHECK_EQUAL(route("/items/42/tags"), "none");
+   BOOST_CHECK_EQUAL(route("/items/"), "none");
+   BOOST_CHECK_EQUAL(route("/static"), "none");
+   BOOST_CHECK(parameters.empty());
+
+   BOOST_CHECK_THROW(router.insert("/items/:other", "x"), std::invalid_argument);
+   BOOST_CHECK_THROW(router.insert("/files/*a/b", "x"), std::invalid_argument);
+   BOOST_CHECK_EQUAL(route("/items/42/tags/blue"), "tag");
+
+   // Exact paths may contain ':' and '*'.
+   router.insert_exact("/a:b", "colon");
+   router.insert_exact("/files/*", "star");
+   BOOST_CHECK_EQUAL(route("/a:b"), "colon");
+   BOOST_CHECK_EQUAL(route("/files/*"), "star");
+   BOOST_CHECK_EQUAL(route("/files/x"), "none");
+
+   // Copies share nodes, but inserting into one leaves the other
+   // unchanged. An empty handler removes a route, after which its
+   // parameter names are free.
+   const auto copy = router;
+   router.insert("/items/:id/tags/:tag", nullptr);
+   router.insert("/items/:id", nullptr);
+   BOOST_CHECK_EQUAL(route("/items/42"), "none");
+   BOOST_CHECK_EQUAL(route("/items/new"), "new");
+   BOOST_CHECK_NO_THROW(router.insert("/items/:other", "other"));
+   BOOST_CHECK_EQUAL(route("/items/42"), "other");
+   BOOST_CHECK_EQUAL(parameters.find("other")->second, "42");
+   router = copy;
+   BOOST_CHECK_EQUAL(route("/items/42/tags/blue"), "tag");
+}
+
+BOOST_AUTO_TEST_CASE(RouteParameters) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 404;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   server.server().set_route("/users/:user/posts/:post", [](const std::shared_ptr<HTTP>& http) {
+         const std::string body = http->path_parameter("user") + ":" + http->path_parameter("post");
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(body.size());
+         boost::asio::write(*http, boost::asio::buffer(body));
+         http->finish();
+      });
+
+   const std::string s = exchange(
+      server.port(),
+      "GET /users/ann/posts/7?x=1 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+   BOOST_CHECK_EQUAL(s.substr(s.find("\r\n\r\n") + 4), "ann:7");
+
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(),
+               "GET /users/ann HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 22),
+      "HTTP/1.1 404 Not Found");
+
+   // A rejected pattern leaves the table as it was and usable.
+   const auto ok = [](const std::shared_ptr<HTTP>& http) {
+      http->response_status() = 200;
+      http->response_headers()["Content-Length"] = "0";
+      http->finish();
+   };
+   BOOST_CHECK_THROW(server.server().set_route("/users/:name", ok), std::invalid_argument);
+   BOOST_CHECK_NO_THROW(server.server().set_handler("/ping", ok));
+   BOOST_CHECK_NO_THROW(server.server().set_handler("/users/:name", ok));
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(),
+               "GET /ping HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 15),
+      "HTTP/1.1 200 OK");
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(),
+               "GET /users/ann/posts/7 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 15),
+      "HTTP/1.1 200 OK");
+
+   // set_handler() paths are exact.
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(),
+               "GET /users/:name HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 15),
+      "HTTP/1.1 200 OK");
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(),
+               "GET /users/ann HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 22),
+      "HTTP/1.1 404 Not Found");
+}
+
+BOOST_AUTO_TEST_CASE(TimerWheel) {
+   struct Timer : detail::TimerWheel::Timer {
+      int nExpired = 0;
+      void expire() { ++nExpired; }
+   };
+
+   // A small wheel so that deadlines wrap around it.
+   detail::TimerWheel wheel(std::chrono::seconds(1), 4);
+   auto a = std::make_shared<Timer>();
+   auto b = std::make_shared<Timer>();
+   auto c = std::make_shared<Timer>();
+   wheel.schedule(a, std::chrono::seconds(2));
+   wheel.schedule(b, std::chrono::seconds(10));
+   wheel.schedule(c, std::chrono::seconds(2));
+   wheel.cancel(*c);
+
+   for (int i = 0; i < 2; ++i)
+      wheel.tick();
+   BOOST_CHECK_EQUAL(a->nExpired, 0);
+   wheel.tick();
+   BOOST_CHECK_EQUAL(a->nExpired, 1);
+   BOOST_CHECK_EQUAL(c->nExpired, 0);
+
+   // Rescheduling replaces the deadline.
+   wheel.schedule(b, std::chrono::seconds(1));
+   wheel.schedule(c, std::chrono::seconds(1));
+   c.reset();
+   for (int i = 0; i < 2; ++i)
+      wheel.tick();
+   BOOST_CHECK_EQUAL(b->nExpired, 1);
+
+   for (int i = 0; i < 12; ++i)
+      wheel.tick();
+   BOOST_CHECK_EQUAL(a->nExpired, 1);
+   BOOST_CHECK_EQUAL(b->nExpired, 1);
+}
+
+BOOST_AUTO_TEST_CASE(Timeouts) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   SimpleHTTPServer::Timeouts timeouts;
+   timeouts.idle = std::chrono::seconds(1);
+   timeouts.head = std::chrono::seconds(1);
+   server.server().set_timeouts(timeouts);
+
+   // The server closes an idle connection and one that never
+   // completes its request head.
+   for (const std::string request : { "", "GET / HTTP/1.1\r\nHost: localhost\r\n" }) {
+      const auto t0 = std::chrono::steady_clock::now();
+      BOOST_CHECK(exchange(server.port(), request).empty());
+      BOOST_CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5));
+   }
+
+   // A timely request still succeeds.
+   BOOST_CHECK_EQUAL(
+      exchange(server.port(),
+               "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").substr(0, 15),
+      "HTTP/1.1 200 OK");
+
+   // Synchronous body reads are timed too, even while the handler
+   // holds the server's only io thread. A slow body fails the read
+   // and ends the connection; a body trickled within the timeout is
+   // read in full.
+   timeouts.body = std::chrono::seconds(1);
+   server.server().set_timeouts(timeouts);
+   std::promise<error_code> readError;
+   server.server().set_handler("/echo", [&](const std::shared_ptr<HTTP>& http) {
+         std::string body(4, 0);
+         error_code error;
+         boost::asio::read(*http, boost::asio::buffer(&body[0], body.size()), error);
+         if (error) {
+            readError.set_value(error);
+            http->response_status() = 408;
+            http->finish(error);
+            return;
+         }
+
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(body.size());
+         boost::asio::write(*http, boost::asio::buffer(body));
+         http->finish();
+      });
+
+   auto put = [&](const std::string& first, std::chrono::milliseconds delay, const std::string& second) {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(
+         socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      error_code error;
+      boost::asio::write(
+         socket,
+         boost::asio::buffer(
+            "PUT /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 4\r\nConnection: close\r\n\r\n" +
+            first),
+         error);
+      std::this_thread::sleep_for(delay);
+      boost::asio::write(socket, boost::asio::buffer(second), error);
+
+      boost::asio::streambuf response;
+      boost::asio::read(socket, response, error);
+      return std::string(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+   };
+
+   std::string s = put("bo", std::chrono::milliseconds(500), "dy");
+   BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+   BOOST_CHECK_EQUAL(s.substr(s.find("\r\n\r\n") + 4), "body");
+
+   const auto t0 = std::chrono::steady_clock::now();
+   s = put("", std::chrono::milliseconds(2500), "body");
+   BOOST_CHECK_EQUAL(s.find("200 OK"), std::string::npos);
+   auto future = readError.get_future();
+   BOOST_REQUIRE(future.wait_until(t0 + std::chrono::seconds(2)) == std::future_status::ready);
+   BOOST_CHECK_EQUAL(future.get(), boost::asio::error::timed_out);
+}
+
+BOOST_AUTO_TEST_CASE(PipelineDepth) {
+   std::mutex mutex;
+   std::vector<std::string> finished;
+   auto respond = [&](const std::shared_ptr<HTTP>& http) {
+      const std::string body = http->request_path();
+      http->response_status() = 200;
+      http->response_headers()["Content-Length"] = std::to_string(body.size());
+      boost::asio::write(*http, boost::asio::buffer(body));
+      http->finish();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      finished.push_back(body);
+   };
+
+   TestServer server(respond, [](SimpleHTTPServer& server) { server.set_pipeline_depth(4); });
+   BOOST_CHECK_EQUAL(server.server().pipeline_depth(), 4);
+
+   // The first response is delayed, but later requests are handled
+   // without waiting for it.
+   server.server().set_handler("/slow", [&](const std::shared_ptr<HTTP>& http) {
+         auto timer = std::make_shared<boost::asio::steady_timer>(http->get_io_service());
+         timer->expires_from_now(std::chrono::milliseconds(200));
+         timer->async_wait([=](const error_code&) {
+               respond(http);
+               timer.get();
+            });
+      });
+
+   const std::string s = exchange(
+      server.port(),
+      "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /a HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /b HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+
+   const auto slow = s.find("\r\n\r\n/slow");
+   const auto a = s.find("\r\n\r\n/a");
+   const auto b = s.find("\r\n\r\n/b");
+   BOOST_CHECK(slow != std::string::npos);
+   BOOST_CHECK(a != std::string::npos);
+   BOOST_CHECK(b != std::string::npos);
+   BOOST_CHECK(slow < a && a < b);
+
+   BOOST_REQUIRE_EQUAL(finished.size(), 3);
+   BOOST_CHECK_EQUAL(finished.back(), "/slow");
+}
+
+BOOST_AUTO_TEST_CASE(PipelineBackpressure) {
+   const size_t chunkSize = 512 * 1024;
+   const size_t nChunks = 8;
+   std::atomic<size_t> nWritten(0);
+   std::atomic<size_t> nWrittenAtHead(nChunks + 1);
+
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         // Write the body in chunks, each after the last completes.
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(chunkSize * nChunks);
+         auto chunk = std::make_shared<std::string>(chunkSize, 'x');
+         auto write = std::make_shared<std::function<void()> >();
+         std::weak_ptr<std::function<void()> > weak = write;
+         *write = [=, &nWritten]() {
+            if (nWritten == nChunks) {
+               http->async_finish([](const error_code&) {});
+               return;
+            }
+
+            auto write = weak.lock();
+            http->async_write_some(
+               boost::asio::buffer(*chunk),
+               [=, &nWritten](const error_code& error, size_t) {
+                  if (!error) {
+                     ++nWritten;
+                     (*write)();
+                  }
+               });
+         };
+         (*write)();
+      },
+      [](SimpleHTTPServer& server) { server.set_pipeline_depth(2); });
+
+   // Hold the head of line long enough for the second response to
+   // reach the queue limit.
+   server.server().set_handler("/slow", [&](const std::shared_ptr<HTTP>& http) {
+         auto timer = std::make_shared<boost::asio::steady_timer>(http->get_io_service());
+         timer->expires_from_now(std::chrono::milliseconds(300));
+         timer->async_wait([=, &nWritten, &nWrittenAtHead](const error_code&) {
+               nWrittenAtHead = nWritten.load();
+               http->response_status() = 200;
+               http->response_headers()["Content-Length"] = "0";
+               http->finish();
+               timer.get();
+            });
+      });
+
+   const std::string s = exchange(
+      server.port(),
+      "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /big HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+
+   // Writes behind the head of line stop completing at the limit.
+   BOOST_CHECK(nWrittenAtHead > 0);
+   BOOST_CHECK(nWrittenAtHead <= detail::ResponseQueue<TCP>::MaxQueuedBytes / chunkSize);
+   BOOST_CHECK_EQUAL(nWritten, nChunks);
+
+   auto body = s.find("\r\n\r\n", s.find("\r\n\r\n") + 4);
+   BOOST_REQUIRE(body != std::string::npos);
+   BOOST_CHECK_EQUAL(s.size() - body - 4, chunkSize * nChunks);
+
+   // Synchronous writes past the limit are copied rather than
+   // blocking the server's only thread.
+   server.server().set_handler("/sync", [=](const std::shared_ptr<HTTP>& http) {
+         const std::string chunk(chunkSize, 'y');
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(chunkSize * nChunks);
+         for (size_t i = 0; i < nChunks; ++i)
+            boost::asio::write(*http, boost::asio::buffer(chunk));
+         http->finish();
+      });
+   const std::string t = exchange(
+      server.port(),
+      "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /sync HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   body = t.find("\r\n\r\n", t.find("\r\n\r\n") + 4);
+   BOOST_REQUIRE(body != std::string::npos);
+   BOOST_CHECK_EQUAL(t.size() - body - 4, chunkSize * nChunks);
+}
+
+BOOST_AUTO_TEST_CASE(SendFile) {
+   // A file larger than a socket buffer and a pooled block.
+   std::string content(1 << 20, 0);
+   std::mt19937 generator;
+   for (auto& c : content)
+      c = 'a' + generator() % 26;
+   char path[] = "/tmp/chunky_sendfileXXXXXX";
+   const int fd = mkstemp(path);
+   BOOST_REQUIRE(fd >= 0);
+   unlink(path);
+   BOOST_REQUIRE_EQUAL(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+
+   const size_t offset = 1000;
+   const size_t length = content.size() - 2 * offset;
+   const std::string region = content.substr(offset, length);
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         if (http->request_path() != "/chunked")
+            http->response_headers()["Content-Length"] = std::to_string(length);
+
+         if (http->request_path() == "/sync") {
+            BOOST_CHECK_EQUAL(http->send_file(fd, offset, length), length);
+            http->finish();
+            return;
+         }
+
+         http->async_send_file(fd, offset, length, [=](const error_code& error, size_t n) {
+               BOOST_CHECK(!error);
+               BOOST_CHECK_EQUAL(n, length);
+               http->async_finish([=](const error_code&) { http.get(); });
+            });
+      });
+
+   for (const std::string resource : { "/sync", "/async" }) {
+      const std::string s = exchange(
+         server.port(),
+         "GET " + resource + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+      BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+      BOOST_CHECK(s.substr(s.find("\r\n\r\n") + 4) == region);
+   }
+
+   // Chunked responses send the region as a single chunk.
+   const std::string s = exchange(
+      server.port(),
+      "GET /chunked HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   std::ostringstream expected;
+   expected << std::hex << length << "\r\n" << region << "\r\n0\r\n\r\n";
+   BOOST_CHECK(s.substr(s.find("\r\n\r\n") + 4) == expected.str());
+   close(fd);
+}
+
+BOOST_AUTO_TEST_CASE(StaticFileHandler) {
+   char root[] = "/tmp/chunky_staticXXXXXX";
+   BOOST_REQUIRE(mkdtemp(root));
+   const std::string dir(root);
+   const std::string large(4096, 'x');
+   std::ofstream(dir + "/index.html") << "<p>index</p>";
+   std::ofstream(dir + "/app.js") << "var x = 1;";
+   std::ofstream(dir + "/app.js.gz") << "GZIPPED";
+   std::ofstream(dir + "/large.txt") << large;
+
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 404;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   chunky::StaticFiles files(dir, 1 << 20, 1024);
+   server.server().set_route("/static/*file", files);
+
+   auto get = [&](const std::string& resource, const std::string& headers) {
+      return exchange(
+         server.port(),
+         "GET " + resource + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + headers + "\r\n");
+   };
+   auto body = [](const std::string& s) {
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+
+   std::string s = get("/static/", "");
+   BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+   BOOST_CHECK(s.find("Content-Type: text/html") != std::string::npos);
+   BOOST_CHECK_EQUAL(body(s), "<p>index</p>");
+
+   // Revalidation with the returned ETag.
+   s = get("/static/app.js", "");
+   BOOST_CHECK_EQUAL(body(s), "var x = 1;");
+   BOOST_CHECK(s.find("Content-Encoding") == std::string::npos);
+   const size_t etag = s.find("ETag: ") + 6;
+   const std::string tag = s.substr(etag, s.find("\r\n", etag) - etag);
+   s = get("/static/app.js", "If-None-Match: " + tag + "\r\n");
+   BOOST_CHECK_EQUAL(s.substr(0, 25), "HTTP/1.1 304 Not Modified");
+   BOOST_CHECK_EQUAL(body(s), "");
+   BOOST_CHECK_EQUAL(files.cache().size(), 22u);
+
+   // Precompressed sibling, unless refused.
+   s = get("/static/app.js", "Accept-Encoding: br, gzip\r\n");
+   BOOST_CHECK(s.find("Content-Encoding: gzip") != std::string::npos);
+   BOOST_CHECK(s.find("Content-Type: application/javascript") != std::string::npos);
+   BOOST_CHECK_EQUAL(body(s), "GZIPPED");
+   s = get("/static/app.js", "Accept-Encoding: gzip;q=0\r\n");
+   BOOST_CHECK_EQUAL(body(s), "var x = 1;");
+
+   // Larger than the cached file limit.
+   BOOST_CHECK(body(get("/static/large.txt", "")) == large);
+   BOOST_CHECK_EQUAL(files.cache().size(), 29u);
+
+   s = exchange(
+      server.port(),
+      "HEAD /static/large.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+   BOOST_CHECK(s.find("Content-Length: 4096") != std::string::npos);
+   BOOST_CHECK_EQUAL(body(s), "");
+
+   BOOST_CHECK_EQUAL(get("/static/missing", "").substr(0, 22), "HTTP/1.1 404 Not Found");
+   BOOST_CHECK_EQUAL(get("/static/../etc/passwd", "").substr(0, 22), "HTTP/1.1 404 Not Found");
+
+   for (const char* name : { "index.html", "app.js", "app.js.gz", "large.txt" })
+      unlink((dir + "/" + name).c_str());
+   rmdir(root);
+}
+
+BOOST_AUTO_TEST_CASE(ByteRanges) {
+   using detail::parse_ranges;
+   std::vector<detail::ByteRange> ranges;
+   BOOST_CHECK_EQUAL(parse_ranges("bytes=0-99", 1000, ranges), detail::range_satisfiable);
+   BOOST_REQUIRE_EQUAL(ranges.size(), 1u);
+   BOOST_CHECK_EQUAL(ranges[0].first, 0u);
+   BOOST_CHECK_EQUAL(ranges[0].size(), 100u);
+
+   BOOST_CHECK_EQUAL(parse_ranges("bytes=900-, -50 ,500-2000", 1000, ranges), detail::range_satisfiable);
+   BOOST_REQUIRE_EQUAL(ranges.size(), 3u);
+   BOOST_CHECK_EQUAL(ranges[0].last, 999u);
+   BOOST_CHECK_EQUAL(ranges[1].first, 950u);
+   BOOST_CHECK_EQUAL(ranges[2].last, 999u);
+
+   // Unsatisfiable ranges are dropped.
+   BOOST_CHECK_EQUAL(parse_ranges("bytes=1000-,0-0", 1000, ranges), detail::range_satisfiable);
+   BOOST_CHECK_EQUAL(ranges.size(), 1u);
+   BOOST_CHECK_EQUAL(parse_ranges("bytes=1000-2000", 1000, ranges), detail::range_unsatisfiable);
+   BOOST_CHECK_EQUAL(parse_ranges("bytes=-0", 1000, ranges), detail::range_unsatisfiable);
+
+   for (const char* value : { "items=0-1", "bytes=5-1", "bytes=a-", "bytes=", "bytes=1",
+                              "bytes=99999999999999999999-" })
+      BOOST_CHECK_EQUAL(parse_ranges(value, 1000, ranges), detail::range_ignored);
+   BOOST_CHECK_EQUAL(parse_ranges("bytes=0-0,1-1,2-2", 1000, ranges, 2), detail::range_ignored);
+}
+
+BOOST_AUTO_TEST_CASE(RangeRequests) {
+   char root[] = "/tmp/chunky_rangesXXXXXX";
+   BOOST_REQUIRE(mkdtemp(root));
+   const std::string dir(root);
+   std::string content;
+   for (int i = 0; i < 1000; ++i)
+      content += static_cast<char>('a' + i % 26);
+   std::ofstream(dir + "/small.txt") << content;
+   std::ofstream(dir + "/large.txt") << content;
+
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 404;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   server.server().set_route("/*file", chunky::StaticFiles(dir, 1 << 20, 500));
+
+   auto get = [&](const std::string& resource, const std::string& headers) {
+      return exchange(
+         server.port(),
+         "GET " + resource + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + headers + "\r\n");
+   };
+   auto body = [](const std::string& s) {
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+
+   // Cached and sent with send_file().
+   for (const std::string resource : { "/small.txt", "/large.txt" }) {
+      std::string s = get(resource, "Range: bytes=10-19\r\n");
+      BOOST_CHECK_EQUAL(s.substr(0, 28), "HTTP/1.1 206 Partial Content");
+      BOOST_CHECK(s.find("Content-Range: bytes 10-19/1000\r\n") != std::string::npos);
+      BOOST_CHECK_EQUAL(body(s), content.substr(10, 10));
+
+      s = get(resource, "Range: bytes=0-1, -3\r\n");
+      BOOST_CHECK_EQUAL(s.substr(0, 28), "HTTP/1.1 206 Partial Content");
+      const size_t b = s.find("boundary=") + 9;
+      const std::string boundary = s.substr(b, s.find("\r\n", b) - b);
+      const std::string expected =
+         "\r\n--" + boundary + "\r\nContent-Type: text/plain; charset=utf-8\r\n"
+         "Content-Range: bytes 0-1/1000\r\n\r\nab"
+         "\r\n--" + boundary + "\r\nContent-Type: text/plain; charset=utf-8\r\n"
+         "Content-Range: bytes 997-999/1000\r\n\r\n" + content.substr(997) +
+         "\r\n--" + boundary + "--\r\n";
+      BOOST_CHECK_EQUAL(body(s), expected);
+      BOOST_CHECK(s.find("Content-Length: " + std::to_string(expected.size())) != std::string::npos);
+
+      s = get(resource, "Range: bytes=1000-\r\n");
+      BOOST_CHECK_EQUAL(s.substr(0, 12), "HTTP/1.1 416");
+      BOOST_CHECK(s.find("Content-Range: bytes */1000\r\n") != std::string::npos);
+
+      // A stale If-Range gets the full representation.
+      s = get(resource, "Range: bytes=0-1\r\nIf-Range: \"stale\"\r\n");
+      BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+      BOOST_CHECK_EQUAL(body(s), content);
+   }
+
+   unlink((dir + "/small.txt").c_str());
+   unlink((dir + "/large.txt").c_str());
+   rmdir(root);
+}
+
+BOOST_AUTO_TEST_CASE(ChunkedRequest) {
+   // Echo the body, the number of reads and the trailer, or the read
+   // error.
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         std::string body;
+         error_code error;
+         char buffer[4096];
+         size_t n, nReads = 0;
+         while ((n = http->read_some(boost::asio::buffer(buffer), error)) > 0 || !error) {
+            body.append(buffer, n);
+            ++nReads;
+         }
+
+         std::ostringstream os;
+         if (error == boost::asio::error::eof)
+            os << body << ' ' << nReads << ' ' << http->request_header("Checksum", "none");
+         else
+            os << error.message();
+         const std::string response = os.str();
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(response.size());
+         boost::asio::write(*http, boost::asio::buffer(response));
+
+         // Discarding the rest of a malformed body fails.
+         http->finish(error);
+      });
+
+   auto post = [&](const std::string& chunks) {
+      const std::string s = exchange(
+         server.port(),
+         "POST / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+         "Transfer-Encoding: chunked\r\n\r\n" + chunks);
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+
+   // Many small chunks sent at once are delivered by a few reads.
+   std::string chunks, expected;
+   for (int i = 0; i < 200; ++i) {
+      const std::string data = std::to_string(i) + ",";
+      std::ostringstream chunk;
+      chunk << std::hex << data.size() << (i % 2 ? ";ext=1" : "") << "\r\n" << data << "\r\n";
+      chunks += chunk.str();
+      expected += data;
+   }
+   std::string s = post(chunks + "0\r\n\r\n");
+   BOOST_CHECK_EQUAL(s.substr(0, expected.size()), expected);
+   BOOST_CHECK_LE(std::stoi(s.substr(expected.size() + 1)), 3);
+   BOOST_CHECK_EQUAL(s.substr(s.rfind(' ') + 1), "none");
+
+   BOOST_CHECK_EQUAL(post("5\r\nhello\r\n0\r\nChecksum: 42\r\n\r\n"), "hello 1 42");
+   BOOST_CHECK_EQUAL(post("A\r\n0123456789\r\n0\r\n\r\n"), "0123456789 1 none");
+   BOOST_CHECK_EQUAL(post("5x\r\nhello\r\n0\r\n\r\n"), "Invalid chunk length");
+   BOOST_CHECK_EQUAL(post("5\r\nhelloX\r\n0\r\n\r\n"), "Invalid chunk delimiter");
+   BOOST_CHECK_EQUAL(post("11111111111111111\r\n"), "Invalid chunk length");
+}
+
+BOOST_AUTO_TEST_CASE(MaxBodySize) {
+   uint64_t n;
+   BOOST_CHECK(detail::parse_decimal("18446744073709551615", n));
+   BOOST_CHECK_EQUAL(n, 18446744073709551615ull);
+   for (const char* s : { "", "+5", " 5", "5 ", "-1", "0x10", "18446744073709551616" })
+      BOOST_CHECK(!detail::parse_decimal(s, n));
+
+   std::atomic<int> nHandled(0);
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         ++nHandled;
+         std::string body;
+         error_code error;
+         char buffer[64];
+         size_t n;
+         while ((n = http->read_some(boost::asio::buffer(buffer), error)) > 0 || !error)
+            body.append(buffer, n);
+         if (error != boost::asio::error::eof)
+            body = error.message();
+
+         http->response_status() = 200;
+         http->response_headers()["Content-Length"] = std::to_string(body.size());
+         boost::asio::write(*http, boost::asio::buffer(body));
+         http->finish(error);
+      });
+   server.server().set_max_body_size(100);
+
+   auto post = [&](const std::string& headers, const std::string& body) {
+      return exchange(
+         server.port(),
+         "POST / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + headers + "\r\n" + body);
+   };
+
+   // Refused without waiting for the body.
+   std::string s = post("Content-Length: 101\r\nConnection: keep-alive\r\n", "");
+   BOOST_CHECK_EQUAL(s.substr(0, 12), "HTTP/1.1 413");
+   BOOST_CHECK(s.find("Connection: close\r\n") != std::string::npos);
+   BOOST_CHECK_EQUAL(nHandled, 0);
+
+   // A client that sends its body anyway still reads the response
+   // rather than a reset connection.
+   {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::ip::tcp::resolver::query query("localhost", std::to_string(server.port()));
+      boost::asio::connect(socket, resolver.resolve(query));
+
+      const std::string large(1 << 18, 'x');
+      const std::string request =
+         "POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+         std::to_string(large.size()) + "\r\n\r\n" + large;
+      error_code error;
+      boost::asio::write(socket, boost::asio::buffer(request), error);
+      BOOST_CHECK(!error);
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+      boost::asio::streambuf response;
+      boost::asio::read(socket, response, error);
+      BOOST_CHECK_EQUAL(error, boost::asio::error::eof);
+      s.assign(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+      BOOST_CHECK_EQUAL(s.substr(0, 12), "HTTP/1.1 413");
+      BOOST_CHECK_EQUAL(nHandled, 0);
+   }
+
+   const std::string body(100, 'x');
+   s = post("Content-Length: 100\r\n", body);
+   BOOST_CHECK_EQUAL(s.substr(s.find("\r\n\r\n") + 4), body);
+   BOOST_CHECK_EQUAL(nHandled, 1);
+
+   // Malformed lengths close the connection.
+   for (const std::string length : { "+5", " 5x", "99999999999999999999999" })
+      BOOST_CHECK_EQUAL(post("Content-Length: " + length + "\r\n", "hello"), "");
+   BOOST_CHECK_EQUAL(nHandled, 1);
+
+   s = post("Transfer-Encoding: chunked\r\n", "64\r\n" + body + "\r\n1\r\nx\r\n0\r\n\r\n");
+   BOOST_CHECK_EQUAL(s.substr(s.find("\r\n\r\n") + 4), "Request body too large");
+}
+
+#ifdef ZLIB_H
+static std::string decode_chunked(const std::string& body) {
+   std::string result;
+   for (size_t i = 0; ; ) {
+      const size_t n = std::stoul(body.substr(i), nullptr, 16);
+      i = body.find("\r\n", i) + 2;
+      if (!n)
+         return result;
+      result += body.substr(i, n);
+      i += n + 2;
+   }
+}
+
+static std::string inflate(const std::string& data) {
+   z_stream stream = z_stream();
+   BOOST_REQUIRE_EQUAL(inflateInit2(&stream, 15 + 32), Z_OK);
+   stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+   stream.avail_in = data.size();
+   std::string result;
+   std::array<char, 1 << 16> buffer;
+   int status;
+   do {
+      stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+      stream.avail_out = buffer.size();
+      status = inflate(&stream, Z_NO_FLUSH);
+      result.append(buffer.data(), buffer.size() - stream.avail_out);
+   } while (status == Z_OK);
+   BOOST_CHECK_EQUAL(status, Z_STREAM_END);
+   inflateEnd(&stream);
+   return result;
+}
+
+static std::string deflate(const std::string& data, bool gzip) {
+   z_stream stream = z_stream();
+   BOOST_REQUIRE_EQUAL(deflateInit2(&stream, 6, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY), Z_OK);
+   std::string result(deflateBound(&stream, data.size()), '\0');
+   stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+   stream.avail_in = data.size();
+   stream.next_out = reinterpret_cast<Bytef*>(&result[0]);
+   stream.avail_out = result.size();
+   BOOST_CHECK_EQUAL(deflate(&stream, Z_FINISH), Z_STREAM_END);
+   result.resize(stream.total_out);
+   deflateEnd(&stream);
+   return result;
+}
+
+BOOST_AUTO_TEST_CASE(Compression) {
+   std::string json;
+   for (int i = 0; i < 2000; ++i)
+      json += "{\"id\":" + std::to_string(i) + ",\"status\":\"ok\"},";
+
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_headers()["Content-Type"] = "application/json";
+         if (http->request_path() == "/small") {
+            http->response_headers()["Content-Length"] = "2";
+            boost::asio::write(*http, boost::asio::buffer("{}", 2));
+            http->finish();
+            return;
+         }
+
+         // Written in two parts, the second asynchronously.
+         const size_t half = json.size() / 2;
+         boost::asio::write(*http, boost::asio::buffer(json.data(), half));
+         boost::asio::async_write(
+            *http, boost::asio::buffer(json.data() + half, json.size() - half),
+            [=](const error_code& error, size_t) {
+               BOOST_CHECK(!error);
+               http->async_finish([=](const error_code&) { http.get(); });
+            });
+      });
+   HTTP::Compression compression;
+   compression.enabled = true;
+   compression.minimumSize = 100;
+   server.server().set_compression(compression);
+
+   auto get = [&](const std::string& resource, const std::string& headers) {
+      return exchange(
+         server.port(),
+         "GET " + resource + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + headers + "\r\n");
+   };
+   auto body = [](const std::string& s) {
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+
+   for (const std::string encoding : { "gzip", "deflate" }) {
+      const std::string s = get("/", "Accept-Encoding: " + encoding + "\r\n");
+      BOOST_CHECK(s.find("Content-Encoding: " + encoding + "\r\n") != std::string::npos);
+      BOOST_CHECK(s.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+      const std::string compressed = decode_chunked(body(s));
+      BOOST_CHECK_LT(compressed.size(), json.size() / 5);
+      BOOST_CHECK(inflate(compressed) == json);
+   }
+
+   // Not acceptable, or too small.
+   std::string s = get("/", "Accept-Encoding: gzip;q=0\r\n");
+   BOOST_CHECK(s.find("Content-Encoding") == std::string::npos);
+   BOOST_CHECK(decode_chunked(body(s)) == json);
+   s = get("/small", "Accept-Encoding: gzip\r\n");
+   BOOST_CHECK(s.find("Content-Encoding") == std::string::npos);
+   BOOST_CHECK_EQUAL(body(s), "{}");
+
+   // Each write is flushed, so a streamed response reaches the client
+   // as it is written rather than when it ends.
+   server.server().set_handler("/stream", [=](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         boost::asio::async_write(
+            *http, boost::asio::buffer(json),
+            [=](const error_code& error, size_t) {
+               BOOST_CHECK(!error);
+               auto timer = std::make_shared<boost::asio::steady_timer>(http->get_io_service());
+               timer->expires_from_now(std::chrono::seconds(2));
+               timer->async_wait([=](const error_code&) {
+                     http->async_finish([=](const error_code&) { timer.get(); });
+                  });
+            });
+      });
+
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::socket socket(io);
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::connect(
+      socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+   const auto t0 = std::chrono::steady_clock::now();
+   boost::asio::write(
+      socket,
+      boost::asio::buffer(std::string(
+         "GET /stream HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: deflate\r\nConnection: close\r\n\r\n")));
+
+   // Read the head and the first chunk.
+   boost::asio::streambuf response;
+   boost::asio::read_until(socket, response, "\r\n\r\n");
+   const size_t headSize = std::string(
+      boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data())).find("\r\n\r\n") + 4;
+   response.consume(headSize);
+   boost::asio::read_until(socket, response, "\r\n");
+   std::string rest(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+   const size_t chunkSize = std::stoul(rest, nullptr, 16);
+   const size_t chunkStart = rest.find("\r\n") + 2;
+   if (rest.size() < chunkStart + chunkSize) {
+      boost::asio::read(socket, response, boost::asio::transfer_exactly(chunkStart + chunkSize - rest.size()));
+      rest.assign(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+   }
+   BOOST_CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(1));
+
+   z_stream stream = z_stream();
+   BOOST_REQUIRE_EQUAL(inflateInit(&stream), Z_OK);
+   std::string first(json.size(), '\0');
+   stream.next_in = reinterpret_cast<Bytef*>(&rest[chunkStart]);
+   stream.avail_in = chunkSize;
+   stream.next_out = reinterpret_cast<Bytef*>(&first[0]);
+   stream.avail_out = first.size();
+   BOOST_CHECK_EQUAL(::inflate(&stream, Z_SYNC_FLUSH), Z_OK);
+   BOOST_CHECK_EQUAL(stream.avail_out, 0);
+   inflateEnd(&stream);
+   BOOST_CHECK(first == json);
+
+   error_code error;
+   boost::asio::read(socket, response, error);
+}
+
+BOOST_AUTO_TEST_CASE(CompressedSendFile) {
+   // Incompressible, and more than the socket buffers hold.
+   std::string content(32 << 20, 0);
+   std::mt19937 generator;
+   for (auto& c : content)
+      c = static_cast<char>(generator());
+   char path[] = "/tmp/chunky_compressedXXXXXX";
+   const int fd = mkstemp(path);
+   BOOST_REQUIRE(fd >= 0);
+   unlink(path);
+   BOOST_REQUIRE_EQUAL(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         if (http->request_path() == "/small") {
+            http->response_headers()["Content-Length"] = "2";
+            boost::asio::write(*http, boost::asio::buffer("{}", 2));
+            http->finish();
+            return;
+         }
+
+         http->async_send_file(fd, 0, content.size(), [=](const error_code& error, size_t n) {
+               BOOST_CHECK(!error);
+               BOOST_CHECK_EQUAL(n, content.size());
+               http->async_finish([=](const error_code&) { http.get(); });
+            });
+      },
+      [](SimpleHTTPServer& server) {
+         HTTP::Compression compression;
+         compression.enabled = true;
+         server.set_compression(compression);
+         server.set_pipeline_depth(2);
+      });
+
+   // Request the file but leave it unread while another connection
+   // is served by the same thread.
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::socket socket(io);
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::connect(
+      socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+   boost::asio::write(
+      socket,
+      boost::asio::buffer(std::string(
+         "GET /big HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\nConnection: close\r\n\r\n")));
+   std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+   auto small = std::async(std::launch::async, [&]() {
+         return exchange(
+            server.port(),
+            "GET /small HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+      });
+   BOOST_REQUIRE(small.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+   BOOST_CHECK_EQUAL(small.get().substr(0, 15), "HTTP/1.1 200 OK");
+
+   boost::asio::streambuf response;
+   error_code error;
+   boost::asio::read(socket, response, error);
+   const std::string s(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+   BOOST_CHECK(s.find("Content-Encoding: gzip\r\n") != std::string::npos);
+   BOOST_CHECK(inflate(decode_chunked(s.substr(s.find("\r\n\r\n") + 4))) == content);
+   close(fd);
+}
+
+BOOST_AUTO_TEST_CASE(CompressedStaticFiles) {
+   char root[] = "/tmp/chunky_compressedstaticXXXXXX";
+   BOOST_REQUIRE(mkdtemp(root));
+   const std::string dir(root);
+   std::string text;
+   for (int i = 0; i < 1000; ++i)
+      text += "line " + std::to_string(i) + "\n";
+   std::ofstream(dir + "/log.txt") << text;
+
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 404;
+         http->response_headers()["Content-Length"] = "0";
+         http->finish();
+      });
+   server.server().set_route("/*file", chunky::StaticFiles(dir));
+   HTTP::Compression compression;
+   compression.enabled = true;
+   server.server().set_compression(compression);
+
+   auto get = [&](const std::string& headers) {
+      return exchange(
+         server.port(),
+         "GET /log.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + headers + "\r\n");
+   };
+   auto header = [](const std::string& s, const std::string& name) {
+      const auto i = s.find("\r\n" + name + ": ");
+      if (i == std::string::npos)
+         return std::string();
+      const auto value = i + name.size() + 4;
+      return s.substr(value, s.find("\r\n", value) - value);
+   };
+
+   // The identity response is rangeable with a strong ETag.
+   std::string s = get("");
+   const std::string identityTag = header(s, "ETag");
+   BOOST_CHECK_EQUAL(header(s, "Accept-Ranges"), "bytes");
+
+   // The compressed one has its own ETag and no Accept-Ranges.
+   s = get("Accept-Encoding: gzip\r\n");
+   BOOST_CHECK_EQUAL(header(s, "Content-Encoding"), "gzip");
+   const std::string gzipTag = header(s, "ETag");
+   BOOST_CHECK(!gzipTag.empty() && gzipTag != identityTag);
+   BOOST_CHECK_EQUAL(header(s, "Accept-Ranges"), "");
+   BOOST_CHECK(inflate(decode_chunked(s.substr(s.find("\r\n\r\n") + 4))) == text);
+
+   // Resuming with the compressed ETag does not splice in identity
+   // bytes; the full response is sent instead.
+   s = get("Accept-Encoding: gzip\r\nRange: bytes=100-\r\nIf-Range: " + gzipTag + "\r\n");
+   BOOST_CHECK_EQUAL(s.substr(0, 15), "HTTP/1.1 200 OK");
+   BOOST_CHECK(inflate(decode_chunked(s.substr(s.find("\r\n\r\n") + 4))) == text);
+   s = get("Range: bytes=100-\r\nIf-Range: " + identityTag + "\r\n");
+   BOOST_CHECK_EQUAL(s.substr(0, 12), "HTTP/1.1 206");
+
+   // Revalidating the compressed response answers with its ETag.
+   s = get("Accept-Encoding: gzip\r\nIf-None-Match: " + gzipTag + "\r\n");
+   BOOST_CHECK_EQUAL(s.substr(0, 12), "HTTP/1.1 304");
+   BOOST_CHECK_EQUAL(header(s, "ETag"), gzipTag);
+
+   unlink((dir + "/log.txt").c_str());
+   rmdir(root);
+}
+
+BOOST_AUTO_TEST_CASE(Decompression) {
+   std::string metrics;
+   for (int i = 0; i < 20000; ++i)
+      metrics += "cpu.load " + std::to_string(i % 97) + "\n";
+
+   // Echo the decoded body, or the read error.
+   auto respond = [](const std::shared_ptr<HTTP>& http, std::string body, const error_code& error) {
+      if (error != boost::asio::error::eof)
+         body = error.message();
+      http->response_status() = 200;
+      http->response_headers()["Content-Length"] = std::to_string(body.size());
+      boost::asio::write(*http, boost::asio::buffer(body));
+      http->finish();
+   };
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         auto body = std::make_shared<std::string>();
+         auto buffer = std::make_shared<std::array<char, 1000> >();
+         if (http->request_path() == "/async") {
+            auto read = std::make_shared<std::function<void(const error_code&, size_t)> >();
+            *read = [=](const error_code& error, size_t n) {
+               body->append(buffer->data(), n);
+               if (error) {
+                  respond(http, *body, error);
+                  *read = nullptr;
+                  return;
+               }
+               http->async_read_some(boost::asio::buffer(*buffer), *read);
+            };
+            http->async_read_some(boost::asio::buffer(*buffer), *read);
+            return;
+         }
+
+         error_code error;
+         size_t n;
+         while ((n = http->read_some(boost::asio::buffer(*buffer), error)) > 0 || !error)
+            body->append(buffer->data(), n);
+         respond(http, *body, error);
+      });
+   HTTP::Decompression decompression;
+   decompression.enabled = true;
+   decompression.maxSize = metrics.size();
+   server.server().set_decompression(decompression);
+
+   auto post = [&](const std::string& encoding, const std::string& body, bool chunked,
+                   const std::string& resource = "/") {
+      std::ostringstream request;
+      request << "POST " << resource << " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+              << "Content-Encoding: " << encoding << "\r\n";
+      if (chunked) {
+         request << "Transfer-Encoding: chunked\r\n\r\n";
+         for (size_t i = 0; i < body.size(); i += 777) {
+            const std::string chunk = body.substr(i, 777);
+            request << std::hex << chunk.size() << "\r\n" << chunk << "\r\n";
+         }
+         request << "0\r\n\r\n";
+      }
+      else
+         request << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+
+      const std::string s = exchange(server.port(), request.str());
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+
+   BOOST_CHECK(post("gzip", deflate(metrics, true), false) == metrics);
+   BOOST_CHECK(post("deflate", deflate(metrics, false), true) == metrics);
+   BOOST_CHECK(post("gzip", deflate(metrics, true), true, "/async") == metrics);
+   BOOST_CHECK_EQUAL(post("gzip", deflate(metrics + "!", true), true, "/async"), "Request body too large");
+   BOOST_CHECK(post("identity", "plain", false) == "plain");
+
+   BOOST_CHECK_EQUAL(post("gzip", deflate(metrics + "!", true), false), "Request body too large");
+   const std::string compressed = deflate(metrics, true);
+   BOOST_CHECK_EQUAL(post("gzip", compressed.substr(0, compressed.size() / 2), false), "Invalid Content-Encoding");
+   BOOST_CHECK_EQUAL(post("gzip", "not gzip", true), "Invalid Content-Encoding");
 }
+#endif